@@ -0,0 +1,430 @@
+// Benchmarks for the library sosemanuk.h
+//
+// Every phase is measured on its own: key schedule, IV setup, keystream
+// generation and encryption for message sizes from 16 B to 64 MiB.
+// Each measurement is warmed up, then repeated; the report gives the median
+// and the 90th/99th percentiles of the time per operation, the cycles per byte
+// (TSC) and the throughput (MiB/s) of the median. The block kernels round the
+// size up to whole blocks; both rates are per byte actually produced.
+//
+// Usage: ./bench [-f text|csv|json] [-r repetitions] [-s max_size] [-i scalar|sse2|avx2|avx512]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#include "sosemanuk.h"
+#include "sosemanuk_keycache.h"
+
+#define MIN_SIZE	16
+#define MAX_SIZE	(64 << 20)
+
+// One repetition lasts at least this long, so the timer resolution does not matter
+#define MIN_REP_NS	2000000
+#define WARMUP_REPS	3
+#define DEFAULT_REPS	21
+
+enum format { FORMAT_TEXT, FORMAT_CSV, FORMAT_JSON };
+
+// State shared by the measured functions
+struct bench_data {
+	struct sosemanuk_context ctx;
+	struct sosemanuk_key kctx;
+	struct sosemanuk_context_x8 xctx;
+	struct sosemanuk_context_x16 xctx16;
+	struct sosemanuk_keycache *cache;
+	uint8_t key[32];
+	uint8_t iv[16];
+	uint8_t *in;
+	uint8_t *out;
+	size_t size;
+};
+
+// Runs "iters" operations of one benchmark
+typedef void (*bench_fn)(struct bench_data *d, size_t iters);
+
+struct result {
+	const char *name;
+	size_t size;
+	size_t bytes;		// bytes actually produced per operation: size rounded up to whole blocks
+	size_t iters;
+	int reps;
+	double median_ns;
+	double p90_ns;
+	double p99_ns;
+	double min_ns;
+	double median_cycles;
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+now_cycles(void)
+{
+#if HAVE_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void
+bench_key_setup(struct bench_data *d, size_t iters)
+{
+	for (size_t i = 0; i < iters; i++)
+		sosemanuk_set_key(&d->kctx, d->key, 32);
+}
+
+static void
+bench_iv_setup(struct bench_data *d, size_t iters)
+{
+	for (size_t i = 0; i < iters; i++) {
+		d->iv[15] = (uint8_t)i;
+		sosemanuk_set_iv(&d->ctx, &d->kctx, d->iv, 16);
+	}
+}
+
+static void
+bench_key_and_iv(struct bench_data *d, size_t iters)
+{
+	for (size_t i = 0; i < iters; i++)
+		sosemanuk_set_key_and_iv(&d->ctx, d->key, 32, d->iv, 16);
+}
+
+// Same setup for a key already in the key cache
+static void
+bench_key_iv_cached(struct bench_data *d, size_t iters)
+{
+	for (size_t i = 0; i < iters; i++)
+		sosemanuk_keycache_set_key_and_iv(d->cache, &d->ctx, d->key, 32, d->iv, 16);
+}
+
+static void
+bench_keystream(struct bench_data *d, size_t iters)
+{
+	size_t blocks = (d->size + 79) / 80;
+
+	for (size_t i = 0; i < iters; i++) {
+		for (size_t j = 0; j < blocks; j++)
+			sosemanuk_generate_keystream(&d->ctx, (uint32_t *)d->out + (j % 4096) * 20);
+	}
+}
+
+static void
+bench_keystream_blocks(struct bench_data *d, size_t iters)
+{
+	size_t blocks = (d->size + 79) / 80;
+
+	for (size_t i = 0; i < iters; i++) {
+		for (size_t j = 0; j < blocks; j += 4096)
+			sosemanuk_generate_keystream_blocks(&d->ctx, (uint32_t *)d->out,
+				blocks - j < 4096 ? blocks - j : 4096);
+	}
+}
+
+static void
+bench_keystream_x8(struct bench_data *d, size_t iters)
+{
+	size_t blocks = (d->size + 639) / 640;
+
+	for (size_t i = 0; i < iters; i++) {
+		for (size_t j = 0; j < blocks; j++)
+			sosemanuk_generate_keystream_x8(&d->xctx, (uint32_t *)d->out + (j % 512) * 160);
+	}
+}
+
+static void
+bench_keystream_x16(struct bench_data *d, size_t iters)
+{
+	size_t blocks = (d->size + 1279) / 1280;
+
+	for (size_t i = 0; i < iters; i++) {
+		for (size_t j = 0; j < blocks; j++)
+			sosemanuk_generate_keystream_x16(&d->xctx16, (uint32_t *)d->out + (j % 256) * 320);
+	}
+}
+
+static void
+bench_crypt(struct bench_data *d, size_t iters)
+{
+	for (size_t i = 0; i < iters; i++)
+		sosemanuk_crypt(&d->ctx, d->in, (uint32_t)d->size, d->out);
+}
+
+static void
+bench_crypt_bulk(struct bench_data *d, size_t iters)
+{
+	for (size_t i = 0; i < iters; i++)
+		sosemanuk_crypt_bulk(&d->ctx, d->in, d->size, d->out);
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of a sorted array
+static double
+percentile(const double *sorted, int n, double p)
+{
+	int rank = (int)(p / 100.0 * n + 0.999999);
+
+	if (rank < 1)
+		rank = 1;
+	if (rank > n)
+		rank = n;
+	return sorted[rank - 1];
+}
+
+/*
+ * Warm up, pick the iteration count, then time "reps" repetitions
+ * unit - bytes produced per call of the kernel (1 for the crypt calls)
+*/
+static void
+run(struct bench_data *d, const char *name, bench_fn fn, size_t size, size_t unit, int reps, struct result *r)
+{
+	double *ns = malloc(sizeof(double) * reps);
+	double *cycles = malloc(sizeof(double) * reps);
+	size_t iters = 1;
+	uint64_t t;
+
+	if (!ns || !cycles) {
+		perror("malloc");
+		exit(1);
+	}
+
+	d->size = size;
+
+	// Calibration doubles as warm-up: grow until one repetition is long enough
+	for (;;) {
+		t = now_ns();
+		fn(d, iters);
+		t = now_ns() - t;
+		if (t >= MIN_REP_NS)
+			break;
+		iters *= (t > 0 && MIN_REP_NS / t < 16) ? MIN_REP_NS / t + 1 : 16;
+	}
+
+	for (int i = 0; i < WARMUP_REPS; i++)
+		fn(d, iters);
+
+	for (int i = 0; i < reps; i++) {
+		uint64_t c = now_cycles();
+
+		t = now_ns();
+		fn(d, iters);
+		t = now_ns() - t;
+		c = now_cycles() - c;
+
+		ns[i] = (double)t / iters;
+		cycles[i] = (double)c / iters;
+	}
+
+	qsort(ns, reps, sizeof(double), compare_double);
+	qsort(cycles, reps, sizeof(double), compare_double);
+
+	r->name = name;
+	r->size = size;
+	r->bytes = (size + unit - 1) / unit * unit;
+	r->iters = iters;
+	r->reps = reps;
+	r->median_ns = percentile(ns, reps, 50);
+	r->p90_ns = percentile(ns, reps, 90);
+	r->p99_ns = percentile(ns, reps, 99);
+	r->min_ns = ns[0];
+	r->median_cycles = percentile(cycles, reps, 50);
+
+	free(ns);
+	free(cycles);
+}
+
+static void
+print_result(const struct result *r, enum format format, int first)
+{
+	// Per byte actually produced: a 16-byte request to a block kernel still costs a whole block
+	double cpb = r->bytes ? r->median_cycles / r->bytes : 0;
+	double mibps = r->bytes ? r->bytes / r->median_ns * 1e9 / (1024.0 * 1024.0) : 0;
+
+	switch (format) {
+	case FORMAT_TEXT:
+		printf("%-14s %10zu %10zu %12.1f %12.1f %12.1f %12.1f %10.2f %10.1f\n", r->name, r->size, r->bytes,
+			r->median_ns, r->p90_ns, r->p99_ns, r->median_cycles, cpb, mibps);
+		break;
+	case FORMAT_CSV:
+		printf("%s,%s,%zu,%zu,%zu,%d,%.1f,%.1f,%.1f,%.1f,%.1f,%.3f,%.1f\n", r->name, sosemanuk_impl_name(),
+			r->size, r->bytes, r->iters, r->reps, r->median_ns, r->p90_ns, r->p99_ns, r->min_ns,
+			r->median_cycles, cpb, mibps);
+		break;
+	case FORMAT_JSON:
+		printf("%s\n    {\"benchmark\": \"%s\", \"impl\": \"%s\", \"size\": %zu, \"bytes\": %zu, \"iterations\": %zu, "
+			"\"reps\": %d, \"median_ns\": %.1f, \"p90_ns\": %.1f, \"p99_ns\": %.1f, \"min_ns\": %.1f, "
+			"\"median_cycles\": %.1f, \"cycles_per_byte\": %.3f, \"mib_per_s\": %.1f}",
+			first ? "" : ",", r->name, sosemanuk_impl_name(), r->size, r->bytes, r->iters, r->reps,
+			r->median_ns, r->p90_ns, r->p99_ns, r->min_ns, r->median_cycles, cpb, mibps);
+		break;
+	}
+}
+
+static void
+usage(const char *program_name)
+{
+	printf("Usage: %s [-f text|csv|json] [-r repetitions] [-s max_size] [-i scalar|sse2|avx2|avx512]\n",
+		program_name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	enum format format = FORMAT_TEXT;
+	int reps = DEFAULT_REPS;
+	size_t max_size = MAX_SIZE;
+	struct bench_data d;
+	struct result r;
+	int first = 1;
+
+	for (int i = 1; i < argc; i++) {
+		if (i + 1 >= argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		if (strcmp(argv[i], "-f") == 0) {
+			i++;
+			if (strcmp(argv[i], "text") == 0)
+				format = FORMAT_TEXT;
+			else if (strcmp(argv[i], "csv") == 0)
+				format = FORMAT_CSV;
+			else if (strcmp(argv[i], "json") == 0)
+				format = FORMAT_JSON;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-r") == 0) {
+			reps = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0) {
+			max_size = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-i") == 0) {
+			i++;
+			unsigned int features;
+			if (strcmp(argv[i], "scalar") == 0)
+				features = 0;
+			else if (strcmp(argv[i], "sse2") == 0)
+				features = SOSEMANUK_CPU_SSE2;
+			else if (strcmp(argv[i], "avx2") == 0)
+				features = SOSEMANUK_CPU_SSE2 | SOSEMANUK_CPU_AVX2;
+			else if (strcmp(argv[i], "avx512") == 0)
+				features = SOSEMANUK_CPU_SSE2 | SOSEMANUK_CPU_AVX2 | SOSEMANUK_CPU_AVX512;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			sosemanuk_cpu_select(features);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (reps < 1 || max_size < MIN_SIZE || max_size > MAX_SIZE) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	memset(&d, 0, sizeof(d));
+	for (int i = 0; i < 32; i++)
+		d.key[i] = (uint8_t)(i * 17);
+	for (int i = 0; i < 16; i++)
+		d.iv[i] = (uint8_t)(i * 29);
+
+	// Output buffer is also the keystream scratch area (4096 blocks = 320 KiB)
+	size_t buflen = max_size > 4096 * 80 ? max_size : 4096 * 80;
+	if (posix_memalign((void **)&d.in, 64, buflen) || posix_memalign((void **)&d.out, 64, buflen)) {
+		perror("posix_memalign");
+		return 1;
+	}
+	memset(d.in, 0x5A, buflen);
+	memset(d.out, 0, buflen);
+
+	sosemanuk_set_key(&d.kctx, d.key, 32);
+	sosemanuk_set_iv(&d.ctx, &d.kctx, d.iv, 16);
+	d.cache = sosemanuk_keycache_create(1024);
+	if (!d.cache) {
+		fprintf(stderr, "Cannot create the key cache\n");
+		return 1;
+	}
+	{
+		struct sosemanuk_context lanes[16];
+		struct sosemanuk_context *lane_ptr[16];
+		for (int n = 0; n < 16; n++) {
+			d.iv[0] = (uint8_t)n;
+			sosemanuk_set_iv(&lanes[n], &d.kctx, d.iv, 16);
+			lane_ptr[n] = &lanes[n];
+		}
+		sosemanuk_load_x8(&d.xctx, lane_ptr);
+		sosemanuk_load_x16(&d.xctx16, lane_ptr);
+	}
+
+	if (format == FORMAT_TEXT) {
+		printf("Sosemanuk benchmark, implementation: %s, %d repetitions%s\n\n", sosemanuk_impl_name(), reps,
+			HAVE_TSC ? "" : " (no TSC: cycles are 0)");
+		printf("%-14s %10s %10s %12s %12s %12s %12s %10s %10s\n", "benchmark", "size", "bytes", "median_ns",
+			"p90_ns", "p99_ns", "cycles", "cyc/byte", "MiB/s");
+	} else if (format == FORMAT_CSV) {
+		printf("benchmark,impl,size,bytes,iterations,reps,median_ns,p90_ns,p99_ns,min_ns,median_cycles,"
+			"cycles_per_byte,mib_per_s\n");
+	} else {
+		printf("[");
+	}
+
+	run(&d, "key_setup", bench_key_setup, 0, 1, reps, &r);
+	print_result(&r, format, first);
+	first = 0;
+	run(&d, "iv_setup", bench_iv_setup, 0, 1, reps, &r);
+	print_result(&r, format, first);
+	run(&d, "key_iv_setup", bench_key_and_iv, 0, 1, reps, &r);
+	print_result(&r, format, first);
+	run(&d, "key_iv_cached", bench_key_iv_cached, 0, 1, reps, &r);
+	print_result(&r, format, first);
+
+	for (size_t size = MIN_SIZE; size <= max_size; size *= 4) {
+		run(&d, "keystream", bench_keystream, size, 80, reps, &r);
+		print_result(&r, format, first);
+		run(&d, "keystream_blk", bench_keystream_blocks, size, 80, reps, &r);
+		print_result(&r, format, first);
+		run(&d, "keystream_x8", bench_keystream_x8, size, 640, reps, &r);
+		print_result(&r, format, first);
+		run(&d, "keystream_x16", bench_keystream_x16, size, 1280, reps, &r);
+		print_result(&r, format, first);
+		run(&d, "crypt", bench_crypt, size, 1, reps, &r);
+		print_result(&r, format, first);
+		run(&d, "crypt_bulk", bench_crypt_bulk, size, 1, reps, &r);
+		print_result(&r, format, first);
+	}
+
+	if (format == FORMAT_JSON)
+		printf("\n]\n");
+
+	sosemanuk_keycache_destroy(d.cache);
+	free(d.in);
+	free(d.out);
+	return 0;
+}
@@ -1,54 +1,16 @@
-// This program tests the library sosemanuk.h
+// This program tests the library sosemanuk.h (timings are measured by bench.c)
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
-#include <sys/time.h>
 
 #include "sosemanuk.h"
-
-// Struct for time value
-struct timeval t1, t2;
+#include "sosemanuk_hex.h"
 
 uint8_t key[32];
 uint8_t iv[16];
 
-static void
-time_start(void)
-{
-	gettimeofday(&t1, NULL);
-}
-
-static uint32_t
-time_stop(void)
-{
-	gettimeofday(&t2, NULL);
-
-	t2.tv_sec -= t1.tv_sec;
-	t2.tv_usec -= t1.tv_usec;
-
-	if(t2.tv_usec < 0) {
-		t2.tv_sec--;
-		t2.tv_usec += 1000000;
-	}
-
-	return (t2.tv_sec * 1000 + t2.tv_usec/1000);
-}
-
-void hex_to_bytes(const char *hex, uint8_t *bytes, size_t len) {
-    for (size_t i = 0; i < len; i++) {
-        sscanf(hex + 2 * i, "%2hhx", &bytes[i]);
-    }
-}
-
-void bytes_to_hex(const uint8_t *bytes, size_t len, char *hex) {
-    for (size_t i = 0; i < len; i++) {
-        sprintf(hex + 2 * i, "%02X", bytes[i]);
-    }
-    hex[2 * len] = '\0';
-}
-
 int
 main()
 {
@@ -62,7 +24,6 @@ main()
 	char line[1024];
 	int vector_count = 0;
 	int pass_count = 0;
-	uint32_t total_time = 0;
 
 	while (fgets(line, sizeof(line), fp)) {
 		if (strstr(line, "Test Vector")) {
@@ -71,18 +32,18 @@ main()
 
 			// Read Key
 			fgets(line, sizeof(line), fp);
-			char key_hex[65];
+			char key_hex[65] = { 0 };
 			sscanf(line, "Key: %64s", key_hex);
-			hex_to_bytes(key_hex, key, 32);
-			bytes_to_hex(key, 32, key_hex);
+			int parsed = (sosemanuk_hex_decode(key, key_hex, strlen(key_hex)) == 32);
+			sosemanuk_hex_encode(key_hex, key, 32);
 			printf("Key: %s\n", key_hex);
 
 			// Read IV
 			fgets(line, sizeof(line), fp);
-			char iv_hex[33];
+			char iv_hex[33] = { 0 };
 			sscanf(line, "IV: %32s", iv_hex);
-			hex_to_bytes(iv_hex, iv, 16);
-			bytes_to_hex(iv, 16, iv_hex);
+			parsed &= (sosemanuk_hex_decode(iv, iv_hex, strlen(iv_hex)) == 16);
+			sosemanuk_hex_encode(iv_hex, iv, 16);
 			printf("IV: %s\n", iv_hex);
 
 			// Skip Keystream
@@ -90,18 +51,19 @@ main()
 
 			// Read Plaintext
 			fgets(line, sizeof(line), fp);
-			char pt_text[17];
+			char pt_text[17] = { 0 };
 			sscanf(line, "Plaintext: %16[^\n]", pt_text);
+			// The file holds the text up to its first zero byte, the rest of the 16 bytes is zero
 			uint8_t plaintext[16];
 			memcpy(plaintext, pt_text, 16);
 			printf("Plaintext (text): %.*s\n", 16, plaintext);
 
 			// Read Ciphertext expected
 			fgets(line, sizeof(line), fp);
-			char ct_hex[33];
+			char ct_hex[33] = { 0 };
 			sscanf(line, "Ciphertext: %32s", ct_hex);
 			uint8_t ct_expected[16];
-			hex_to_bytes(ct_hex, ct_expected, 16);
+			parsed &= (sosemanuk_hex_decode(ct_expected, ct_hex, strlen(ct_hex)) == 16);
 			printf("Ciphertext Expected (hex): %s\n", ct_hex);
 
 			// Skip Recovered
@@ -109,6 +71,11 @@ main()
 			// Skip blank
 			fgets(line, sizeof(line), fp);
 
+			if (!parsed) {
+				printf("Error: bad hex field in vector %d\n", vector_count);
+				continue;
+			}
+
 			// Set key and IV for verification
 			if (sosemanuk_set_key_and_iv(&ctx, key, 32, iv, 16)) {
 				printf("Error setting key/iv for vector %d\n", vector_count);
@@ -121,7 +88,7 @@ main()
 			uint8_t keystream_bytes[80];
 			memcpy(keystream_bytes, keystream, 80);
 			char keystream_hex[161];
-			bytes_to_hex(keystream_bytes, 80, keystream_hex);
+			sosemanuk_hex_encode(keystream_hex, keystream_bytes, 80);
 			printf("Keystream: %s\n", keystream_hex);
 			uint8_t ciphertext[16];
 			for (int j = 0; j < 16; j++) {
@@ -129,7 +96,7 @@ main()
 			}
 
 			char computed_hex[33];
-			bytes_to_hex(ciphertext, 16, computed_hex);
+			sosemanuk_hex_encode(computed_hex, ciphertext, 16);
 			printf("Ciphertext Computed (hex): %s\n", computed_hex);
 
 			// Compare ciphertext
@@ -147,7 +114,7 @@ main()
 				recovered[j] = ciphertext[j] ^ keystream_bytes[j];
 			}
 			// char recovered_hex[33];
-			// bytes_to_hex(recovered, 16, recovered_hex);
+			// sosemanuk_hex_encode(recovered_hex, recovered, 16);
 			printf("Recovered Plaintext Expected (text): %.*s\n", 16, plaintext);
 			// printf("Recovered Plaintext Computed (hex): %s\n", recovered_hex);
 			printf("Recovered Plaintext Computed (text): %.*s\n", 16, recovered);
@@ -166,27 +133,6 @@ main()
 			} else {
 				printf("Overall Result: FAIL\n");
 			}
-
-			// Measure time for multiple encryptions (reset context each time for fair timing)
-			const int loops = 10000;
-			time_start();
-			for (int i = 0; i < loops; i++) {
-				sosemanuk_set_key_and_iv(&ctx, key, 32, iv, 16);
-				sosemanuk_generate_keystream(&ctx, keystream);
-				memcpy(keystream_bytes, keystream, 80);
-				for (int j = 0; j < 16; j++) {
-					ciphertext[j] = plaintext[j] ^ keystream_bytes[j];
-				}
-			}
-			uint32_t time_ms = time_stop();
-			total_time += time_ms;
-
-			// Performance
-			size_t total_bytes = (size_t)loops * 16;
-			double time_sec = time_ms / 1000.0;
-			double mbps = (total_bytes / (1024.0 * 1024.0)) / time_sec;
-			printf("Time for %d encryptions: %u ms\n", loops, time_ms);
-			printf("Throughput: %.2f MB/s\n", mbps);
 		}
 	}
 
@@ -196,13 +142,6 @@ main()
 	printf("Total vectors: %d\n", vector_count);
 	printf("Passed: %d\n", pass_count);
 	printf("Failed: %d\n", vector_count - pass_count);
-	printf("Total time: %u ms\n", total_time);
-	if (total_time > 0) {
-		size_t total_bytes = (size_t)vector_count * 10000 * 16;
-		double time_sec = total_time / 1000.0;
-		double mbps = (total_bytes / (1024.0 * 1024.0)) / time_sec;
-		printf("Overall Throughput: %.2f MB/s\n", mbps);
-	}
 
 	return 0;
 }
@@ -0,0 +1,1358 @@
+// Self-test of the library sosemanuk.h
+//
+// Known answers: the two test vectors of the Sosemanuk specification (40-bit
+// and 128-bit keys), the padding rules of short keys and IVs, and the hex codec
+// of the tools against printf formatting.
+// Regression digests: FNV-1a of the first 4 MiB of the two keystreams. They
+// were recorded from this code once its first 64 bytes matched the
+// specification, not taken from the eSTREAM long vectors: they catch a change
+// of output, not an error present when they were recorded.
+// Differential tests: every optimized path (crypt, crypt_bulk, streaming,
+// iovec, compact state, multi-block generation, x4/x8/x16 lanes, batch IV setup,
+// key cache, index, batch pool, reservoir, encryption server) is compared with the scalar reference - one
+// sosemanuk_generate_keystream per block and a byte XOR - at every length up
+// to a few blocks, at every alignment of the input and output, and on buffers
+// of several MiB. The differential tests run once for every implementation the
+// CPU supports (sosemanuk_cpu_select).
+//
+// Usage: ./selftest [-s seed] [-m megabytes]
+// Exit status: 0 (all tests pass), 1 (a test failed)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "sosemanuk.h"
+#include "sosemanuk_keycache.h"
+#include "sosemanuk_pool.h"
+#include "sosemanuk_hex.h"
+#include "sosemanuk_index.h"
+#include "sosemanuk_batch.h"
+#include "sosemanuk_reservoir.h"
+#include "sosemanuk_server.h"
+#include "sosemanuk_client.h"
+#include "sosemanuk_stats.h"
+
+// Every length from 0 to SHORT_MAX is tested at every alignment up to ALIGN_MAX
+#define SHORT_MAX	400
+#define ALIGN_MAX	16
+
+// Bytes after the output that must stay untouched
+#define GUARD		64
+#define GUARD_BYTE	0xA5
+
+// Keystream covered by the regression digests
+#define KAT_LONG	(4 << 20)
+
+// Differential tests run on DEFAULT_MB MiB, more than the non-temporal threshold of crypt_bulk
+#define DEFAULT_MB	5
+
+#define LANES		16
+
+// A test vector of the specification, and the regression digest (FNV-1a) of its first KAT_LONG bytes
+struct kat {
+	const char *name;
+	uint8_t key[32];
+	int keylen;
+	uint8_t iv[16];
+	int ivlen;
+	uint8_t output[64];
+	uint64_t digest;
+};
+
+static const struct kat kats[] = {
+	{
+		"spec_tv1",
+		{ 0xA7, 0xC0, 0x83, 0xFE, 0xB7 }, 5,
+		{ 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+		  0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF }, 16,
+		{ 0xFE, 0x81, 0xD2, 0x16, 0x2C, 0x9A, 0x10, 0x0D, 0x04, 0x89, 0x5C, 0x45, 0x4A, 0x77, 0x51, 0x5B,
+		  0xBE, 0x6A, 0x43, 0x1A, 0x93, 0x5C, 0xB9, 0x0E, 0x22, 0x21, 0xEB, 0xB7, 0xEF, 0x50, 0x23, 0x28,
+		  0x94, 0x35, 0x39, 0x49, 0x2E, 0xFF, 0x63, 0x10, 0xC8, 0x71, 0x05, 0x4C, 0x28, 0x89, 0xCC, 0x72,
+		  0x8F, 0x82, 0xE8, 0x6B, 0x1A, 0xFF, 0xF4, 0x33, 0x4B, 0x61, 0x27, 0xA1, 0x3A, 0x15, 0x5C, 0x75 },
+		0x2CE01AC1D7EAB863ULL
+	},
+	{
+		"spec_tv2",
+		{ 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+		  0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF }, 16,
+		{ 0x88, 0x99, 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF,
+		  0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77 }, 16,
+		{ 0xFA, 0x61, 0xDB, 0xEB, 0x71, 0x17, 0x81, 0x31, 0xA7, 0x7C, 0x71, 0x4B, 0xD2, 0xEA, 0xBF, 0x4E,
+		  0x13, 0x94, 0x20, 0x7A, 0x25, 0x69, 0x8A, 0xA1, 0x30, 0x8F, 0x2F, 0x06, 0x3A, 0x0F, 0x76, 0x06,
+		  0x04, 0xCF, 0x67, 0x56, 0x9B, 0xA5, 0x9A, 0x3D, 0xFA, 0xD7, 0xF0, 0x01, 0x45, 0xC7, 0x8D, 0x29,
+		  0xC5, 0xFF, 0xE5, 0xF9, 0x64, 0x95, 0x04, 0x86, 0x42, 0x44, 0x51, 0x95, 0x2C, 0x84, 0x03, 0x9D },
+		0x65D67D225C2A0879ULL
+	},
+};
+
+#define KATS	(sizeof(kats) / sizeof(kats[0]))
+
+// Stream under test: key, IV, reference keystream and the expected ciphertext of "in"
+struct stream {
+	uint8_t key[32];
+	int keylen;
+	uint8_t iv[16];
+	int ivlen;
+	size_t len;
+	uint8_t *ks;
+	uint8_t *in;
+	uint8_t *ct;
+};
+
+static uint64_t rng_state;
+static int failed;
+
+// Scratch buffers: len + ALIGN_MAX + GUARD bytes
+static uint8_t *scratch_in;
+static uint8_t *scratch_out;
+
+static uint64_t
+rng(void)
+{
+	// xorshift64*
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+// Random number in [0, n)
+static size_t
+rng_below(size_t n)
+{
+	return n ? (size_t)(rng() % n) : 0;
+}
+
+static void
+rng_fill(uint8_t *p, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		p[i] = (uint8_t)rng();
+}
+
+static uint64_t
+fnv1a(const uint8_t *p, size_t len)
+{
+	uint64_t h = 0xCBF29CE484222325ULL;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001B3ULL;
+	}
+
+	return h;
+}
+
+static void *
+xalloc(size_t len)
+{
+	void *p;
+
+	if (posix_memalign(&p, 64, len)) {
+		perror("posix_memalign");
+		exit(1);
+	}
+
+	return p;
+}
+
+// Reference keystream: one block at a time from the scalar generator
+static void
+ref_keystream(const uint8_t *key, int keylen, const uint8_t *iv, int ivlen, uint8_t *ks, size_t len)
+{
+	struct sosemanuk_context ctx;
+	uint32_t block[20];
+
+	sosemanuk_set_key_and_iv(&ctx, key, keylen, iv, ivlen);
+
+	for (size_t i = 0; i < len; i += 80) {
+		sosemanuk_generate_keystream(&ctx, block);
+		memcpy(ks + i, block, len - i < 80 ? len - i : 80);
+	}
+}
+
+static void
+ref_xor(uint8_t *out, const uint8_t *in, const uint8_t *ks, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		out[i] = in[i] ^ ks[i];
+}
+
+static void
+report(const char *name, int bad)
+{
+	if (bad) {
+		printf("  %-16s FAIL (%d cases)\n", name, bad);
+		failed = 1;
+	} else {
+		printf("  %-16s ok\n", name);
+	}
+}
+
+// Compare an output with the expected bytes and check the guard after it
+static int
+expect(const char *name, const uint8_t *got, const uint8_t *want, size_t len, size_t param, int *bad)
+{
+	size_t i;
+
+	for (i = 0; i < len && got[i] == want[i]; i++)
+		;
+	if (i == len) {
+		for (; i < len + GUARD && got[i] == GUARD_BYTE; i++)
+			;
+		if (i == len + GUARD)
+			return 0;
+	}
+
+	if (*bad < 3)
+		printf("  %s: length %zu, case %zu: %s at byte %zu\n", name, len, param,
+			i < len ? "mismatch" : "write past the end", i);
+	(*bad)++;
+
+	return 1;
+}
+
+// Output buffer at offset "align", filled with the guard pattern
+static uint8_t *
+prepare_out(size_t align, size_t len)
+{
+	memset(scratch_out, GUARD_BYTE, align + len + GUARD);
+	return scratch_out + align;
+}
+
+static uint8_t *
+prepare_in(const struct stream *s, size_t align, size_t len)
+{
+	memcpy(scratch_in + align, s->in, len);
+	return scratch_in + align;
+}
+
+static void
+stream_start(const struct stream *s, struct sosemanuk_context *ctx)
+{
+	sosemanuk_set_key_and_iv(ctx, s->key, s->keylen, s->iv, s->ivlen);
+}
+
+// Specification vectors, regression digests and the first bytes through sosemanuk_crypt
+static void
+test_kat(void)
+{
+	uint8_t *ks = xalloc(KAT_LONG), zero[64], out[64];
+	struct sosemanuk_context ctx;
+	int bad;
+
+	memset(zero, 0, sizeof(zero));
+
+	for (size_t i = 0; i < KATS; i++) {
+		const struct kat *k = &kats[i];
+
+		bad = 0;
+		ref_keystream(k->key, k->keylen, k->iv, k->ivlen, ks, KAT_LONG);
+		if (memcmp(ks, k->output, 64) != 0)
+			bad++;
+		if (fnv1a(ks, KAT_LONG) != k->digest) {
+			printf("  %s: digest %016llX\n", k->name, (unsigned long long)fnv1a(ks, KAT_LONG));
+			bad++;
+		}
+
+		sosemanuk_set_key_and_iv(&ctx, k->key, k->keylen, k->iv, k->ivlen);
+		sosemanuk_crypt(&ctx, zero, 64, out);
+		if (memcmp(out, k->output, 64) != 0)
+			bad++;
+
+		report(k->name, bad);
+	}
+
+	free(ks);
+}
+
+// Short keys are padded with 0x01 then zeros, short IVs with zeros; every setup agrees
+static void
+test_short(void)
+{
+	uint8_t key[32], iv[16], pkey[32], piv[16], want[160], got[160];
+	struct sosemanuk_context ctx;
+	struct sosemanuk_key kctx;
+	struct sosemanuk_state st;
+	int bad = 0;
+
+	rng_fill(key, sizeof(key));
+	rng_fill(iv, sizeof(iv));
+
+	for (int keylen = 1; keylen <= 32; keylen++) {
+		for (int ivlen = 1; ivlen <= 16; ivlen++) {
+			memset(pkey, 0, sizeof(pkey));
+			memcpy(pkey, key, keylen);
+			if (keylen < 32)
+				pkey[keylen] = 0x01;
+			memset(piv, 0, sizeof(piv));
+			memcpy(piv, iv, ivlen);
+
+			ref_keystream(pkey, 32, piv, 16, want, sizeof(want));
+
+			ref_keystream(key, keylen, iv, ivlen, got, sizeof(got));
+			if (memcmp(got, want, sizeof(want)) != 0)
+				bad++;
+
+			sosemanuk_set_key(&kctx, key, keylen);
+			sosemanuk_set_iv(&ctx, &kctx, iv, ivlen);
+			sosemanuk_generate_keystream_blocks(&ctx, (uint32_t *)got, 2);
+			if (memcmp(got, want, sizeof(want)) != 0)
+				bad++;
+
+			sosemanuk_state_set_iv(&st, &kctx, iv, ivlen);
+			sosemanuk_state_generate_keystream_blocks(&st, (uint32_t *)got, 2);
+			if (memcmp(got, want, sizeof(want)) != 0)
+				bad++;
+		}
+	}
+
+	if (sosemanuk_set_key_and_iv(&ctx, key, 0, iv, 16) == 0 || sosemanuk_set_key_and_iv(&ctx, key, 33, iv, 16) == 0 ||
+		sosemanuk_set_key_and_iv(&ctx, key, 32, iv, 0) == 0 || sosemanuk_set_key_and_iv(&ctx, key, 32, iv, 17) == 0)
+		bad++;
+
+	report("short_key_iv", bad);
+}
+
+// Hex codec: every length around the vector width, both cases, bad digits at every position, streaming
+static void
+test_hex(void)
+{
+	static const char bad_chars[] = { 'g', 'G', 'x', '/', ':', '@', '`', ' ', '\n', '\0', (char)0x80, (char)0xC1, (char)0xE6 };
+	enum { LONG = 100003 };
+	uint8_t *bytes = xalloc(LONG), *got = xalloc(LONG);
+	char *want = xalloc(2 * LONG + 1), *hex = xalloc(2 * LONG + 1), *text;
+	struct sosemanuk_hex_decoder dec;
+	size_t lens[] = { 0, 1, 15, 16, 17, 31, 32, 33, 47, 48, 100, 255, LONG }, textlen;
+	ssize_t n;
+	FILE *fp;
+	int bad = 0;
+
+	rng_fill(bytes, LONG);
+
+	for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+		size_t len = lens[l];
+
+		for (size_t i = 0; i < len; i++)
+			snprintf(want + 2 * i, 3, "%02X", bytes[i]);
+		want[2 * len] = '\0';
+
+		memset(hex, 0x55, 2 * len + 1);
+		sosemanuk_hex_encode(hex, bytes, len);
+		if (memcmp(hex, want, 2 * len + 1) != 0)
+			bad++;
+
+		// Lowercase and mixed case decode the same
+		for (int c = 0; c < 3; c++) {
+			for (size_t i = 0; i < 2 * len; i++) {
+				if (hex[i] >= 'A' && (c == 1 || (c == 2 && rng() % 2)))
+					hex[i] |= 0x20;
+			}
+			memset(got, 0, len);
+			if (sosemanuk_hex_decode(got, hex, 2 * len) != (ssize_t)len || memcmp(got, bytes, len) != 0)
+				bad++;
+		}
+
+		// Pieces of random size, odd cuts included
+		sosemanuk_hex_decoder_init(&dec);
+		for (size_t pos = 0, out = 0, cut; pos < 2 * len; pos += cut) {
+			cut = 1 + rng_below(len < 40 ? 3 : 97);
+			if (cut > 2 * len - pos)
+				cut = 2 * len - pos;
+			n = sosemanuk_hex_decode_update(&dec, got + out, hex + pos, cut);
+			if (n < 0) {
+				bad++;
+				break;
+			}
+			out += n;
+			if (pos + cut == 2 * len && (out != len || memcmp(got, bytes, len) != 0))
+				bad++;
+		}
+		if (sosemanuk_hex_decode_final(&dec) != 0)
+			bad++;
+
+		fp = open_memstream(&text, &textlen);
+		if (!fp || sosemanuk_hex_write(fp, bytes, len) != 0 || fclose(fp) != 0 ||
+			textlen != 2 * len || memcmp(text, want, textlen) != 0)
+			bad++;
+		free(text);
+	}
+
+	// 48 bytes: vector blocks and a scalar tail
+	sosemanuk_hex_encode(hex, bytes, 48);
+	for (size_t i = 0; i < 96; i++) {
+		for (size_t c = 0; c < sizeof(bad_chars); c++) {
+			char save = hex[i];
+
+			hex[i] = bad_chars[c];
+			if (sosemanuk_hex_decode(got, hex, 96) != -1)
+				bad++;
+			sosemanuk_hex_decoder_init(&dec);
+			if (sosemanuk_hex_decode_update(&dec, got, hex, i + 1) != -1)
+				bad++;
+			hex[i] = save;
+		}
+	}
+
+	// Odd lengths
+	sosemanuk_hex_decoder_init(&dec);
+	if (sosemanuk_hex_decode(got, hex, 95) != -1 || sosemanuk_hex_decode_update(&dec, got, hex, 95) != 47 ||
+		sosemanuk_hex_decode_final(&dec) != -1)
+		bad++;
+
+	free(bytes);
+	free(got);
+	free(want);
+	free(hex);
+
+	report("hex", bad);
+}
+
+// sosemanuk_crypt and sosemanuk_crypt_bulk: every short length and alignment, in place, large buffers
+static void
+test_crypt(const struct stream *s, int bulk)
+{
+	const char *name = bulk ? "crypt_bulk" : "crypt";
+	static const size_t large[] = { 4095, 65536 + 7, (1 << 20) + 13 };
+	struct sosemanuk_context ctx;
+	uint8_t *in, *out;
+	int bad = 0;
+
+	for (size_t len = 0; len <= SHORT_MAX; len++) {
+		for (size_t align = 0; align < ALIGN_MAX; align++) {
+			size_t oalign = (align * 5 + len) % ALIGN_MAX;
+
+			stream_start(s, &ctx);
+			in = prepare_in(s, align, len);
+			out = prepare_out(oalign, len);
+			if (bulk)
+				sosemanuk_crypt_bulk(&ctx, in, len, out);
+			else
+				sosemanuk_crypt(&ctx, in, (uint32_t)len, out);
+			expect(name, out, s->ct, len, align, &bad);
+		}
+
+		// In place
+		stream_start(s, &ctx);
+		out = prepare_out(len % ALIGN_MAX, len);
+		memcpy(out, s->in, len);
+		if (bulk)
+			sosemanuk_crypt_bulk(&ctx, out, len, out);
+		else
+			sosemanuk_crypt(&ctx, out, (uint32_t)len, out);
+		expect(name, out, s->ct, len, ALIGN_MAX, &bad);
+	}
+
+	for (size_t i = 0; i <= sizeof(large) / sizeof(large[0]); i++) {
+		size_t len = i < sizeof(large) / sizeof(large[0]) ? large[i] : s->len;
+
+		if (len > s->len)
+			continue;
+		stream_start(s, &ctx);
+		in = prepare_in(s, i, len);
+		out = prepare_out(ALIGN_MAX - 1 - i, len);
+		if (bulk)
+			sosemanuk_crypt_bulk(&ctx, in, len, out);
+		else
+			sosemanuk_crypt(&ctx, in, (uint32_t)len, out);
+		expect(name, out, s->ct, len, i, &bad);
+	}
+
+	// Calls on whole blocks continue the stream
+	stream_start(s, &ctx);
+	out = prepare_out(0, 80 * 100);
+	for (size_t pos = 0, n; pos < 80 * 100; pos += n) {
+		n = 80 * (1 + rng_below(7));
+		if (n > 80 * 100 - pos)
+			n = 80 * 100 - pos;
+		if (bulk)
+			sosemanuk_crypt_bulk(&ctx, s->in + pos, n, out + pos);
+		else
+			sosemanuk_crypt(&ctx, s->in + pos, (uint32_t)n, out + pos);
+	}
+	expect(name, out, s->ct, 80 * 100, 0, &bad);
+
+	report(name, bad);
+}
+
+// sosemanuk_stream_crypt: random fragments give the output of one call
+static void
+test_stream_crypt(const struct stream *s)
+{
+	struct sosemanuk_context ctx;
+	size_t len = s->len < (1 << 20) ? s->len : (1 << 20);
+	uint8_t *out;
+	int bad = 0;
+
+	for (int round = 0; round < 8; round++) {
+		stream_start(s, &ctx);
+		out = prepare_out(round, len);
+
+		for (size_t pos = 0, n; pos < len; pos += n) {
+			// Mostly sub-block fragments, sometimes large ones
+			n = rng_below(8) ? rng_below(200) : rng_below(100000);
+			if (n > len - pos)
+				n = len - pos;
+			sosemanuk_stream_crypt(&ctx, s->in + pos, n, out + pos);
+		}
+		expect("stream_crypt", out, s->ct, len, round, &bad);
+	}
+
+	report("stream_crypt", bad);
+}
+
+// Cut [0, len) in up to max random segments (empty ones included)
+static int
+random_iov(struct iovec *iov, int max, uint8_t *base, size_t len)
+{
+	size_t pos = 0, n;
+	int cnt = 0;
+
+	while (pos < len || cnt == 0) {
+		if (cnt == max - 1)
+			n = len - pos;
+		else
+			n = rng_below(4) ? rng_below(300) : rng_below(len - pos + 1);
+		if (n > len - pos)
+			n = len - pos;
+		iov[cnt].iov_base = base + pos;
+		iov[cnt].iov_len = n;
+		cnt++;
+		pos += n;
+	}
+
+	return cnt;
+}
+
+// sosemanuk_crypt_iov: in and out cut differently, and in place
+static void
+test_crypt_iov(const struct stream *s)
+{
+	struct iovec in[64], out[64];
+	struct sosemanuk_context ctx;
+	size_t len;
+	uint8_t *dst;
+	int incnt, outcnt, bad = 0;
+
+	for (int round = 0; round < 200; round++) {
+		len = rng_below(round < 100 ? 2000 : 200000);
+		if (len > s->len)
+			len = s->len;
+		dst = prepare_out(0, len);
+
+		stream_start(s, &ctx);
+		incnt = random_iov(in, 64, (uint8_t *)s->in, len);
+		outcnt = random_iov(out, 64, dst, len);
+		if (sosemanuk_crypt_iov(&ctx, in, incnt, out, outcnt) != 0)
+			bad++;
+		expect("crypt_iov", dst, s->ct, len, round, &bad);
+
+		dst = prepare_out(0, len);
+		memcpy(dst, s->in, len);
+		stream_start(s, &ctx);
+		incnt = random_iov(in, 64, dst, len);
+		if (sosemanuk_crypt_iov(&ctx, in, incnt, NULL, 0) != 0)
+			bad++;
+		expect("crypt_iov", dst, s->ct, len, round, &bad);
+	}
+
+	// Output shorter than the input
+	if (len > 0) {
+		stream_start(s, &ctx);
+		in[0].iov_base = (uint8_t *)s->in;
+		in[0].iov_len = len;
+		out[0].iov_base = dst;
+		out[0].iov_len = len - 1;
+		if (sosemanuk_crypt_iov(&ctx, in, 1, out, 1) != -1)
+			bad++;
+	}
+
+	report("crypt_iov", bad);
+}
+
+// sosemanuk_generate_keystream_blocks on a context and on a compact state
+static void
+test_blocks(const struct stream *s)
+{
+	struct sosemanuk_context ctx;
+	struct sosemanuk_key kctx;
+	struct sosemanuk_state st;
+	size_t blocks = s->len / 80 < 20000 ? s->len / 80 : 20000;
+	uint8_t *out;
+	int bad = 0;
+
+	for (int state = 0; state < 2; state++) {
+		stream_start(s, &ctx);
+		sosemanuk_set_key(&kctx, s->key, s->keylen);
+		sosemanuk_state_set_iv(&st, &kctx, s->iv, s->ivlen);
+		out = prepare_out(0, blocks * 80);
+
+		for (size_t pos = 0, n; pos < blocks; pos += n) {
+			n = rng_below(4) ? rng_below(20) : rng_below(3000);
+			if (n > blocks - pos)
+				n = blocks - pos;
+			if (state)
+				sosemanuk_state_generate_keystream_blocks(&st, (uint32_t *)(out + pos * 80), n);
+			else
+				sosemanuk_generate_keystream_blocks(&ctx, (uint32_t *)(out + pos * 80), n);
+		}
+		expect(state ? "state_blocks" : "keystream_blocks", out, s->ks, blocks * 80, 0, &bad);
+	}
+
+	report("keystream_blocks", bad);
+}
+
+// Compact state: sosemanuk_state_crypt, export and import against a context
+static void
+test_state(const struct stream *s)
+{
+	uint8_t raw[SOSEMANUK_STATE_BYTES];
+	struct sosemanuk_context ctx;
+	struct sosemanuk_key kctx;
+	struct sosemanuk_state st, st2;
+	uint8_t *out;
+	size_t len;
+	int bad = 0;
+
+	sosemanuk_set_key(&kctx, s->key, s->keylen);
+
+	for (len = 0; len <= SHORT_MAX; len++) {
+		sosemanuk_state_set_iv(&st, &kctx, s->iv, s->ivlen);
+		out = prepare_out(len % ALIGN_MAX, len);
+		sosemanuk_state_crypt(&st, prepare_in(s, (len * 3) % ALIGN_MAX, len), len, out);
+		expect("state_crypt", out, s->ct, len, 0, &bad);
+	}
+
+	// Whole blocks, then the state moves through export/import and into a context
+	len = s->len;
+	sosemanuk_state_set_iv(&st, &kctx, s->iv, s->ivlen);
+	out = prepare_out(0, len);
+	for (size_t pos = 0, n; pos < len; pos += n) {
+		n = 80 * (rng_below(3) ? rng_below(10) : rng_below(5000));
+		if (n >= len - pos)
+			n = len - pos;
+
+		switch (rng_below(3)) {
+		case 0:
+			sosemanuk_state_crypt(&st, s->in + pos, n, out + pos);
+			break;
+		case 1:
+			sosemanuk_state_export(&st, raw);
+			sosemanuk_state_import(&st2, raw);
+			sosemanuk_state_crypt(&st2, s->in + pos, n, out + pos);
+			st = st2;
+			break;
+		default:
+			sosemanuk_state_export(&st, raw);
+			stream_start(s, &ctx);
+			sosemanuk_import_state(&ctx, raw);
+			sosemanuk_crypt_bulk(&ctx, s->in + pos, n, out + pos);
+			sosemanuk_export_state(&ctx, raw);
+			sosemanuk_state_import(&st, raw);
+			break;
+		}
+	}
+	expect("state_crypt", out, s->ct, len, 1, &bad);
+
+	report("state", bad);
+}
+
+// Reference keystreams of LANES streams: the stream under test with iv[0] ^= lane
+static void
+lane_streams(const struct stream *s, uint8_t iv[LANES][16], uint8_t **ks, size_t len)
+{
+	for (int n = 0; n < LANES; n++) {
+		memcpy(iv[n], s->iv, 16);
+		iv[n][0] ^= (uint8_t)n;
+		ref_keystream(s->key, s->keylen, iv[n], s->ivlen, ks[n], len);
+	}
+}
+
+// x4, x8 and x16 kernels: lanes start at different positions and go back to the scalar code
+static void
+test_lanes(const struct stream *s)
+{
+	enum { BLOCKS = 64 };
+	struct sosemanuk_context lane[LANES], *ctx[LANES];
+	struct sosemanuk_context_x4 x4;
+	struct sosemanuk_context_x8 x8;
+	struct sosemanuk_context_x16 x16;
+	uint32_t keystream[20 * LANES];
+	uint8_t iv[LANES][16], *ks[LANES], got[LANES][BLOCKS * 80];
+	size_t pos[LANES];
+	int bad = 0;
+
+	for (int n = 0; n < LANES; n++) {
+		ks[n] = xalloc(BLOCKS * 80);
+		ctx[n] = &lane[n];
+	}
+	lane_streams(s, iv, ks, BLOCKS * 80);
+
+	for (int width = 4; width <= LANES; width *= 2) {
+		for (int round = 0; round < 4; round++) {
+			// Scalar blocks first, lanes out of step
+			for (int n = 0; n < width; n++) {
+				sosemanuk_set_key_and_iv(&lane[n], s->key, s->keylen, iv[n], s->ivlen);
+				for (pos[n] = 0; pos[n] < 80 * (size_t)((n + round) % 3); pos[n] += 80)
+					sosemanuk_generate_keystream(&lane[n], (uint32_t *)(got[n] + pos[n]));
+			}
+
+			if (width == 4)
+				sosemanuk_load_x4(&x4, ctx);
+			else if (width == 8)
+				sosemanuk_load_x8(&x8, ctx);
+			else
+				sosemanuk_load_x16(&x16, ctx);
+
+			for (int b = 0; b < 40; b++) {
+				struct sosemanuk_stats before, after;
+
+				sosemanuk_stats_thread(&before);
+				if (width == 4)
+					sosemanuk_generate_keystream_x4(&x4, keystream);
+				else if (width == 8)
+					sosemanuk_generate_keystream_x8(&x8, keystream);
+				else
+					sosemanuk_generate_keystream_x16(&x16, keystream);
+				sosemanuk_stats_thread(&after);
+
+				// With STATS=1 one call counts one block per lane, whatever the kernel
+				if (sosemanuk_stats_enabled() &&
+				    (after.count[SOSEMANUK_PHASE_KEYSTREAM] - before.count[SOSEMANUK_PHASE_KEYSTREAM] != (uint64_t)width ||
+				     after.bytes[SOSEMANUK_PHASE_KEYSTREAM] - before.bytes[SOSEMANUK_PHASE_KEYSTREAM] != 80 * (uint64_t)width))
+					bad++;
+
+				// x16 output is one contiguous block per lane
+				for (int n = 0; n < width; n++) {
+					for (int i = 0; i < 20; i++)
+						memcpy(got[n] + pos[n] + 4 * i,
+							&keystream[width == 16 ? 20 * n + i : i * width + n], 4);
+					pos[n] += 80;
+				}
+			}
+
+			if (width == 4)
+				sosemanuk_store_x4(&x4, ctx);
+			else if (width == 8)
+				sosemanuk_store_x8(&x8, ctx);
+			else
+				sosemanuk_store_x16(&x16, ctx);
+
+			for (int n = 0; n < width; n++) {
+				for (; pos[n] < BLOCKS * 80; pos[n] += 80)
+					sosemanuk_generate_keystream(&lane[n], (uint32_t *)(got[n] + pos[n]));
+				if (memcmp(got[n], ks[n], BLOCKS * 80) != 0)
+					bad++;
+			}
+		}
+	}
+
+	for (int n = 0; n < LANES; n++)
+		free(ks[n]);
+
+	report("lanes_x4_x8_x16", bad);
+}
+
+// Keys of the key cache test: every length, recurring in a random order
+#define CACHE_KEYS	64
+#define CACHE_CALLS	4000
+
+struct cache_test {
+	struct sosemanuk_keycache *cache;
+	uint8_t key[CACHE_KEYS][32];
+	int keylen[CACHE_KEYS];
+	uint8_t iv[16];
+	int ivlen;
+	uint8_t want[CACHE_KEYS][160];
+	uint64_t seed;
+	int bad;
+};
+
+// CACHE_CALLS setups through the cache, each checked against the scalar keystream
+static void *
+cache_thread(void *arg)
+{
+	struct cache_test *t = arg;
+	struct sosemanuk_context ctx;
+	struct sosemanuk_key kctx, ref;
+	uint8_t got[160];
+	uint64_t x = t->seed;
+
+	for (int i = 0; i < CACHE_CALLS; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		int k = (int)(x % CACHE_KEYS);
+
+		if (i % 2) {
+			if (sosemanuk_keycache_set_key_and_iv(t->cache, &ctx, t->key[k], t->keylen[k], t->iv, t->ivlen) != 0)
+				t->bad++;
+			sosemanuk_generate_keystream_blocks(&ctx, (uint32_t *)got, 2);
+			if (memcmp(got, t->want[k], sizeof(got)) != 0)
+				t->bad++;
+		} else {
+			sosemanuk_set_key(&ref, t->key[k], t->keylen[k]);
+			if (sosemanuk_keycache_get(t->cache, &kctx, t->key[k], t->keylen[k]) < 0 ||
+				memcmp(&kctx, &ref, sizeof(ref)) != 0)
+				t->bad++;
+		}
+	}
+
+	return NULL;
+}
+
+// Key cache: hits, evictions and concurrent lookups give the keystream of sosemanuk_set_key_and_iv
+static void
+test_keycache(const struct stream *s)
+{
+	enum { THREADS = 4 };
+	struct cache_test t[THREADS];
+	struct sosemanuk_keycache_stats st;
+	struct sosemanuk_context ctx;
+	pthread_t thread[THREADS];
+	int bad = 0;
+
+	memset(&t[0], 0, sizeof(t[0]));
+	memcpy(t[0].key[0], s->key, s->keylen);
+	t[0].keylen[0] = s->keylen;
+	for (int k = 1; k < CACHE_KEYS; k++) {
+		t[0].keylen[k] = 1 + k % 32;
+		rng_fill(t[0].key[k], 32);
+	}
+	memcpy(t[0].iv, s->iv, 16);
+	t[0].ivlen = s->ivlen;
+	for (int k = 0; k < CACHE_KEYS; k++)
+		ref_keystream(t[0].key[k], t[0].keylen[k], t[0].iv, t[0].ivlen, t[0].want[k], 160);
+
+	// Room for every key: one miss per key, then only hits
+	t[0].cache = sosemanuk_keycache_create(4 * CACHE_KEYS);
+	t[0].seed = 1;
+	cache_thread(&t[0]);
+	for (int k = 0; k < CACHE_KEYS; k++)
+		sosemanuk_keycache_set_key_and_iv(t[0].cache, &ctx, t[0].key[k], t[0].keylen[k], t[0].iv, t[0].ivlen);
+	sosemanuk_keycache_stats(t[0].cache, &st);
+	if (st.misses != CACHE_KEYS || st.hits != CACHE_CALLS || st.evictions != 0 || st.entries != CACHE_KEYS)
+		bad++;
+	if (sosemanuk_keycache_get(t[0].cache, &(struct sosemanuk_key){ 0 }, s->key, 33) != -1 ||
+		sosemanuk_keycache_set_key_and_iv(t[0].cache, &ctx, s->key, s->keylen, s->iv, 0) != -1)
+		bad++;
+	bad += t[0].bad;
+	sosemanuk_keycache_destroy(t[0].cache);
+
+	// Fewer entries than keys, several threads: constant eviction
+	t[0].cache = sosemanuk_keycache_create(8);
+	t[0].bad = 0;
+	for (int i = 0; i < THREADS; i++) {
+		if (i > 0)
+			memcpy(&t[i], &t[0], sizeof(t[0]));
+		t[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+		pthread_create(&thread[i], NULL, cache_thread, &t[i]);
+	}
+	for (int i = 0; i < THREADS; i++) {
+		pthread_join(thread[i], NULL);
+		bad += t[i].bad;
+	}
+	sosemanuk_keycache_stats(t[0].cache, &st);
+	if (st.hits + st.misses != THREADS * CACHE_CALLS || st.evictions == 0 || st.entries > 16)
+		bad++;
+	sosemanuk_keycache_destroy(t[0].cache);
+
+	report("keycache", bad);
+}
+
+// sosemanuk_set_iv_batch: every count, short IVs
+static void
+test_iv_batch(const struct stream *s)
+{
+	enum { COUNT = 31 };
+	static const int ivlens[] = { 16, 12, 8, 1 };
+	struct sosemanuk_context lane[COUNT], *ctx[COUNT];
+	struct sosemanuk_key kctx;
+	uint8_t ivs[COUNT][16], want[160], got[160];
+	const uint8_t *iv[COUNT];
+	int bad = 0;
+
+	sosemanuk_set_key(&kctx, s->key, s->keylen);
+
+	for (int i = 0; i < COUNT; i++) {
+		rng_fill(ivs[i], 16);
+		iv[i] = ivs[i];
+		ctx[i] = &lane[i];
+	}
+
+	for (size_t l = 0; l < sizeof(ivlens) / sizeof(ivlens[0]); l++) {
+		for (size_t n = 1; n <= COUNT; n++) {
+			memset(lane, 0, sizeof(lane));
+			if (sosemanuk_set_iv_batch(ctx, &kctx, iv, ivlens[l], n) != 0)
+				bad++;
+
+			for (size_t i = 0; i < COUNT; i++) {
+				if (i >= n) {
+					// Contexts past n are not touched
+					if (lane[i].keylen != 0)
+						bad++;
+					continue;
+				}
+				ref_keystream(s->key, s->keylen, iv[i], ivlens[l], want, sizeof(want));
+				sosemanuk_generate_keystream_blocks(&lane[i], (uint32_t *)got, 2);
+				if (memcmp(got, want, sizeof(want)) != 0)
+					bad++;
+			}
+		}
+	}
+
+	report("set_iv_batch", bad);
+}
+
+// Checkpoint index: random reads after one pass, and after a save and load
+static void
+test_index(const struct stream *s)
+{
+	struct sosemanuk_index idx, idx2;
+	struct sosemanuk_key kctx;
+	struct sosemanuk_state st;
+	size_t len = s->len < (2 << 20) ? s->len : (2 << 20);
+	uint8_t *saved, *out;
+	int bad = 0;
+
+	sosemanuk_set_key(&kctx, s->key, s->keylen);
+	sosemanuk_state_set_iv(&st, &kctx, s->iv, s->ivlen);
+	sosemanuk_index_init(&idx, 7);
+
+	out = prepare_out(0, len);
+	for (size_t pos = 0, n; pos < len; pos += n) {
+		n = 80 * rng_below(2000);
+		if (n >= len - pos)
+			n = len - pos;
+		if (sosemanuk_index_crypt(&idx, &st, s->in + pos, n, out + pos) != 0)
+			bad++;
+	}
+	expect("index_crypt", out, s->ct, len, 0, &bad);
+
+	saved = xalloc(sosemanuk_index_size(&idx));
+	sosemanuk_index_save(&idx, saved);
+	if (sosemanuk_index_load(&idx2, saved, sosemanuk_index_size(&idx)) != 0)
+		bad++;
+
+	for (int round = 0; round < 2000; round++) {
+		size_t offset = rng_below(len);
+		size_t n = rng_below(2) ? rng_below(200) : rng_below(len - offset + 1);
+
+		if (n > len - offset)
+			n = len - offset;
+		out = prepare_out(round % ALIGN_MAX, n);
+		if (sosemanuk_index_crypt_at(round & 1 ? &idx2 : &idx, offset, s->in + offset, n, out) != 0)
+			bad++;
+		expect("index_crypt_at", out, s->ct + offset, n, offset, &bad);
+	}
+
+	// Past the end of the covered stream
+	if (sosemanuk_index_crypt_at(&idx, idx.blocks * 80, s->in, 1, scratch_out) != -1)
+		bad++;
+
+	free(saved);
+	sosemanuk_index_free(&idx);
+	sosemanuk_index_free(&idx2);
+
+	report("index", bad);
+}
+
+// Batch pool: running contexts and new streams, small jobs grouped on the lanes
+static void
+test_batch(const struct stream *s)
+{
+	enum { JOBS = 64, JOB_MAX = 100000 };
+	struct sosemanuk_batch_pool *pool;
+	struct sosemanuk_batch *batch;
+	struct sosemanuk_job jobs[JOBS];
+	struct sosemanuk_context ctx[JOBS];
+	struct sosemanuk_key kctx;
+	uint8_t ivs[JOBS][16], *out, *want;
+	int bad = 0;
+
+	pool = sosemanuk_batch_pool_create(4);
+	if (!pool) {
+		report("batch", 1);
+		return;
+	}
+
+	out = xalloc(JOBS * JOB_MAX);
+	want = xalloc(JOB_MAX);
+	sosemanuk_set_key(&kctx, s->key, s->keylen);
+
+	for (int round = 0; round < 4; round++) {
+		memset(jobs, 0, sizeof(jobs));
+		for (int i = 0; i < JOBS; i++) {
+			rng_fill(ivs[i], 16);
+			jobs[i].iv = ivs[i];
+			jobs[i].ivlen = 16;
+			jobs[i].buf = s->in;
+			jobs[i].out = out + (size_t)i * JOB_MAX;
+			// Mostly small jobs, which are grouped 8 per task
+			jobs[i].buflen = rng_below(4) ? rng_below(2049) : rng_below(JOB_MAX + 1);
+			if (rng_below(4) == 0) {
+				sosemanuk_set_key_and_iv(&ctx[i], s->key, s->keylen, ivs[i], 16);
+				jobs[i].ctx = &ctx[i];
+			} else {
+				jobs[i].key = &kctx;
+			}
+		}
+
+		batch = sosemanuk_batch_submit(pool, jobs, JOBS, NULL, NULL);
+		if (!batch || sosemanuk_batch_wait(batch) != 0)
+			bad++;
+
+		for (int i = 0; i < JOBS; i++) {
+			ref_keystream(s->key, s->keylen, ivs[i], 16, want, jobs[i].buflen);
+			ref_xor(want, s->in, want, jobs[i].buflen);
+			if (jobs[i].status != 0 || memcmp(jobs[i].out, want, jobs[i].buflen) != 0)
+				bad++;
+		}
+	}
+
+	sosemanuk_batch_pool_destroy(pool);
+	free(out);
+	free(want);
+
+	report("batch", bad);
+}
+
+// Context pool: pooled contexts work and come back wiped, foreign pointers are refused
+static void
+test_pool(const struct stream *s)
+{
+	enum { COUNT = 3 };
+	struct sosemanuk_pool *pool;
+	struct sosemanuk_context *ctx[COUNT], local, *heap;
+	size_t len = s->len < 4096 ? s->len : 4096;
+	uint8_t *out = xalloc(len);
+	int bad = 0;
+
+	pool = sosemanuk_pool_create(1);
+	heap = malloc(sizeof(*heap));
+	if (!pool || !heap) {
+		report("pool", 1);
+		free(heap);
+		free(out);
+		return;
+	}
+
+	for (int i = 0; i < COUNT; i++) {
+		ctx[i] = sosemanuk_pool_acquire(pool);
+		if (!ctx[i]) {
+			report("pool", 1);
+			return;
+		}
+		sosemanuk_set_key_and_iv(ctx[i], s->key, s->keylen, s->iv, s->ivlen);
+	}
+
+	sosemanuk_crypt(ctx[1], s->in, len, out);
+	if (memcmp(out, s->ct, len) != 0)
+		bad++;
+
+	// Neither in a slab of the pool nor on a context boundary
+	if (sosemanuk_pool_release(pool, &local) != -1 || sosemanuk_pool_release(pool, heap) != -1 ||
+	    sosemanuk_pool_release(pool, (struct sosemanuk_context *)((uint8_t *)ctx[0] + 8)) != -1)
+		bad++;
+
+	for (int i = COUNT - 1; i >= 0; i--) {
+		if (sosemanuk_pool_release(pool, ctx[i]) != 0)
+			bad++;
+	}
+
+	// A second release would put the context twice on the freelist
+	if (sosemanuk_pool_release(pool, ctx[1]) != -1)
+		bad++;
+
+	// Last released, first handed out again; each context once
+	if (sosemanuk_pool_acquire(pool) != ctx[0] || ctx[0]->keylen != 0 || ctx[0]->r1 != 0)
+		bad++;
+	if (sosemanuk_pool_acquire(pool) != ctx[1] || sosemanuk_pool_acquire(pool) != ctx[2] ||
+	    sosemanuk_pool_acquire(pool) == ctx[1])
+		bad++;
+
+	sosemanuk_pool_destroy(pool);
+	free(heap);
+	free(out);
+
+	report("pool", bad);
+}
+
+// Reservoir: fragments of any size, with the worker ahead of the caller or not
+static void
+test_reservoir(const struct stream *s)
+{
+	struct sosemanuk_reservoir *res;
+	struct sosemanuk_reservoir_stream *rs;
+	struct sosemanuk_key kctx;
+	struct sosemanuk_state st;
+	size_t len = s->len < (1 << 20) ? s->len : (1 << 20);
+	uint8_t *out;
+	int bad = 0;
+
+	res = sosemanuk_reservoir_create(8000, 1 << 20);
+	if (!res) {
+		report("reservoir", 1);
+		return;
+	}
+
+	sosemanuk_set_key(&kctx, s->key, s->keylen);
+
+	for (int round = 0; round < 2; round++) {
+		sosemanuk_state_set_iv(&st, &kctx, s->iv, s->ivlen);
+		rs = sosemanuk_reservoir_attach(res, &st);
+		if (!rs) {
+			bad++;
+			break;
+		}
+
+		out = prepare_out(round, len);
+		for (size_t pos = 0, n; pos < len; pos += n) {
+			n = round ? rng_below(100000) : rng_below(300);
+			if (n > len - pos)
+				n = len - pos;
+			sosemanuk_reservoir_crypt(rs, s->in + pos, n, out + pos);
+		}
+		expect("reservoir", out, s->ct, len, round, &bad);
+
+		sosemanuk_reservoir_detach(rs);
+	}
+
+	sosemanuk_reservoir_destroy(res);
+
+	report("reservoir", bad);
+}
+
+static void *
+server_thread(void *arg)
+{
+	sosemanuk_server_run(arg);
+	return NULL;
+}
+
+// Encryption server: sessions of two clients interleaved, inline and shared-buffer payloads
+static void
+test_server(const struct stream *s)
+{
+	struct sosemanuk_server *srv;
+	struct sosemanuk_client *cl[2];
+	pthread_t thread;
+	size_t len = s->len < (2 << 20) ? s->len : (2 << 20), pos[4], n;
+	uint8_t *out[4], *shm;
+	char path[64];
+	int session[4], bad = 0;
+
+	snprintf(path, sizeof(path), "/tmp/sosemanuk-selftest-%d.sock", (int)getpid());
+	srv = sosemanuk_server_create(path, 2);
+	if (!srv || sosemanuk_server_add_key(srv, "k", s->key, s->keylen) != 0 ||
+		pthread_create(&thread, NULL, server_thread, srv)) {
+		if (srv)
+			sosemanuk_server_destroy(srv);
+		report("server", 1);
+		return;
+	}
+
+	cl[0] = sosemanuk_client_connect(path);
+	cl[1] = sosemanuk_client_connect(path);
+	if (!cl[0] || !cl[1]) {
+		bad++;
+		goto stop;
+	}
+
+	// Two sessions per client on the same stream
+	for (int i = 0; i < 4; i++) {
+		session[i] = sosemanuk_client_open(cl[i & 1], "k", s->iv, s->ivlen);
+		if (session[i] < 0)
+			bad++;
+		out[i] = xalloc(len + GUARD);
+		memset(out[i], GUARD_BYTE, len + GUARD);
+		pos[i] = 0;
+	}
+	if (bad)
+		goto stop;
+
+	for (int done = 0; done < 4; ) {
+		int i = (int)rng_below(4);
+
+		if (pos[i] == len)
+			continue;
+		n = rng_below(8) ? rng_below(3000) : rng_below(300000);
+		if (n > len - pos[i])
+			n = len - pos[i];
+		if (sosemanuk_client_crypt(cl[i & 1], session[i], s->in + pos[i], n, out[i] + pos[i]) != 0)
+			bad++;
+		pos[i] += n;
+		if (pos[i] == len)
+			done++;
+	}
+	for (int i = 0; i < 4; i++)
+		expect("server", out[i], s->ct, len, i, &bad);
+
+	// Zero copy: the shared buffer is encrypted in place
+	session[0] = sosemanuk_client_open(cl[0], "k", s->iv, s->ivlen);
+	shm = sosemanuk_client_buffer(cl[0], 100000);
+	if (!shm || session[0] < 0) {
+		bad++;
+	} else {
+		memcpy(shm, s->in, 100000);
+		if (sosemanuk_client_crypt_shared(cl[0], session[0], 0, 33333) != 0 ||
+			sosemanuk_client_crypt_shared(cl[0], session[0], 33333, 100000 - 33333) != 0 ||
+			memcmp(shm, s->ct, 100000) != 0)
+			bad++;
+		if (sosemanuk_client_crypt_shared(cl[0], session[0], (size_t)1 << 40, 1) != -1)
+			bad++;
+	}
+
+	// Errors leave the connection usable
+	if (sosemanuk_client_open(cl[1], "missing", s->iv, s->ivlen) != -1 ||
+		sosemanuk_client_crypt(cl[1], 1000, s->in, 10, scratch_out) != -1 ||
+		sosemanuk_client_close_session(cl[1], session[1]) != 0 ||
+		sosemanuk_client_close_session(cl[1], session[1]) != -1 ||
+		sosemanuk_client_open(cl[1], "k", s->iv, s->ivlen) < 0)
+		bad++;
+
+	for (int i = 0; i < 4; i++)
+		free(out[i]);
+
+stop:
+	for (int i = 0; i < 2; i++) {
+		if (cl[i])
+			sosemanuk_client_close(cl[i]);
+	}
+	sosemanuk_server_stop(srv);
+	pthread_join(thread, NULL);
+	sosemanuk_server_destroy(srv);
+
+	report("server", bad);
+}
+
+static void
+run_differential(const struct stream *s)
+{
+	test_crypt(s, 0);
+	test_crypt(s, 1);
+	test_stream_crypt(s);
+	test_crypt_iov(s);
+	test_blocks(s);
+	test_state(s);
+	test_lanes(s);
+	test_iv_batch(s);
+	test_keycache(s);
+	test_pool(s);
+	test_index(s);
+	test_batch(s);
+	test_reservoir(s);
+	test_server(s);
+}
+
+static void
+usage(const char *program_name)
+{
+	printf("Usage: %s [-s seed] [-m megabytes]\n", program_name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const unsigned int masks[] = {
+		0,
+		SOSEMANUK_CPU_SSE2,
+		SOSEMANUK_CPU_SSE2 | SOSEMANUK_CPU_AVX2,
+		SOSEMANUK_CPU_SSE2 | SOSEMANUK_CPU_AVX2 | SOSEMANUK_CPU_AVX512,
+	};
+	unsigned int cpu = sosemanuk_cpu_features(), tested = 0;
+	uint64_t seed = 1;
+	size_t megabytes = DEFAULT_MB;
+	struct stream streams[2];
+
+	for (int i = 1; i < argc; i++) {
+		if (i + 1 >= argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		if (strcmp(argv[i], "-s") == 0) {
+			seed = strtoull(argv[++i], NULL, 0);
+		} else if (strcmp(argv[i], "-m") == 0) {
+			megabytes = strtoull(argv[++i], NULL, 0);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (megabytes < 1 || megabytes > 1024) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	rng_state = seed ? seed : 1;
+	printf("Sosemanuk self-test, seed %llu, %zu MiB streams\n", (unsigned long long)seed, megabytes);
+
+	printf("\nKnown answers\n");
+	test_kat();
+	test_short();
+	test_hex();
+
+	// The 40-bit key of the specification, and a random 256-bit key with a 12-byte IV
+	for (int i = 0; i < 2; i++) {
+		struct stream *s = &streams[i];
+
+		memset(s, 0, sizeof(*s));
+		if (i == 0) {
+			memcpy(s->key, kats[0].key, 32);
+			s->keylen = kats[0].keylen;
+			memcpy(s->iv, kats[0].iv, 16);
+			s->ivlen = kats[0].ivlen;
+		} else {
+			rng_fill(s->key, 32);
+			s->keylen = 32;
+			rng_fill(s->iv, 12);
+			s->ivlen = 12;
+		}
+
+		// Not a multiple of 80: the last block is cut
+		s->len = (megabytes << 20) + 37;
+		s->ks = xalloc(s->len);
+		s->in = xalloc(s->len);
+		s->ct = xalloc(s->len);
+		ref_keystream(s->key, s->keylen, s->iv, s->ivlen, s->ks, s->len);
+		rng_fill(s->in, s->len);
+		ref_xor(s->ct, s->in, s->ks, s->len);
+	}
+
+	scratch_in = xalloc(streams[0].len + ALIGN_MAX + GUARD);
+	scratch_out = xalloc(streams[0].len + ALIGN_MAX + GUARD);
+
+	for (size_t m = 0; m < sizeof(masks) / sizeof(masks[0]); m++) {
+		// Masks the CPU cannot run fall back to an implementation already tested
+		unsigned int used = sosemanuk_cpu_select(masks[m]);
+
+		if (m > 0 && used == tested)
+			continue;
+		tested = used;
+
+		for (int i = 0; i < 2; i++) {
+			printf("\nImplementation %s, %d-byte key, %d-byte IV\n", sosemanuk_impl_name(),
+				streams[i].keylen, streams[i].ivlen);
+			run_differential(&streams[i]);
+		}
+	}
+
+	sosemanuk_cpu_select(cpu);
+
+	for (int i = 0; i < 2; i++) {
+		free(streams[i].ks);
+		free(streams[i].in);
+		free(streams[i].ct);
+	}
+	free(scratch_in);
+	free(scratch_out);
+
+	printf("\n%s\n", failed ? "FAILED" : "All tests passed");
+
+	return failed ? 1 : 0;
+}
@@ -5,6 +5,11 @@
  *   encrypt: ./simple_sosemanuk -e input.txt output.bin
  *   decrypt from hex: ./simple_sosemanuk -d input.txt
  *   decrypt from hex: ./simple_sosemanuk -h input.txt
+ *   container encrypt: ./simple_sosemanuk -c key_file input output [chunk_size]
+ *   container decrypt: ./simple_sosemanuk -x key_file input output [offset length]
+ *   binary file (mmap): ./simple_sosemanuk -m input output (-k key_hex -v iv_hex | -f key_file)
+ *   stdin to stdout: ./simple_sosemanuk -s (-k key_hex -v iv_hex | -f key_file)
+ *   batch of records: ./simple_sosemanuk -b input output [threads]
  *
  * Input file format for encryption:
  *   key=<32_byte_hex_key>
@@ -15,121 +20,1086 @@
  *   key=<32_byte_hex_key>
  *   iv=<16_byte_hex_iv>
  *   ciphertext=<hex_data>
+ *
+ * Key file for the container modes: key= and iv= lines as above, bytes 8..15 of the IV zero
+ * Record formats of the batch mode: see batch_crypt
 */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "sosemanuk.h"
+#include "sosemanuk_batch.h"
+#include "sosemanuk_hex.h"
+#include "sosemanuk_keycache.h"
 
-// Function to convert hex string to bytes
-int hex_to_bytes(const char *hex, uint8_t *bytes, size_t max_len, size_t *out_len) {
+// Decode a hex field of exactly len bytes; return -1 on a bad digit or another length
+static int parse_hex_exact(const char *hex, uint8_t *bytes, size_t len) {
     size_t hex_len = strlen(hex);
-    if (hex_len % 2 != 0) return -1;
+    if (hex_len != 2 * len) return -1;
+    return sosemanuk_hex_decode(bytes, hex, hex_len) == (ssize_t)len ? 0 : -1;
+}
+
+// Function to read input file and parse parameters
+// mode: 0=encrypt (plaintext= into *data), 1 and 2=decrypt (ciphertext= into *data), 3=key and iv only
+// Lines may have any length; *data is allocated and freed by the caller
+int parse_input_file(const char *filename, uint8_t *key, uint8_t *iv, uint8_t **data, size_t *data_len, int mode) {
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        perror("Cannot open input file");
+        return -1;
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    int have_key = 0, have_iv = 0, ret = 0;
+
+    while (ret == 0 && getline(&line, &cap, fp) >= 0) {
+        if (strncmp(line, "key=", 4) == 0) {
+            char *ptr = line + 4;
+            ptr[strcspn(ptr, " \t\r\n")] = 0;
+            if (parse_hex_exact(ptr, key, 32) != 0) {
+                printf("Error: Invalid key format\n");
+                ret = -1;
+            }
+            have_key = 1;
+        } else if (strncmp(line, "iv=", 3) == 0) {
+            char *ptr = line + 3;
+            ptr[strcspn(ptr, " \t\r\n")] = 0;
+            if (parse_hex_exact(ptr, iv, 16) != 0) {
+                printf("Error: Invalid IV format\n");
+                ret = -1;
+            }
+            have_iv = 1;
+        } else if ((mode == 0 && strncmp(line, "plaintext=", 10) == 0) ||
+                   ((mode == 1 || mode == 2) && strncmp(line, "ciphertext=", 11) == 0)) {
+            char *ptr = line + (mode == 0 ? 10 : 11);
+            size_t len = strcspn(ptr, "\r\n");
+
+            // Plaintext that is not all hex digits (or has an odd length) is taken as text.
+            // The check comes first: a failed in-place decode has already overwritten the line
+            int is_hex = len > 0 && len % 2 == 0 && strspn(ptr, "0123456789abcdefABCDEF") >= len;
+            if (!is_hex && mode != 0 && len > 0) {
+                printf("Error: Invalid ciphertext hex format\n");
+                ret = -1;
+                break;
+            }
+
+            // Decoded in place, the line buffer becomes the data
+            ssize_t n = is_hex ? sosemanuk_hex_decode((uint8_t *)ptr, ptr, len) : (ssize_t)len;
+
+            free(*data);
+            *data = (uint8_t *)line;
+            *data_len = (size_t)n;
+            memmove(line, ptr, n);
+            line = NULL;
+            cap = 0;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+
+    if (ret == 0 && (!have_key || !have_iv)) {
+        printf("Error: Missing key or iv in input file\n");
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Container format (-c / -x), all integers little-endian:
+ *   0  magic "SOSC"
+ *   4  version (uint32)
+ *   8  chunk size in bytes (uint32)
+ *   12 reserved, 0 (uint32)
+ *   16 chunk count (uint64)
+ *   24 plaintext length (uint64)
+ *   32 ciphertext chunks in order, the last one may be shorter
+ * Chunk i is an independent Sosemanuk stream whose IV is the 8-byte base IV
+ * (bytes 0..7 of iv=, bytes 8..15 must be zero) followed by the 64-bit chunk
+ * index. Distinct (base IV, index) pairs always give distinct IVs, so two
+ * containers under one key never share keystream as long as their base IVs
+ * differ. Chunks are processed on all cores and any byte range can be
+ * decrypted without the chunks before it.
+ * Version 1 containers XORed the index into bytes 8..15 of a 16-byte base IV,
+ * which collides across related base IVs; they can still be decrypted.
+*/
+#define CONTAINER_MAGIC "SOSC"
+#define CONTAINER_VERSION 2
+#define CONTAINER_VERSION_XOR 1
+#define CONTAINER_HEADER_SIZE 32
+#define CONTAINER_DEFAULT_CHUNK (1024 * 1024)
+#define CONTAINER_MAX_CHUNK (256 * 1024 * 1024)
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static void put_le64(uint8_t *p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+    return v;
+}
+
+// pread/pwrite until done; return -1 on error or unexpected end of file
+static int read_full(int fd, uint8_t *buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, off);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
 
-    *out_len = hex_len / 2;
-    if (*out_len > max_len) return -1;
+static int write_full(int fd, const uint8_t *buf, size_t len, off_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
 
-    for (size_t i = 0; i < *out_len; i++) {
-        if (sscanf(hex + 2 * i, "%2hhx", &bytes[i]) != 1) {
+// IV of one chunk: 8-byte base IV and the chunk index (version 1: index XORed into bytes 8..15)
+static void chunk_iv(const uint8_t *base_iv, uint64_t index, int version, uint8_t *iv) {
+    if (version == CONTAINER_VERSION_XOR) {
+        memcpy(iv, base_iv, 16);
+        for (int i = 0; i < 8; i++) iv[8 + i] ^= (uint8_t)(index >> (8 * i));
+    } else {
+        memcpy(iv, base_iv, 8);
+        put_le64(iv + 8, index);
+    }
+}
+
+// The chunk index takes bytes 8..15 of the IV: the base IV must leave them zero
+static int container_check_iv(const uint8_t *iv) {
+    for (int i = 8; i < 16; i++) {
+        if (iv[i] != 0) {
+            printf("Error: The container IV is 8 bytes, bytes 8..15 of iv= must be zero\n");
             return -1;
         }
     }
     return 0;
 }
 
-// Function to convert bytes to hex string
-void bytes_to_hex(const uint8_t *bytes, size_t len, char *hex) {
-    for (size_t i = 0; i < len; i++) {
-        sprintf(hex + 2 * i, "%02X", bytes[i]);
+// Work shared by the container threads: chunks [next, last] of the plaintext
+// range [range_start, range_end) are read at in_base and written at out_base
+struct container_job {
+    const struct sosemanuk_key *key;
+    const uint8_t *base_iv;
+    int version;
+    int in_fd;
+    int out_fd;
+    off_t in_base;
+    off_t out_base;
+    uint64_t chunk_size;
+    uint64_t total_len;
+    uint64_t range_start;
+    uint64_t range_end;
+    uint64_t next;
+    uint64_t last;
+    int error;
+};
+
+static void *container_worker(void *arg) {
+    struct container_job *job = arg;
+    struct sosemanuk_context ctx;
+    uint8_t *buf = malloc(job->chunk_size);
+    uint8_t iv[16];
+
+    if (!buf) {
+        __atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    for (;;) {
+        uint64_t c = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+        if (c > job->last || __atomic_load_n(&job->error, __ATOMIC_RELAXED)) break;
+
+        uint64_t start = c * job->chunk_size;
+        uint64_t len = job->total_len - start;
+        if (len > job->chunk_size) len = job->chunk_size;
+
+        if (read_full(job->in_fd, buf, len, job->in_base + start) != 0) {
+            __atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+            break;
+        }
+
+        chunk_iv(job->base_iv, c, job->version, iv);
+        sosemanuk_set_iv(&ctx, job->key, iv, 16);
+        sosemanuk_crypt_bulk(&ctx, buf, len, buf);
+
+        // Only the part of the chunk inside the requested range is written
+        uint64_t lo = start > job->range_start ? start : job->range_start;
+        uint64_t hi = start + len < job->range_end ? start + len : job->range_end;
+        if (write_full(job->out_fd, buf + (lo - start), hi - lo, job->out_base + (lo - job->range_start)) != 0) {
+            __atomic_store_n(&job->error, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    free(buf);
+    return NULL;
+}
+
+// Run the job on one thread per online CPU
+static int container_run(struct container_job *job) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t chunks = job->last - job->next + 1;
+    int nthreads = ncpu > 0 ? (int)ncpu : 1;
+    if ((uint64_t)nthreads > chunks) nthreads = (int)chunks;
+
+    pthread_t *threads = malloc(sizeof(*threads) * nthreads);
+    if (!threads) return -1;
+
+    int started = 0;
+    for (; started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, container_worker, job) != 0) break;
     }
-    hex[2 * len] = '\0';
+    if (started == 0) container_worker(job);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+    free(threads);
+    return job->error ? -1 : 0;
 }
 
-// Function to read input file and parse parameters
-int parse_input_file(const char *filename, uint8_t *key, uint8_t *iv, char *plaintext, size_t *plaintext_len, char *ciphertext_file, char *ciphertext_hex, int mode) {
-    // mode: 0=encrypt, 1=decrypt_file, 2=decrypt_hex
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
+// -c: encrypt input into a container
+int container_encrypt(const struct sosemanuk_key *key, const uint8_t *iv, const char *input, const char *output, uint64_t chunk_size) {
+    if (container_check_iv(iv) != 0) return -1;
+
+    int in_fd = open(input, O_RDONLY);
+    if (in_fd < 0) {
         perror("Cannot open input file");
         return -1;
     }
 
-    char line[1024];
+    struct stat st;
+    if (fstat(in_fd, &st) != 0) {
+        perror("Cannot stat input file");
+        close(in_fd);
+        return -1;
+    }
 
-    while (fgets(line, sizeof(line), fp)) {
-        if (strstr(line, "key=")) {
-            char key_hex[65] = {0};
-            sscanf(line, "key=%64s", key_hex);
-            size_t key_len;
-            if (hex_to_bytes(key_hex, key, 32, &key_len) != 0 || key_len != 32) {
-                printf("Error: Invalid key format\n");
-                fclose(fp);
+    int out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror("Cannot open output file");
+        close(in_fd);
+        return -1;
+    }
+
+    uint64_t total = (uint64_t)st.st_size;
+    uint64_t chunks = (total + chunk_size - 1) / chunk_size;
+
+    uint8_t header[CONTAINER_HEADER_SIZE] = {0};
+    memcpy(header, CONTAINER_MAGIC, 4);
+    put_le32(header + 4, CONTAINER_VERSION);
+    put_le32(header + 8, (uint32_t)chunk_size);
+    put_le64(header + 16, chunks);
+    put_le64(header + 24, total);
+
+    int ret = write_full(out_fd, header, sizeof(header), 0);
+    if (ret == 0 && chunks > 0) {
+        struct container_job job = {
+            .key = key, .base_iv = iv, .version = CONTAINER_VERSION, .in_fd = in_fd, .out_fd = out_fd,
+            .in_base = 0, .out_base = CONTAINER_HEADER_SIZE,
+            .chunk_size = chunk_size, .total_len = total,
+            .range_start = 0, .range_end = total, .next = 0, .last = chunks - 1,
+        };
+        ret = container_run(&job);
+    }
+
+    if (ret != 0) printf("Error: Container encryption failed\n");
+    else printf("Encrypted %llu bytes in %llu chunks of %llu bytes. Output written to: %s\n",
+                (unsigned long long)total, (unsigned long long)chunks, (unsigned long long)chunk_size, output);
+
+    close(in_fd);
+    if (close(out_fd) != 0) ret = -1;
+    return ret;
+}
+
+// -x: decrypt the plaintext range [offset, offset + length) of a container
+int container_decrypt(const struct sosemanuk_key *key, const uint8_t *iv, const char *input, const char *output, uint64_t offset, uint64_t length) {
+    int in_fd = open(input, O_RDONLY);
+    if (in_fd < 0) {
+        perror("Cannot open input file");
+        return -1;
+    }
+
+    uint8_t header[CONTAINER_HEADER_SIZE];
+    struct stat st;
+    if (read_full(in_fd, header, sizeof(header), 0) != 0 || memcmp(header, CONTAINER_MAGIC, 4) != 0 ||
+        (get_le32(header + 4) != CONTAINER_VERSION && get_le32(header + 4) != CONTAINER_VERSION_XOR) ||
+        fstat(in_fd, &st) != 0) {
+        printf("Error: Not a Sosemanuk container\n");
+        close(in_fd);
+        return -1;
+    }
+
+    int version = (int)get_le32(header + 4);
+    if (version == CONTAINER_VERSION && container_check_iv(iv) != 0) {
+        close(in_fd);
+        return -1;
+    }
+
+    uint64_t chunk_size = get_le32(header + 8);
+    uint64_t chunks = get_le64(header + 16);
+    uint64_t total = get_le64(header + 24);
+    if (chunk_size == 0 || chunk_size > CONTAINER_MAX_CHUNK || chunks != (total + chunk_size - 1) / chunk_size ||
+        (uint64_t)st.st_size != CONTAINER_HEADER_SIZE + total) {
+        printf("Error: Corrupted container header\n");
+        close(in_fd);
+        return -1;
+    }
+
+    if (offset > total) offset = total;
+    if (length > total - offset) length = total - offset;
+
+    int out_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror("Cannot open output file");
+        close(in_fd);
+        return -1;
+    }
+
+    int ret = 0;
+    if (length > 0) {
+        struct container_job job = {
+            .key = key, .base_iv = iv, .version = version, .in_fd = in_fd, .out_fd = out_fd,
+            .in_base = CONTAINER_HEADER_SIZE, .out_base = 0,
+            .chunk_size = chunk_size, .total_len = total,
+            .range_start = offset, .range_end = offset + length,
+            .next = offset / chunk_size, .last = (offset + length - 1) / chunk_size,
+        };
+        ret = container_run(&job);
+    }
+
+    if (ret != 0) printf("Error: Container decryption failed\n");
+    else printf("Decrypted %llu bytes at offset %llu. Output written to: %s\n",
+                (unsigned long long)length, (unsigned long long)offset, output);
+
+    close(in_fd);
+    if (close(out_fd) != 0) ret = -1;
+    return ret;
+}
+
+// Key and IV for the binary modes: "-k <key_hex> -v <iv_hex>" or "-f <key_file>"
+int parse_key_options(int argc, char *argv[], int first, uint8_t *key, uint8_t *iv) {
+    int have_key = 0, have_iv = 0;
+
+    for (int i = first; i < argc; i++) {
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Error: Missing value for %s\n", argv[i]);
+            return -1;
+        }
+
+        if (strcmp(argv[i], "-k") == 0) {
+            if (parse_hex_exact(argv[++i], key, 32) != 0) {
+                fprintf(stderr, "Error: Invalid key format\n");
                 return -1;
             }
-        } else if (strstr(line, "iv=")) {
-            char iv_hex[33] = {0};
-            sscanf(line, "iv=%32s", iv_hex);
-            size_t iv_len;
-            if (hex_to_bytes(iv_hex, iv, 16, &iv_len) != 0 || iv_len != 16) {
-                printf("Error: Invalid IV format\n");
-                fclose(fp);
+            have_key = 1;
+        } else if (strcmp(argv[i], "-v") == 0) {
+            if (parse_hex_exact(argv[++i], iv, 16) != 0) {
+                fprintf(stderr, "Error: Invalid IV format\n");
                 return -1;
             }
-        } else if (mode == 0 && strstr(line, "plaintext=")) { // encrypt mode
-            char *ptr = strstr(line, "plaintext=") + 10;
-            // Remove newline
-            ptr[strcspn(ptr, "\n")] = 0;
-
-            // Try to parse as hex first
-            size_t hex_len = strlen(ptr);
-            if (hex_len % 2 == 0 && hex_len > 0) {
-                // Check if it's valid hex
-                int is_hex = 1;
-                for (size_t i = 0; i < hex_len; i++) {
-                    if (!isxdigit((unsigned char)ptr[i])) {
-                        is_hex = 0;
-                        break;
-                    }
-                }
-                if (is_hex) {
-                    if (hex_to_bytes(ptr, (uint8_t*)plaintext, sizeof(plaintext), plaintext_len) != 0) {
-                        printf("Error: Invalid plaintext hex format\n");
-                        fclose(fp);
-                        return -1;
-                    }
-                    plaintext[*plaintext_len] = '\0';
-                } else {
-                    // Treat as plain text
-                    strcpy(plaintext, ptr);
-                    *plaintext_len = strlen(plaintext);
-                }
-            } else {
-                // Plain text
-                strcpy(plaintext, ptr);
-                *plaintext_len = strlen(plaintext);
+            have_iv = 1;
+        } else if (strcmp(argv[i], "-f") == 0) {
+            if (parse_input_file(argv[++i], key, iv, NULL, NULL, 3) != 0) return -1;
+            have_key = have_iv = 1;
+        } else {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (!have_key || !have_iv) {
+        fprintf(stderr, "Error: Key and IV are required (-k and -v, or -f)\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Bytes handled per step of the mmap mode, a multiple of the 80-byte keystream block
+#define MMAP_WINDOW (80 * 1024 * 1024)
+
+// Start writing back an output window without waiting for it
+static void mmap_writeback(int fd, size_t off, size_t len) {
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(fd, off, len, SYNC_FILE_RANGE_WRITE);
+#else
+    (void)fd; (void)off; (void)len;
+#endif
+}
+
+// Wait until an output window is on disk, then drop it from the mapping and the page cache
+static int mmap_flush(int fd, uint8_t *dst, size_t off, size_t len) {
+#ifdef SYNC_FILE_RANGE_WRITE
+    if (sync_file_range(fd, off, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0) return -1;
+#else
+    if (msync(dst + off, len, MS_SYNC) != 0) return -1;
+#endif
+    madvise(dst + off, len, MADV_DONTNEED);
+    posix_fadvise(fd, off, len, POSIX_FADV_DONTNEED);
+    return 0;
+}
+
+/*
+ * -m: XOR the mapped input straight into the mapped output, no heap buffers.
+ * Neither file stays in the page cache: a source window is dropped once it is
+ * encrypted, an output window is written back while the next one is encrypted
+ * and dropped after that.
+*/
+int mmap_crypt(struct sosemanuk_context *ctx, const char *input, const char *output) {
+    int in_fd = open(input, O_RDONLY);
+    if (in_fd < 0) {
+        perror("Cannot open input file");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(in_fd, &st) != 0) {
+        perror("Cannot stat input file");
+        close(in_fd);
+        return -1;
+    }
+
+    // Pipes and devices report no size: they go through -s
+    if (!S_ISREG(st.st_mode)) {
+        printf("Error: %s is not a regular file (use -s for pipes and devices)\n", input);
+        close(in_fd);
+        return -1;
+    }
+
+    // O_TRUNC on the input itself (same path, link or symlink) would empty it before it is mapped
+    struct stat out_st;
+    if (stat(output, &out_st) == 0 && out_st.st_dev == st.st_dev && out_st.st_ino == st.st_ino) {
+        printf("Error: Input and output are the same file\n");
+        close(in_fd);
+        return -1;
+    }
+
+    int out_fd = open(output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        perror("Cannot open output file");
+        close(in_fd);
+        return -1;
+    }
+
+    size_t size = (size_t)st.st_size;
+    int ret = 0;
+
+    if (size > 0) {
+        uint8_t *src = MAP_FAILED, *dst = MAP_FAILED;
+
+        if (ftruncate(out_fd, st.st_size) != 0) {
+            perror("Cannot resize output file");
+            ret = -1;
+        } else if ((src = mmap(NULL, size, PROT_READ, MAP_SHARED, in_fd, 0)) == MAP_FAILED ||
+                   (dst = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, out_fd, 0)) == MAP_FAILED) {
+            perror("Cannot map file");
+            ret = -1;
+        } else {
+            madvise(src, size, MADV_SEQUENTIAL);
+            madvise(dst, size, MADV_SEQUENTIAL);
+
+            size_t prev_off = 0, prev_len = 0;
+
+            for (size_t off = 0; ret == 0 && off < size; off += MMAP_WINDOW) {
+                size_t len = size - off < MMAP_WINDOW ? size - off : MMAP_WINDOW;
+
+                sosemanuk_crypt_bulk(ctx, src + off, len, dst + off);
+
+                // The source window is done: drop it from the mapping and the page cache
+                madvise(src + off, len, MADV_DONTNEED);
+                posix_fadvise(in_fd, off, len, POSIX_FADV_DONTNEED);
+
+                // Output: this window goes to disk while the previous one is waited for and dropped
+                mmap_writeback(out_fd, off, len);
+                if (prev_len > 0 && mmap_flush(out_fd, dst, prev_off, prev_len) != 0) ret = -1;
+                prev_off = off;
+                prev_len = len;
             }
-        } else if ((mode == 1 || mode == 2) && strstr(line, "ciphertext=")) { // decrypt from hex mode
-            char *ptr = strstr(line, "ciphertext=") + 11;
-            // Remove newline
-            ptr[strcspn(ptr, "\n")] = 0;
-            strcpy(ciphertext_hex, ptr);
+
+            if ((ret == 0 && mmap_flush(out_fd, dst, prev_off, prev_len) != 0) || fsync(out_fd) != 0) ret = -1;
+            if (ret != 0) perror("Cannot write output file");
         }
+
+        if (src != MAP_FAILED) munmap(src, size);
+        if (dst != MAP_FAILED) munmap(dst, size);
     }
 
-    fclose(fp);
+    if (ret == 0) printf("Processed %zu bytes. Output written to: %s\n", size, output);
+
+    close(in_fd);
+    if (close(out_fd) != 0) ret = -1;
+    return ret;
+}
+
+/*
+ * Streaming mode (-s): stdin -> stdout through a ring of PIPE_SLOTS buffers.
+ * A reader thread, the crypt loop (main thread) and a writer thread work on
+ * different slots at the same time, so I/O overlaps with the cipher.
+ * Each slot goes EMPTY -> FILLED (reader) -> CRYPTED (crypt) -> EMPTY (writer).
+*/
+#define PIPE_SLOTS 4
+#define PIPE_BUFFER (1024 * 1024)
+
+enum pipe_slot_state { SLOT_EMPTY, SLOT_FILLED, SLOT_CRYPTED };
+
+struct pipe_slot {
+    uint8_t *data;
+    size_t len;  // 0 marks the end of the input
+    enum pipe_slot_state state;
+};
+
+struct pipe_ring {
+    struct pipe_slot slots[PIPE_SLOTS];
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int error;
+};
+
+// Wait until slot i reaches the given state; return -1 if another stage failed
+static int pipe_wait(struct pipe_ring *ring, int i, enum pipe_slot_state state) {
+    pthread_mutex_lock(&ring->lock);
+    while (ring->slots[i].state != state && !ring->error) {
+        pthread_cond_wait(&ring->changed, &ring->lock);
+    }
+    int ret = ring->error ? -1 : 0;
+    pthread_mutex_unlock(&ring->lock);
+    return ret;
+}
+
+static void pipe_set(struct pipe_ring *ring, int i, enum pipe_slot_state state) {
+    pthread_mutex_lock(&ring->lock);
+    ring->slots[i].state = state;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static void pipe_fail(struct pipe_ring *ring) {
+    pthread_mutex_lock(&ring->lock);
+    ring->error = 1;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static int pipe_failed(struct pipe_ring *ring) {
+    pthread_mutex_lock(&ring->lock);
+    int error = ring->error;
+    pthread_mutex_unlock(&ring->lock);
+    return error;
+}
+
+// Cancelled by pipe_crypt when another stage fails, only ever while blocked in read()
+static void *pipe_reader(void *arg) {
+    struct pipe_ring *ring = arg;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    for (int i = 0;; i = (i + 1) % PIPE_SLOTS) {
+        struct pipe_slot *slot = &ring->slots[i];
+        if (pipe_wait(ring, i, SLOT_EMPTY) != 0) break;
+
+        ssize_t n;
+        do {
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            n = read(STDIN_FILENO, slot->data, PIPE_BUFFER);
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        } while (n < 0 && errno == EINTR && !pipe_failed(ring));
+        if (n < 0) {
+            perror("Cannot read stdin");
+            pipe_fail(ring);
+            break;
+        }
+
+        slot->len = (size_t)n;
+        pipe_set(ring, i, SLOT_FILLED);
+        if (n == 0) break;
+    }
+    return NULL;
+}
+
+static void *pipe_writer(void *arg) {
+    struct pipe_ring *ring = arg;
+
+    for (int i = 0;; i = (i + 1) % PIPE_SLOTS) {
+        struct pipe_slot *slot = &ring->slots[i];
+        if (pipe_wait(ring, i, SLOT_CRYPTED) != 0) break;
+        if (slot->len == 0) break;
+
+        for (size_t done = 0; done < slot->len;) {
+            ssize_t n = write(STDOUT_FILENO, slot->data + done, slot->len - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                perror("Cannot write stdout");
+                pipe_fail(ring);
+                return NULL;
+            }
+            done += (size_t)n;
+        }
+
+        pipe_set(ring, i, SLOT_EMPTY);
+    }
+    return NULL;
+}
+
+// -s: the keystream continues across reads of any size (sosemanuk_stream_crypt)
+int pipe_crypt(struct sosemanuk_context *ctx) {
+    struct pipe_ring ring;
+    pthread_t reader, writer;
+    int i, ret = 0;
+
+    memset(&ring, 0, sizeof(ring));
+    for (i = 0; i < PIPE_SLOTS; i++) {
+        ring.slots[i].data = malloc(PIPE_BUFFER);
+        if (!ring.slots[i].data) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            while (i-- > 0) free(ring.slots[i].data);
+            return -1;
+        }
+    }
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.changed, NULL);
+
+    if (pthread_create(&reader, NULL, pipe_reader, &ring) != 0) {
+        ret = -1;
+    } else {
+        if (pthread_create(&writer, NULL, pipe_writer, &ring) != 0) {
+            pipe_fail(&ring);
+            ret = -1;
+        } else {
+            for (i = 0;; i = (i + 1) % PIPE_SLOTS) {
+                struct pipe_slot *slot = &ring.slots[i];
+                if (pipe_wait(&ring, i, SLOT_FILLED) != 0) break;
+
+                // The slot belongs to the writer after pipe_set: keep its length
+                size_t len = slot->len;
+                sosemanuk_stream_crypt(ctx, slot->data, len, slot->data);
+
+                pipe_set(&ring, i, SLOT_CRYPTED);
+                if (len == 0) break;
+            }
+            pthread_join(writer, NULL);
+        }
+
+        // After a failure the reader either sees the error flag (waiting for a slot)
+        // or is blocked on stdin, which may never deliver: cancel it there
+        if (pipe_failed(&ring)) {
+            pipe_fail(&ring);
+            pthread_cancel(reader);
+        }
+        pthread_join(reader, NULL);
+    }
+
+    if (ring.error) ret = -1;
+
+    pthread_cond_destroy(&ring.changed);
+    pthread_mutex_destroy(&ring.lock);
+    for (i = 0; i < PIPE_SLOTS; i++) free(ring.slots[i].data);
+    return ret;
+}
+
+/*
+ * Batch mode (-b): many independent records, each with its own key, IV and
+ * payload, in one run. Records are read BATCH_RECORDS (or BATCH_BYTES of data)
+ * at a time and handed to a sosemanuk_batch pool; while the workers encrypt one
+ * batch, the next one is read and the previous one is written, in input order.
+ * Key schedules come from a key cache, and consecutive records with the same
+ * key share one prepared key, so the pool runs them 16 at a time on the
+ * multi-lane IV setup.
+ *
+ * Text input (one record per data= line, key= and iv= hold until changed):
+ *   key=<hex, 1..32 bytes>
+ *   iv=<hex, 1..16 bytes>
+ *   data=<hex>
+ * Text output: one hex line per record.
+ *
+ * Binary input: "SOSB", then per record
+ *   keylen (1 byte) | ivlen (1 byte) | data length (4 bytes LE) | key | iv | data
+ * Binary output: "SOSB", then per record data length (4 bytes LE) | data
+*/
+#define BATCH_MAGIC "SOSB"
+#define BATCH_RECORDS 4096
+#define BATCH_BYTES (4 * 1024 * 1024)
+#define BATCH_KEY_CACHE 1024
+
+struct batch_record {
+    size_t key;       // index in batch_buffer.keys
+    uint8_t iv[16];
+    int ivlen;
+    size_t off;       // data in batch_buffer.data
+    size_t len;
+};
+
+struct batch_buffer {
+    struct batch_record *records;
+    struct sosemanuk_job *jobs;
+    struct sosemanuk_key *keys;
+    size_t count, nkeys;
+    uint8_t *data;
+    size_t used, cap;
+    uint8_t last_key[32];  // key of keys[nkeys - 1]
+    int last_keylen;
+    struct sosemanuk_batch *handle;
+};
+
+struct batch_reader {
+    FILE *fp;
+    int binary;
+    char *line;
+    size_t line_cap;
+    size_t position;  // line (text) or record (binary) number, for messages
+    uint8_t key[32];
+    int keylen;
+    uint8_t iv[16];
+    int ivlen;
+    struct sosemanuk_keycache *cache;
+};
+
+// Make room for len more bytes of data at buf->data + buf->used; offsets stay valid across a move
+static int batch_reserve(struct batch_buffer *buf, size_t len) {
+    if (buf->cap - buf->used < len) {
+        size_t cap = buf->cap ? buf->cap : BATCH_BYTES;
+        while (cap - buf->used < len) cap *= 2;
+        uint8_t *data = realloc(buf->data, cap);
+        if (!data) {
+            printf("Error: Memory allocation failed\n");
+            return -1;
+        }
+        buf->data = data;
+        buf->cap = cap;
+    }
+    return 0;
+}
+
+// Append a record with the reader's key and iv; its data (len bytes) is already reserved
+static int batch_add(struct batch_reader *rd, struct batch_buffer *buf, size_t len) {
+    struct batch_record *rec = &buf->records[buf->count];
+
+    if (buf->nkeys == 0 || rd->keylen != buf->last_keylen || memcmp(rd->key, buf->last_key, rd->keylen) != 0) {
+        if (sosemanuk_keycache_get(rd->cache, &buf->keys[buf->nkeys], rd->key, rd->keylen) < 0) {
+            printf("Error: Failed to initialize cipher key\n");
+            return -1;
+        }
+        memcpy(buf->last_key, rd->key, rd->keylen);
+        buf->last_keylen = rd->keylen;
+        buf->nkeys++;
+    }
+
+    rec->key = buf->nkeys - 1;
+    memcpy(rec->iv, rd->iv, rd->ivlen);
+    rec->ivlen = rd->ivlen;
+    rec->off = buf->used;
+    rec->len = len;
+    buf->used += len;
+    buf->count++;
+    return 0;
+}
+
+// Decode a key= or iv= value of 1..max bytes
+static int batch_parse_field(char *hex, uint8_t *bytes, int max, int *len) {
+    size_t hex_len = strlen(hex);
+    if (hex_len == 0 || hex_len > 2 * (size_t)max) return -1;
+    ssize_t n = sosemanuk_hex_decode(bytes, hex, hex_len);
+    if (n <= 0) return -1;
+    *len = (int)n;
+    return 0;
+}
+
+// Return value: 1 (record added), 0 (end of input), -1 (bad input)
+static int batch_read_text(struct batch_reader *rd, struct batch_buffer *buf) {
+    ssize_t line_len;
+
+    while ((line_len = getline(&rd->line, &rd->line_cap, rd->fp)) >= 0) {
+        char *line = rd->line;
+        rd->position++;
+
+        while (line_len > 0 && isspace((unsigned char)line[line_len - 1])) line[--line_len] = 0;
+        if (line_len == 0 || line[0] == '#') continue;
+
+        if (strncmp(line, "key=", 4) == 0) {
+            if (batch_parse_field(line + 4, rd->key, 32, &rd->keylen) != 0) {
+                printf("Error: line %zu: Invalid key format\n", rd->position);
+                return -1;
+            }
+        } else if (strncmp(line, "iv=", 3) == 0) {
+            if (batch_parse_field(line + 3, rd->iv, 16, &rd->ivlen) != 0) {
+                printf("Error: line %zu: Invalid IV format\n", rd->position);
+                return -1;
+            }
+        } else if (strncmp(line, "data=", 5) == 0) {
+            size_t hex_len = (size_t)line_len - 5;
+            if (rd->keylen == 0 || rd->ivlen == 0) {
+                printf("Error: line %zu: data= before key= and iv=\n", rd->position);
+                return -1;
+            }
+            if (batch_reserve(buf, hex_len / 2) != 0) return -1;
+            if (sosemanuk_hex_decode(buf->data + buf->used, line + 5, hex_len) < 0) {
+                printf("Error: line %zu: Invalid data format\n", rd->position);
+                return -1;
+            }
+            return batch_add(rd, buf, hex_len / 2) == 0 ? 1 : -1;
+        } else {
+            printf("Error: line %zu: Unknown field\n", rd->position);
+            return -1;
+        }
+    }
+
+    if (ferror(rd->fp)) {
+        perror("Cannot read input file");
+        return -1;
+    }
+    return 0;
+}
+
+// Return value: 1 (record added), 0 (end of input), -1 (bad input)
+static int batch_read_binary(struct batch_reader *rd, struct batch_buffer *buf) {
+    uint8_t header[6];
+
+    size_t n = fread(header, 1, sizeof(header), rd->fp);
+    if (n == 0 && !ferror(rd->fp)) return 0;
+    rd->position++;
+
+    if (n == sizeof(header)) {
+        rd->keylen = header[0];
+        rd->ivlen = header[1];
+        size_t len = get_le32(header + 2);
+
+        if (rd->keylen < 1 || rd->keylen > 32 || rd->ivlen < 1 || rd->ivlen > 16) {
+            printf("Error: record %zu: Invalid key or IV length\n", rd->position);
+            return -1;
+        }
+
+        if (batch_reserve(buf, len) != 0) return -1;
+        if (fread(rd->key, 1, rd->keylen, rd->fp) == (size_t)rd->keylen &&
+            fread(rd->iv, 1, rd->ivlen, rd->fp) == (size_t)rd->ivlen &&
+            fread(buf->data + buf->used, 1, len, rd->fp) == len) {
+            return batch_add(rd, buf, len) == 0 ? 1 : -1;
+        }
+    }
+
+    if (ferror(rd->fp)) {
+        perror("Cannot read input file");
+    } else {
+        printf("Error: record %zu: Truncated record\n", rd->position);
+    }
+    return -1;
+}
+
+// Fill buf with the next records; buf->count is 0 at the end of the input
+static int batch_read(struct batch_reader *rd, struct batch_buffer *buf) {
+    buf->count = 0;
+    buf->nkeys = 0;
+    buf->used = 0;
+
+    while (buf->count < BATCH_RECORDS && buf->used < BATCH_BYTES) {
+        int ret = rd->binary ? batch_read_binary(rd, buf) : batch_read_text(rd, buf);
+        if (ret < 0) return -1;
+        if (ret == 0) break;
+    }
+    return 0;
+}
+
+static int batch_submit(struct sosemanuk_batch_pool *pool, struct batch_buffer *buf) {
+    for (size_t i = 0; i < buf->count; i++) {
+        struct batch_record *rec = &buf->records[i];
+        struct sosemanuk_job *job = &buf->jobs[i];
+
+        memset(job, 0, sizeof(*job));
+        job->key = &buf->keys[rec->key];
+        job->iv = rec->iv;
+        job->ivlen = rec->ivlen;
+        job->buf = buf->data + rec->off;
+        job->out = buf->data + rec->off;
+        job->buflen = rec->len;
+    }
+
+    buf->handle = sosemanuk_batch_submit(pool, buf->jobs, buf->count, NULL, NULL);
+    if (!buf->handle) {
+        printf("Error: Memory allocation failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Wait for the batch in flight, if any
+static int batch_finish(struct batch_buffer *buf) {
+    if (!buf->handle) return 0;
+
+    size_t failed = sosemanuk_batch_wait(buf->handle);
+    buf->handle = NULL;
+    if (failed) {
+        printf("Error: %zu records failed\n", failed);
+        return -1;
+    }
     return 0;
 }
 
+static int batch_write(FILE *fp, int binary, const struct batch_buffer *buf) {
+    for (size_t i = 0; i < buf->count; i++) {
+        const struct batch_record *rec = &buf->records[i];
+        int ret;
+
+        if (binary) {
+            uint8_t len[4];
+            put_le32(len, (uint32_t)rec->len);
+            ret = (fwrite(len, 1, 4, fp) == 4 && fwrite(buf->data + rec->off, 1, rec->len, fp) == rec->len) ? 0 : -1;
+        } else {
+            ret = (sosemanuk_hex_write(fp, buf->data + rec->off, rec->len) == 0 && fputc('\n', fp) != EOF) ? 0 : -1;
+        }
+
+        if (ret != 0) {
+            perror("Cannot write output file");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int batch_buffer_init(struct batch_buffer *buf) {
+    buf->records = malloc(BATCH_RECORDS * sizeof(*buf->records));
+    buf->jobs = malloc(BATCH_RECORDS * sizeof(*buf->jobs));
+    buf->keys = malloc(BATCH_RECORDS * sizeof(*buf->keys));
+    if (!buf->records || !buf->jobs || !buf->keys) {
+        printf("Error: Memory allocation failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void batch_buffer_free(struct batch_buffer *buf) {
+    if (buf->keys) memset(buf->keys, 0, BATCH_RECORDS * sizeof(*buf->keys));
+    memset(buf->last_key, 0, sizeof(buf->last_key));
+    free(buf->records);
+    free(buf->jobs);
+    free(buf->keys);
+    free(buf->data);
+}
+
+int batch_crypt(const char *input, const char *output, int threads) {
+    FILE *in = fopen(input, "rb");
+    if (!in) {
+        perror("Cannot open input file");
+        return -1;
+    }
+    FILE *out = fopen(output, "wb");
+    if (!out) {
+        perror("Cannot open output file");
+        fclose(in);
+        return -1;
+    }
+
+    struct batch_reader rd;
+    memset(&rd, 0, sizeof(rd));
+    rd.fp = in;
+
+    // The binary framing starts with the magic, anything else is text
+    char magic[4];
+    if (fread(magic, 1, 4, in) == 4 && memcmp(magic, BATCH_MAGIC, 4) == 0) {
+        rd.binary = 1;
+    } else {
+        rewind(in);
+    }
+
+    struct batch_buffer bufs[2];
+    memset(bufs, 0, sizeof(bufs));
+    struct sosemanuk_batch_pool *pool = sosemanuk_batch_pool_create(threads);
+    rd.cache = sosemanuk_keycache_create(BATCH_KEY_CACHE);
+    int ret = 0;
+    if (batch_buffer_init(&bufs[0]) != 0 || batch_buffer_init(&bufs[1]) != 0) {
+        ret = -1;
+    } else if (!pool || !rd.cache) {
+        printf("Error: Cannot start the worker pool\n");
+        ret = -1;
+    } else if (rd.binary && fwrite(BATCH_MAGIC, 1, 4, out) != 4) {
+        perror("Cannot write output file");
+        ret = -1;
+    }
+
+    size_t records = 0, bytes = 0;
+    int cur = 0;
+
+    if (ret == 0) ret = batch_read(&rd, &bufs[cur]);
+    if (ret == 0 && bufs[cur].count > 0) ret = batch_submit(pool, &bufs[cur]);
+
+    while (ret == 0 && bufs[cur].count > 0) {
+        struct batch_buffer *done = &bufs[cur], *next = &bufs[cur ^ 1];
+
+        // Read the next batch while the workers encrypt this one
+        ret = batch_read(&rd, next);
+        if (batch_finish(done) != 0) ret = -1;
+        if (ret == 0 && next->count > 0) ret = batch_submit(pool, next);
+
+        // ... and write this one while they encrypt the next
+        if (ret == 0) ret = batch_write(out, rd.binary, done);
+
+        records += done->count;
+        bytes += done->used;
+        cur ^= 1;
+    }
+
+    // Nothing may be in flight when the buffers go away
+    batch_finish(&bufs[0]);
+    batch_finish(&bufs[1]);
+
+    if (ret == 0) {
+        struct sosemanuk_keycache_stats st;
+        sosemanuk_keycache_stats(rd.cache, &st);
+        printf("Processed %zu records (%zu bytes, %llu key schedules computed, %llu reused). Output written to: %s\n",
+               records, bytes, (unsigned long long)st.misses, (unsigned long long)st.hits, output);
+    }
+
+    if (pool) sosemanuk_batch_pool_destroy(pool);
+    if (rd.cache) sosemanuk_keycache_destroy(rd.cache);
+    batch_buffer_free(&bufs[0]);
+    batch_buffer_free(&bufs[1]);
+    memset(&rd.key, 0, sizeof(rd.key));
+    free(rd.line);
+    fclose(in);
+    if (fclose(out) != 0) ret = -1;
+    return ret;
+}
+
 void print_usage(const char *program_name) {
     printf("Simple Sosemanuk Encrypt/Decrypt Tool\n\n");
     printf("Usage:\n");
     printf("  %s -e <input_file> <output_file>    # Encrypt\n", program_name);
     printf("  %s -d <input_file>                  # Decrypt from hex\n", program_name);
-    printf("  %s -h <input_file>                  # Decrypt from hex\n\n", program_name);
+    printf("  %s -h <input_file>                  # Decrypt from hex\n", program_name);
+    printf("  %s -c <key_file> <input> <output> [chunk_size]      # Encrypt into a chunked container\n", program_name);
+    printf("  %s -x <key_file> <input> <output> [offset length]   # Decrypt a container (or a byte range)\n", program_name);
+    printf("  %s -m <input> <output> (-k <key_hex> -v <iv_hex> | -f <key_file>)   # Encrypt/decrypt a binary file\n", program_name);
+    printf("  %s -s (-k <key_hex> -v <iv_hex> | -f <key_file>)   # Encrypt/decrypt stdin to stdout\n", program_name);
+    printf("  %s -b <input> <output> [threads]   # Encrypt/decrypt a batch of records\n\n", program_name);
     printf("Input file format for encryption:\n");
     printf("  key=<32_byte_hex_key>\n");
     printf("  iv=<16_byte_hex_iv>\n");
@@ -142,10 +1112,134 @@ void print_usage(const char *program_name) {
     printf("  key=<32_byte_hex_key>\n");
     printf("  iv=<16_byte_hex_iv>\n");
     printf("  ciphertext=<hex_data>\n\n");
+    printf("Key file for the container modes (bytes 8..15 of the IV hold the chunk index):\n");
+    printf("  key=<32_byte_hex_key>\n");
+    printf("  iv=<8_byte_hex_iv>0000000000000000\n\n");
+    printf("Batch input, text (key= and iv= hold until changed, one record per data= line):\n");
+    printf("  key=<1_to_32_byte_hex_key>\n");
+    printf("  iv=<1_to_16_byte_hex_iv>\n");
+    printf("  data=<hex_data>\n");
+    printf("Batch input, binary: \"SOSB\" then records of\n");
+    printf("  keylen (1 byte) | ivlen (1 byte) | data length (4 bytes LE) | key | iv | data\n\n");
     printf("Examples:\n");
     printf("  %s -e encrypt_input.txt message.enc\n", program_name);
     printf("  %s -d decrypt_input.txt message.txt\n", program_name);
     printf("  %s -h hex_decrypt_input.txt\n", program_name);
+    printf("  %s -c key.txt backup.img backup.sosc\n", program_name);
+    printf("  %s -x key.txt backup.sosc part.bin 1048576 4096\n", program_name);
+    printf("  %s -m image.iso image.enc -f key.txt\n", program_name);
+    printf("  tar c dir | %s -s -f key.txt | ssh host 'cat > dir.tar.enc'\n", program_name);
+    printf("  %s -b records.txt records.out 8\n", program_name);
+}
+
+// Container modes: the key file only provides key= and iv=
+int container_main(int argc, char *argv[]) {
+    int encrypt = strcmp(argv[1], "-c") == 0;
+    uint64_t chunk_size = CONTAINER_DEFAULT_CHUNK;
+    uint64_t offset = 0, length = UINT64_MAX;
+    char *end;
+
+    if (encrypt && argc == 6) {
+        chunk_size = strtoull(argv[5], &end, 0);
+        if (*end != '\0' || chunk_size == 0 || chunk_size > CONTAINER_MAX_CHUNK) {
+            printf("Error: Invalid chunk size\n");
+            return 1;
+        }
+    } else if (!encrypt && argc == 7) {
+        offset = strtoull(argv[5], &end, 0);
+        if (*end == '\0') length = strtoull(argv[6], &end, 0);
+        if (*end != '\0') {
+            printf("Error: Invalid offset or length\n");
+            return 1;
+        }
+    } else if (argc != 5) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    uint8_t key[32];
+    uint8_t iv[16];
+    if (parse_input_file(argv[2], key, iv, NULL, NULL, 3) != 0) {
+        return 1;
+    }
+
+    struct sosemanuk_key kctx;
+    if (sosemanuk_set_key(&kctx, key, 32)) {
+        printf("Error: Failed to initialize cipher key\n");
+        return 1;
+    }
+
+    int ret = encrypt ? container_encrypt(&kctx, iv, argv[3], argv[4], chunk_size)
+                      : container_decrypt(&kctx, iv, argv[3], argv[4], offset, length);
+
+    memset(&kctx, 0, sizeof(kctx));
+    return ret == 0 ? 0 : 1;
+}
+
+// Binary file mode: raw bytes in, raw bytes out
+int mmap_main(int argc, char *argv[]) {
+    uint8_t key[32];
+    uint8_t iv[16];
+
+    if (argc < 4) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (parse_key_options(argc, argv, 4, key, iv) != 0) {
+        return 1;
+    }
+
+    struct sosemanuk_context ctx;
+    if (sosemanuk_set_key_and_iv(&ctx, key, 32, iv, 16)) {
+        printf("Error: Failed to initialize cipher context\n");
+        return 1;
+    }
+
+    int ret = mmap_crypt(&ctx, argv[2], argv[3]);
+
+    memset(&ctx, 0, sizeof(ctx));
+    return ret == 0 ? 0 : 1;
+}
+
+// Streaming mode: raw bytes from stdin to stdout, messages on stderr
+int pipe_main(int argc, char *argv[]) {
+    uint8_t key[32];
+    uint8_t iv[16];
+
+    if (parse_key_options(argc, argv, 2, key, iv) != 0) {
+        return 1;
+    }
+
+    struct sosemanuk_context ctx;
+    if (sosemanuk_set_key_and_iv(&ctx, key, 32, iv, 16)) {
+        fprintf(stderr, "Error: Failed to initialize cipher context\n");
+        return 1;
+    }
+
+    int ret = pipe_crypt(&ctx);
+
+    memset(&ctx, 0, sizeof(ctx));
+    return ret == 0 ? 0 : 1;
+}
+
+// Batch mode: the records carry their own keys and IVs
+int batch_main(int argc, char *argv[]) {
+    int threads = 0;
+
+    if (argc == 5) {
+        char *end;
+        long n = strtol(argv[4], &end, 10);
+        if (*end != '\0' || n < 1 || n > 1024) {
+            printf("Error: Invalid thread count\n");
+            return 1;
+        }
+        threads = (int)n;
+    } else if (argc != 4) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    return batch_crypt(argv[2], argv[3], threads) == 0 ? 0 : 1;
 }
 
 int main(int argc, char *argv[]) {
@@ -159,6 +1253,19 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    if (strcmp(argv[1], "-c") == 0 || strcmp(argv[1], "-x") == 0) {
+        return container_main(argc, argv);
+    }
+    if (strcmp(argv[1], "-m") == 0) {
+        return mmap_main(argc, argv);
+    }
+    if (strcmp(argv[1], "-s") == 0) {
+        return pipe_main(argc, argv);
+    }
+    if (strcmp(argv[1], "-b") == 0) {
+        return batch_main(argc, argv);
+    }
+
     if (strcmp(argv[1], "-e") == 0) {
         mode = 0;
         if (argc != 4) {
@@ -189,12 +1296,11 @@ int main(int argc, char *argv[]) {
     // Parse input file
     uint8_t key[32];
     uint8_t iv[16];
-    char plaintext[1024];
-    size_t plaintext_len = 0;
-    char ciphertext_file[256];
-    char ciphertext_hex[2048];
+    uint8_t *data = NULL;
+    size_t data_len = 0;
 
-    if (parse_input_file(input_file, key, iv, plaintext, &plaintext_len, ciphertext_file, ciphertext_hex, mode) != 0) {
+    if (parse_input_file(input_file, key, iv, &data, &data_len, mode) != 0) {
+        free(data);
         return 1;
     }
 
@@ -202,40 +1308,32 @@ int main(int argc, char *argv[]) {
     struct sosemanuk_context ctx;
     if (sosemanuk_set_key_and_iv(&ctx, key, 32, iv, 16)) {
         printf("Error: Failed to initialize cipher context\n");
+        free(data);
         return 1;
     }
 
+    // The data is encrypted or decrypted in place
+    sosemanuk_crypt_bulk(&ctx, data, data_len, data);
+
     if (mode == 0) {
         // Encrypt mode
-        printf("Encrypting %zu bytes of plaintext...\n", plaintext_len);
-
-        // Allocate output buffer
-        uint8_t *ciphertext = (uint8_t*)malloc(plaintext_len);
-        if (!ciphertext) {
-            printf("Error: Memory allocation failed\n");
-            return 1;
-        }
-
-        // Encrypt
-        sosemanuk_crypt(&ctx, (uint8_t*)plaintext, plaintext_len, ciphertext);
+        printf("Encrypting %zu bytes of plaintext...\n", data_len);
 
         // Write to output file
         FILE *fp = fopen(output_file, "wb");
         if (!fp) {
             perror("Cannot open output file");
-            free(ciphertext);
+            free(data);
             return 1;
         }
 
-        fwrite(ciphertext, 1, plaintext_len, fp);
+        fwrite(data, 1, data_len, fp);
         fclose(fp);
 
         // Print hex for verification
-        char hex_output[2049];
-        bytes_to_hex(ciphertext, plaintext_len, hex_output);
-        printf("Ciphertext (hex): %s\n", hex_output);
-
-        free(ciphertext);
+        printf("Ciphertext (hex): ");
+        sosemanuk_hex_write(stdout, data, data_len);
+        printf("\n");
 
         printf("Encryption complete. Output written to: %s\n", output_file);
 
@@ -243,46 +1341,20 @@ int main(int argc, char *argv[]) {
         // Decrypt from hex mode
         printf("Decrypting from hex ciphertext...\n");
 
-        // Parse hex ciphertext
-        uint8_t *ciphertext = (uint8_t*)malloc(strlen(ciphertext_hex) / 2);
-        if (!ciphertext) {
-            printf("Error: Memory allocation failed\n");
-            return 1;
-        }
-
-        size_t ciphertext_len;
-        if (hex_to_bytes(ciphertext_hex, ciphertext, strlen(ciphertext_hex) / 2, &ciphertext_len) != 0) {
-            printf("Error: Invalid ciphertext hex format\n");
-            free(ciphertext);
-            return 1;
-        }
-
-        // Allocate output buffer
-        uint8_t *decrypted = (uint8_t*)malloc(ciphertext_len);
-        if (!decrypted) {
-            printf("Error: Memory allocation failed\n");
-            free(ciphertext);
-            return 1;
-        }
-
-        // Decrypt
-        sosemanuk_crypt(&ctx, ciphertext, ciphertext_len, decrypted);
-
         // Print recovered text
         printf("Recovered plaintext: ");
-        for (size_t i = 0; i < ciphertext_len; i++) {
-            if (isprint(decrypted[i])) {
-                printf("%c", decrypted[i]);
+        for (size_t i = 0; i < data_len; i++) {
+            if (isprint(data[i])) {
+                printf("%c", data[i]);
             } else {
-                printf("\\x%02X", decrypted[i]);
+                printf("\\x%02X", data[i]);
             }
         }
         printf("\n");
-
-        free(ciphertext);
-        free(decrypted);
     }
 
+    memset(&ctx, 0, sizeof(ctx));
+    free(data);
+
     return 0;
 }
-
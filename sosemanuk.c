@@ -17,140 +17,11 @@
 #include <string.h>
 
 #include "sosemanuk.h"
+#include "sosemanuk_internal.h"
 
 // Maximum Sosemanuk key length in bytes
 #define SOSEMANUK	32
 
-// Selecting the byte order
-#if __BYTE_ORDER == BIG_ENDIAN
-#define U32TO32(x)								\
-	((x << 24) | ((x << 8) & 0xFF0000) | ((x >> 8) & 0xFF00) | (x >> 24))
-#elif __BYTE_ORDER == LITTLE_ENDIAN
-#define U32TO32(x)	(x)
-#else
-#error unsupported byte 
-#endif
-
-// Little-endian 4 uint8_t in the uint32_t
-#define U8TO32_LITTLE(p) 						\
-	(((uint32_t)((p)[0])     ) | ((uint32_t)((p)[1]) << 8) |	\
-	((uint32_t)((p)[2]) << 16) | ((uint32_t)((p)[3]) << 24))
-
-// Little-endian uint32_t in the 4 uint8_t
-#define U32TO8_LITTLE(dst, val) {	\
-	dst[0] = val;			\
-	dst[1] = val >> 8;		\
-	dst[2] = val >> 16;		\
-	dst[3] = val >> 24;		\
-}
-
-// Cyclic shift
-#define ROTL32(v, n)	((v << n) | (v >> (32 - n)))
-
-// Serpent S-boxes, implemented in bitslice mode.
-// These circuits have been published by Dag Arne Osvik ("Speeding up Serpent"). 
-// Published in the 3rd AES Candidate Conference.
-
-#define S0(r0, r1, r2, r3, r4) {	\
-	r3 ^= r0; r4  = r1;		\
-	r1 &= r3; r4 ^= r2;		\
-	r1 ^= r0; r0 |= r3;		\
-	r0 ^= r4; r4 ^= r3;		\
-	r3 ^= r2; r2 |= r1;		\
-	r2 ^= r4; r4 =~ r4;		\
-	r4 |= r1; r1 ^= r3;		\
-	r1 ^= r4; r3 |= r0;		\
-	r1 ^= r3; r4 ^= r3;		\
-}
-
-#define S1(r0, r1, r2, r3, r4) {	\
-	r0 =~ r0; r2 =~ r2;		\
-	r4  = r0; r0 &= r1;		\
-	r2 ^= r0; r0 |= r3;		\
-	r3 ^= r2; r1 ^= r0;		\
-	r0 ^= r4; r4 |= r1;		\
-	r1 ^= r3; r2 |= r0;		\
-	r2 &= r4; r0 ^= r1;		\
-	r1 &= r2;			\
-	r1 ^= r0; r0 &= r2;		\
-	r0 ^= r4;			\
-}
-
-#define S2(r0, r1, r2, r3, r4) {	\
-	r4  = r0; r0 &= r2;		\
-	r0 ^= r3; r2 ^= r1;		\
-	r2 ^= r0; r3 |= r4;		\
-	r3 ^= r1; r4 ^= r2;		\
-	r1  = r3; r3 |= r4;		\
-	r3 ^= r0; r0 &= r1;		\
-	r4 ^= r0; r1 ^= r3;		\
-	r1 ^= r4; r4 =~ r4;		\
-}
-
-#define S3(r0, r1, r2, r3, r4) {	\
-	r4  = r0; r0 |= r3;		\
-	r3 ^= r1; r1 &= r4;		\
-	r4 ^= r2; r2 ^= r3;		\
-	r3 &= r0; r4 |= r1;		\
-	r3 ^= r4; r0 ^= r1;		\
-	r4 &= r0; r1 ^= r3;		\
-	r4 ^= r2; r1 |= r0;		\
-	r1 ^= r2; r0 ^= r3;		\
-	r2  = r1; r1 |= r3;		\
-	r1 ^= r0;			\
-}
-
-#define S4(r0, r1, r2, r3, r4) {	\
-	r1 ^= r3; r3 =~ r3;		\
-	r2 ^= r3; r3 ^= r0;		\
-	r4  = r1; r1 &= r3;		\
-	r1 ^= r2; r4 ^= r3;		\
-	r0 ^= r4; r2 &= r4;		\
-	r2 ^= r0; r0 &= r1;		\
-	r3 ^= r0; r4 |= r1;		\
-	r4 ^= r0; r0 |= r3;		\
-	r0 ^= r2; r2 &= r3;		\
-	r0 =~ r0; r4 ^= r2;		\
-}
-
-#define S5(r0, r1, r2, r3, r4) {	\
-	r0 ^= r1; r1 ^= r3;		\
-	r3 =~ r3; r4  = r1;		\
-	r1 &= r0; r2 ^= r3;		\
-	r1 ^= r2; r2 |= r4;		\
-	r4 ^= r3; r3 &= r1;		\
-	r3 ^= r0; r4 ^= r1;		\
-	r4 ^= r2; r2 ^= r0;		\
-	r0 &= r3; r2 =~ r2;		\
-	r0 ^= r4; r4 |= r3;		\
-	r2 ^= r4;			\
-}
-
-#define S6(r0, r1, r2, r3, r4) {	\
-	r2 =~ r2; r4  = r3;		\
-	r3 &= r0; r0 ^= r4;		\
-	r3 ^= r2; r2 |= r4;		\
-	r1 ^= r3; r2 ^= r0;		\
-	r0 |= r1; r2 ^= r1;		\
-	r4 ^= r0; r0 |= r3;		\
-	r0 ^= r2; r4 ^= r3;		\
-	r4 ^= r0; r3 =~ r3;		\
-	r2 &= r4; r2 ^= r3;		\
-}
-
-#define S7(r0, r1, r2, r3, r4) {	\
-	r4  = r1; r1 |= r2;		\
-	r1 ^= r3; r4 ^= r2;		\
-	r2 ^= r1; r3 |= r4;		\
-	r3 &= r0; r4 ^= r2;		\
-	r3 ^= r1; r1 |= r4;		\
-	r1 ^= r0; r0 |= r4;		\
-	r0 ^= r2; r1 ^= r4;		\
-	r2 ^= r1; r1 &= r0;		\
-	r1 ^= r4; r2 =~ r2;		\
-	r2 |= r0; r4 ^= r2;		\
-}
-
 // This key schedule is actually a truncated Serpent key schedule
 #define SKS(S, a, b, c, d, x0, x1, x2, x3) {	\
 	uint32_t r0, r1, r2, r3, r4;		\
@@ -161,10 +32,10 @@
 						\
 	S(r0, r1, r2, r3, r4);			\
 						\
-	ctx->sk[i++] = r ## x0;			\
-	ctx->sk[i++] = r ## x1;			\
-	ctx->sk[i++] = r ## x2;			\
-	ctx->sk[i++] = r ## x3;			\
+	sk[i++] = r ## x0;			\
+	sk[i++] = r ## x1;			\
+	sk[i++] = r ## x2;			\
+	sk[i++] = r ## x3;			\
 }
 
 #define SKS0	SKS(S0, w4, w5, w6, w7, 1, 4, 2, 0)
@@ -196,90 +67,23 @@
 	WUP(w7, w2, w4, w6, cc + 3);	\
 }
 
-// The Serpent key addition step
-#define KA(zc, x0, x1, x2, x3) {	\
-	x0 ^= ctx->sk[zc];		\
-	x1 ^= ctx->sk[zc + 1];		\
-	x2 ^= ctx->sk[zc + 2];		\
-	x3 ^= ctx->sk[zc + 3];		\
-}
-
-// The Serpent linear transform
-#define SERPENT_LT(x0, x1, x2, x3) {	\
-	x0 = ROTL32(x0, 13);		\
-	x2 = ROTL32(x2, 3);		\
-	x1 = x1 ^ x0 ^ x2;		\
-	x3 = x3 ^ x2 ^ (x0 << 3);	\
-	x1 = ROTL32(x1, 1);		\
-	x3 = ROTL32(x3, 7);		\
-	x0 = x0 ^ x1 ^ x3;		\
-	x2 = x2 ^ x3 ^ (x1 << 7);	\
-	x0 = ROTL32(x0, 5);		\
-	x2 = ROTL32(x2, 22);		\
-}
-
-/* 
- * One Serpent round
- * zc - current subkey counter
- * S - S-box macro for this round
- * i0 - i4 - input register number
- * o0 - o3 - output register number
-*/
-#define FSS(zc, S, i0, i1, i2, i3, i4, o0, o1, o2, o3) {	\
-	KA(zc, r ## i0, r ## i1, r ## i2, r ## i3);		\
-	S(r ## i0, r ## i1, r ## i2, r ## i3, r ## i4);		\
-	SERPENT_LT(r ## o0, r ## o1, r ## o2, r ## o3);		\
-}
-
-// Last Serpent round. Keep the linear transformation for that last round
-#define FSF(zc, S, i0, i1, i2, i3, i4, o0, o1, o2, o3) {	\
-	KA(zc, r ## i0, r ## i1, r ## i2, r ## i3);		\
-	S(r ## i0, r ## i1, r ## i2, r ## i3, r ## i4);		\
-	SERPENT_LT(r ## o0, r ## o1, r ## o2, r ## o3);		\
-	KA(zc + 4, r ## o0, r ## o1, r ## o2, r ## o3);		\
-}
-
 // This macro computes the special multiplexer, winch chooses between  "x" and "x xor y"
+#ifdef SOSEMANUK_NO_TABLES
+#define XMUX(c, x, y)	((x) ^ ((y) & -((c) & 0x1)))
+#else
 #define XMUX(c, x, y)	((c & 0x1) ? (x ^ y) : x)
+#endif
 
-// Multiplication (alpha * x) and (1/alpha * x)
-#define MUL_A(x)	((x << 8) ^ mul_a[x >> 24])
-#define MUL_G(x)	(((x) >> 8) ^ mul_ia[x & 0xFF])
-
-// Updates the finite state machine
-#define FSM(x1, x3) {				\
-	uint32_t tt, or1;			\
-	tt = XMUX(r1, s ## x1, s ## x3);	\
-	or1 = r1;				\
-	r1 = r2 + tt;				\
-	tt = or1 * 0x54655307;			\
-	r2 = ROTL32(tt, 7);			\
-}
-
-// Updates the shift registres. Value stored in "dd" and "ee"
-#define LRU(x0, x2, x4, dd, ee) {				\
-	dd = s ## x0;						\
-	s ## x0 = MUL_A(s ## x0) ^ MUL_G(s ## x2) ^ s ## x4;	\
-	ee = (s ## x4 + r1) ^ r2;				\
-}
+#define TABLE(table, i)	(table)[i]
 
-// Computes one internal round
-#define STEP(x0, x1, x2, x3, x4, dd, ee) {	\
-	FSM(x1, x3);				\
-	LRU(x0, x2, x4, dd, ee);		\
-}
+// Multiplication (alpha * x) and (1/alpha * x)
+#define MUL_A(x)	MUL_ALPHA(x, TABLE)
+#define MUL_G(x)	DIV_ALPHA(x, TABLE)
 
-// Entry keystream
-#define SRD(S, x0, x1, x2, x3, i) {		\
-	S(u0, u1, u2, u3, u4);			\
-	keystream[i] = U32TO32(((u ## x0) ^ v0));		\
-	keystream[i + 1] = U32TO32(((u ## x1) ^ v1));	\
-	keystream[i + 2] = U32TO32(((u ## x2) ^ v2));	\
-	keystream[i + 3] = U32TO32(((u ## x3) ^ v3));	\
-}
+#ifndef SOSEMANUK_NO_TABLES
 
 // Multiplication by alpha: alpha * x = (x << 8) ^ mul_a[x >> 24]
-uint32_t mul_a[] = {
+const uint32_t mul_a[256] __attribute__((aligned(64))) = {
 	0x00000000, 0xE19FCF13, 0x6B973726, 0x8A08F835,
 	0xD6876E4C, 0x3718A15F, 0xBD10596A, 0x5C8F9679,
 	0x05A7DC98, 0xE438138B, 0x6E30EBBE, 0x8FAF24AD,
@@ -347,7 +151,7 @@ uint32_t mul_a[] = {
 };
 
 // Multiplication by 1/alpha: 1/alpha * x = (x >> 8) ^ mul_ia[x & 0xFF]
-uint32_t mul_ia[] = {
+const uint32_t mul_ia[256] __attribute__((aligned(64))) = {
 	0x00000000, 0x180F40CD, 0x301E8033, 0x2811C0FE,
 	0x603CA966, 0x7833E9AB, 0x50222955, 0x482D6998,
 	0xC078FBCC, 0xD877BB01, 0xF0667BFF, 0xE8693B32,
@@ -414,6 +218,8 @@ uint32_t mul_ia[] = {
 	0x9EE2651C, 0x86ED25D1, 0xAEFCE52F, 0xB6F3A5E2
 };
 
+#endif
+
 
 // Sosemanuk initialization function
 static void
@@ -422,76 +228,83 @@ sosemanuk_init(struct sosemanuk_context *ctx)
 	memset(ctx, 0, sizeof(*ctx));
 }
 
+// Store one Serpent24 output word in the context
+#define IVS(f, x)	st->f = x
+
+// Copy the running state between a context and a struct sosemanuk_state
+#define STATE_COPY(dst, src) {					\
+	memcpy((dst)->s, (src)->s, sizeof((dst)->s));		\
+	(dst)->r1 = (src)->r1;					\
+	(dst)->r2 = (src)->r2;					\
+}
+
+// Load the running state in local variables (any struct with s[10], r1, r2)
+#define STATE_LOAD(st) {	\
+	s0 = (st)->s[0];	\
+	s1 = (st)->s[1];	\
+	s2 = (st)->s[2];	\
+	s3 = (st)->s[3];	\
+	s4 = (st)->s[4];	\
+	s5 = (st)->s[5];	\
+	s6 = (st)->s[6];	\
+	s7 = (st)->s[7];	\
+	s8 = (st)->s[8];	\
+	s9 = (st)->s[9];	\
+	r1 = (st)->r1;		\
+	r2 = (st)->r2;		\
+}
+
+#define STATE_STORE(st) {	\
+	(st)->s[0] = s0;	\
+	(st)->s[1] = s1;	\
+	(st)->s[2] = s2;	\
+	(st)->s[3] = s3;	\
+	(st)->s[4] = s4;	\
+	(st)->s[5] = s5;	\
+	(st)->s[6] = s6;	\
+	(st)->s[7] = s7;	\
+	(st)->s[8] = s8;	\
+	(st)->s[9] = s9;	\
+	(st)->r1 = r1;		\
+	(st)->r2 = r2;		\
+}
+
 // IV injection: using a block cipher Serpent24. Output is used 12th, 18th and 24th rounds Serpent24
-// Subkeys write in array s (ctx->s) and registers r1, r2
+// Subkeys write in array s (st->s) and registers r1, r2
+// sk - Serpent24 subkeys, iv - 16-byte (zero padded) initialization vector
 static void
-sosemanuk_ivsetup(struct sosemanuk_context *ctx)
+sosemanuk_ivsetup(struct sosemanuk_state *st, const uint32_t *sk, const uint8_t *iv)
 {
 	uint32_t r0, r1, r2, r3, r4;
+	STATS_START(t);
 
-	r0 = U8TO32_LITTLE(ctx->iv);
-	r1 = U8TO32_LITTLE(ctx->iv + 4);
-	r2 = U8TO32_LITTLE(ctx->iv + 8);
-	r3 = U8TO32_LITTLE(ctx->iv + 12);
-
-	FSS( 0, S0, 0, 1, 2, 3, 4, 1, 4, 2, 0);
-	FSS( 4, S1, 1, 4, 2, 0, 3, 2, 1, 0, 4);
-	FSS( 8, S2, 2, 1, 0, 4, 3, 0, 4, 1, 3);
-	FSS(12, S3, 0, 4, 1, 3, 2, 4, 1, 3, 2);
-	FSS(16, S4, 4, 1, 3, 2, 0, 1, 0, 4, 2);
-	FSS(20, S5, 1, 0, 4, 2, 3, 0, 2, 1, 4);
-	FSS(24, S6, 0, 2, 1, 4, 3, 0, 2, 3, 1);
-	FSS(28, S7, 0, 2, 3, 1, 4, 4, 1, 2, 0);
-	FSS(32, S0, 4, 1, 2, 0, 3, 1, 3, 2, 4);
-	FSS(36, S1, 1, 3, 2, 4, 0, 2, 1, 4, 3);
-	FSS(40, S2, 2, 1, 4, 3, 0, 4, 3, 1, 0);
-	FSS(44, S3, 4, 3, 1, 0, 2, 3, 1, 0, 2);
-	
-	ctx->s[9] = r3;
-	ctx->s[8] = r1;
-	ctx->s[7] = r0;
-	ctx->s[6] = r2;
-
-	FSS(48, S4, 3, 1, 0, 2, 4, 1, 4, 3, 2);
-	FSS(52, S5, 1, 4, 3, 2, 0, 4, 2, 1, 3);
-	FSS(56, S6, 4, 2, 1, 3, 0, 4, 2, 0, 1);
-	FSS(60, S7, 4, 2, 0, 1, 3, 3, 1, 2, 4);
-	FSS(64, S0, 3, 1, 2, 4, 0, 1, 0, 2, 3);
-	FSS(68, S1, 1, 0, 2, 3, 4, 2, 1, 3, 0);
-
-	ctx->r1 = r2;
-	ctx->s[4] = r1;
-	ctx->r2 = r3;
-	ctx->s[5] = r0;
-
-	FSS(72, S2, 2, 1, 3, 0, 4, 3, 0, 1, 4);
-	FSS(76, S3, 3, 0, 1, 4, 2, 0, 1, 4, 2);
-	FSS(80, S4, 0, 1, 4, 2, 3, 1, 3, 0, 2);
-	FSS(84, S5, 1, 3, 0, 2, 4, 3, 2, 1, 0);
-	FSS(88, S6, 3, 2, 1, 0, 4, 3, 2, 4, 1);
-	FSF(92, S7, 3, 2, 4, 1, 0, 0, 1, 2, 3);
-
-	ctx->s[3] = r0;
-	ctx->s[2] = r1;
-	ctx->s[1] = r2;
-	ctx->s[0] = r3;
+	r0 = U8TO32_LITTLE(iv);
+	r1 = U8TO32_LITTLE(iv + 4);
+	r2 = U8TO32_LITTLE(iv + 8);
+	r3 = U8TO32_LITTLE(iv + 12);
+
+	SERPENT24_IV(IVS);
+
+	STATS_STOP(t, SOSEMANUK_PHASE_IV_SETUP, 1, 0);
 }
 
 // Key schedule: produces 25 128-bit subkeys as 100 32-bit words (write in array sk[100]) 
+// key - 32-byte cipher key; a shorter key is padded as in Serpent: one 0x01 byte, then zeros
 static void
-sosemanuk_keysetup(struct sosemanuk_context *ctx)
+sosemanuk_keysetup(uint32_t *sk, const uint8_t *key)
 {
 	uint32_t w0, w1, w2, w3, w4, w5, w6, w7;
 	int i = 0;
+	STATS_START(t);
 
-	w0 = U8TO32_LITTLE(ctx->key + 0);
-	w1 = U8TO32_LITTLE(ctx->key + 4);
-	w2 = U8TO32_LITTLE(ctx->key + 8);
-	w3 = U8TO32_LITTLE(ctx->key + 12);
-	w4 = U8TO32_LITTLE(ctx->key + 16);
-	w5 = U8TO32_LITTLE(ctx->key + 20);
-	w6 = U8TO32_LITTLE(ctx->key + 24);
-	w7 = U8TO32_LITTLE(ctx->key + 28);
+	w0 = U8TO32_LITTLE(key + 0);
+	w1 = U8TO32_LITTLE(key + 4);
+	w2 = U8TO32_LITTLE(key + 8);
+	w3 = U8TO32_LITTLE(key + 12);
+	w4 = U8TO32_LITTLE(key + 16);
+	w5 = U8TO32_LITTLE(key + 20);
+	w6 = U8TO32_LITTLE(key + 24);
+	w7 = U8TO32_LITTLE(key + 28);
 
 	WUP0(0);  SKS3; 
 	WUP1(4);  SKS2; 
@@ -519,7 +332,7 @@ sosemanuk_keysetup(struct sosemanuk_context *ctx)
 	WUP1(92); SKS4; 
 	WUP0(96); SKS3;
 
-	sosemanuk_ivsetup(ctx);
+	STATS_STOP(t, SOSEMANUK_PHASE_KEY_SETUP, 1, 0);
 }
 
 // Fill the sosemanuk_context (key and iv)
@@ -527,6 +340,8 @@ sosemanuk_keysetup(struct sosemanuk_context *ctx)
 int
 sosemanuk_set_key_and_iv(struct sosemanuk_context *ctx, const uint8_t *key, const int keylen, const uint8_t iv[16], const int ivlen)
 {
+	struct sosemanuk_state st;
+
 	sosemanuk_init(ctx);
 
 	if((keylen > 0) && (keylen <= SOSEMANUK))
@@ -540,80 +355,216 @@ sosemanuk_set_key_and_iv(struct sosemanuk_context *ctx, const uint8_t *key, cons
 		return -1;
 	
 	memcpy(ctx->key, key, ctx->keylen);
+	if(ctx->keylen < SOSEMANUK)
+		ctx->key[ctx->keylen] = 0x01;
 	memcpy(ctx->iv, iv, ctx->ivlen);
 	
-	sosemanuk_keysetup(ctx);
+	sosemanuk_keysetup(ctx->sk, ctx->key);
+	sosemanuk_ivsetup(&st, ctx->sk, ctx->iv);
+	STATE_COPY(ctx, &st);
+
+	return 0;
+}
+
+// Prepare a key for sosemanuk_set_iv: runs the Serpent24 key schedule once
+// Return value: 0 (if all is well), -1 (is all bad)
+int
+sosemanuk_set_key(struct sosemanuk_key *kctx, const uint8_t *key, const int keylen)
+{
+	if((keylen <= 0) || (keylen > SOSEMANUK))
+		return -1;
+
+	memset(kctx->key, 0, sizeof(kctx->key));
+	memcpy(kctx->key, key, keylen);
+	if(keylen < SOSEMANUK)
+		kctx->key[keylen] = 0x01;
+	kctx->keylen = keylen;
+
+	sosemanuk_keysetup(kctx->sk, kctx->key);
+
+	return 0;
+}
+
+// Start a new stream under a prepared key: only the IV injection is computed.
+// ctx->sk is not filled in, the subkeys stay in the key object
+// Return value: 0 (if all is well), -1 (is all bad)
+int
+sosemanuk_set_iv(struct sosemanuk_context *ctx, const struct sosemanuk_key *kctx, const uint8_t *iv, const int ivlen)
+{
+	struct sosemanuk_state st;
+
+	if((ivlen <= 0) || (ivlen > 16))
+		return -1;
+
+	ctx->keylen = kctx->keylen;
+	memcpy(ctx->key, kctx->key, sizeof(ctx->key));
+
+	ctx->ivlen = ivlen;
+	memset(ctx->iv, 0, sizeof(ctx->iv));
+	memcpy(ctx->iv, iv, ivlen);
+
+	sosemanuk_ivsetup(&st, kctx->sk, ctx->iv);
+	STATE_COPY(ctx, &st);
+	ctx->avail = 0;
+
+	return 0;
+}
+
+// sosemanuk_set_iv for a compact state: nothing but the running state is written
+// Return value: 0 (if all is well), -1 (is all bad)
+int
+sosemanuk_state_set_iv(struct sosemanuk_state *st, const struct sosemanuk_key *kctx, const uint8_t *iv, const int ivlen)
+{
+	uint8_t ivpad[16];
+
+	if((ivlen <= 0) || (ivlen > 16))
+		return -1;
+
+	memset(ivpad, 0, sizeof(ivpad));
+	memcpy(ivpad, iv, ivlen);
+
+	sosemanuk_ivsetup(st, kctx->sk, ivpad);
 
 	return 0;
 }
 
+// One block without a statistics sample, for the kernels that count their own calls
+void
+sosemanuk_generate_keystream_ref(struct sosemanuk_context *ctx, uint32_t *keystream)
+{
+	uint32_t r1, r2, u0, u1, u2, u3, u4, v0, v1, v2, v3;
+	uint32_t s0, s1, s2, s3, s4, s5, s6, s7, s8, s9;
+	uint32_t tt, or1;
+
+	STATE_LOAD(ctx);
+
+	SOSEMANUK_BLOCK;
+
+	STATE_STORE(ctx);
+}
+
 // Function generate keystream
 void
 sosemanuk_generate_keystream(struct sosemanuk_context *ctx, uint32_t *keystream)
 {
 	uint32_t r1, r2, u0, u1, u2, u3, u4, v0, v1, v2, v3;
 	uint32_t s0, s1, s2, s3, s4, s5, s6, s7, s8, s9;
+	uint32_t tt, or1;
+	STATS_START(t);
 
-	s0 = ctx->s[0];
-	s1 = ctx->s[1];
-	s2 = ctx->s[2];
-	s3 = ctx->s[3];
-	s4 = ctx->s[4];
-	s5 = ctx->s[5];
-	s6 = ctx->s[6];
-	s7 = ctx->s[7];
-	s8 = ctx->s[8];
-	s9 = ctx->s[9];
-	r1 = ctx->r1;
-	r2 = ctx->r2;
-
-	STEP(0, 1, 3, 8, 9, v0, u0);
-	STEP(1, 2, 4, 9, 0, v1, u1);
-	STEP(2, 3, 5, 0, 1, v2, u2);
-	STEP(3, 4, 6, 1, 2, v3, u3);
-
-	SRD(S2, 2, 3, 1, 4, 0);
-
-	STEP(4, 5, 7, 2, 3, v0, u0);
-	STEP(5, 6, 8, 3, 4, v1, u1);
-	STEP(6, 7, 9, 4, 5, v2, u2);
-	STEP(7, 8, 0, 5, 6, v3, u3);
-
-	SRD(S2, 2, 3, 1, 4, 4);
-
-	STEP(8, 9, 1, 6, 7, v0, u0);
-	STEP(9, 0, 2, 7, 8, v1, u1);
-	STEP(0, 1, 3, 8, 9, v2, u2);
-	STEP(1, 2, 4, 9, 0, v3, u3);
-
-	SRD(S2, 2, 3, 1, 4, 8);
-
-	STEP(2, 3, 5, 0, 1, v0, u0);
-	STEP(3, 4, 6, 1, 2, v1, u1);
-	STEP(4, 5, 7, 2, 3, v2, u2);
-	STEP(5, 6, 8, 3, 4, v3, u3);
-	
-	SRD(S2, 2, 3, 1, 4, 12);
+	STATE_LOAD(ctx);
+
+	SOSEMANUK_BLOCK;
+
+	STATE_STORE(ctx);
+
+	STATS_STOP(t, SOSEMANUK_PHASE_KEYSTREAM, 1, 80);
+}
+
+void
+sosemanuk_state_generate_keystream(struct sosemanuk_state *st, uint32_t *keystream)
+{
+	uint32_t r1, r2, u0, u1, u2, u3, u4, v0, v1, v2, v3;
+	uint32_t s0, s1, s2, s3, s4, s5, s6, s7, s8, s9;
+	uint32_t tt, or1;
+	STATS_START(t);
+
+	STATE_LOAD(st);
+
+	SOSEMANUK_BLOCK;
+
+	STATE_STORE(st);
+
+	STATS_STOP(t, SOSEMANUK_PHASE_KEYSTREAM, 1, 80);
+}
+
+/*
+ * Generate nblocks keystream blocks (80 * nblocks bytes) into keystream
+ * The state is loaded once and stays in registers across the blocks
+*/
+void
+sosemanuk_generate_keystream_blocks(struct sosemanuk_context *ctx, uint32_t *keystream, size_t nblocks)
+{
+	uint32_t r1, r2, u0, u1, u2, u3, u4, v0, v1, v2, v3;
+	uint32_t s0, s1, s2, s3, s4, s5, s6, s7, s8, s9;
+	uint32_t tt, or1;
+	size_t i;
+	STATS_START(t);
+
+	STATE_LOAD(ctx);
+
+	for(i = 0; i < nblocks; i++, keystream += 20)
+		SOSEMANUK_BLOCK;
+
+	STATE_STORE(ctx);
+
+	STATS_STOP(t, SOSEMANUK_PHASE_KEYSTREAM, nblocks, 80 * nblocks);
+}
+
+void
+sosemanuk_state_generate_keystream_blocks(struct sosemanuk_state *st, uint32_t *keystream, size_t nblocks)
+{
+	uint32_t r1, r2, u0, u1, u2, u3, u4, v0, v1, v2, v3;
+	uint32_t s0, s1, s2, s3, s4, s5, s6, s7, s8, s9;
+	uint32_t tt, or1;
+	size_t i;
+	STATS_START(t);
+
+	STATE_LOAD(st);
+
+	for(i = 0; i < nblocks; i++, keystream += 20)
+		SOSEMANUK_BLOCK;
+
+	STATE_STORE(st);
+
+	STATS_STOP(t, SOSEMANUK_PHASE_KEYSTREAM, nblocks, 80 * nblocks);
+}
+
+// Running state to 48 bytes (little-endian words s[0..9], r1, r2)
+void
+sosemanuk_state_export(const struct sosemanuk_state *st, uint8_t *out)
+{
+	int i;
+
+	for(i = 0; i < 10; i++, out += 4)
+		U32TO8_LITTLE(out, st->s[i]);
 
-	STEP(6, 7, 9, 4, 5, v0, u0);
-	STEP(7, 8, 0, 5, 6, v1, u1);
-	STEP(8, 9, 1, 6, 7, v2, u2);
-	STEP(9, 0, 2, 7, 8, v3, u3);
+	U32TO8_LITTLE(out, st->r1);
+	out += 4;
+	U32TO8_LITTLE(out, st->r2);
+}
+
+void
+sosemanuk_state_import(struct sosemanuk_state *st, const uint8_t *in)
+{
+	int i;
+
+	for(i = 0; i < 10; i++, in += 4)
+		st->s[i] = U8TO32_LITTLE(in);
+
+	st->r1 = U8TO32_LITTLE(in);
+	st->r2 = U8TO32_LITTLE(in + 4);
+}
+
+void
+sosemanuk_export_state(const struct sosemanuk_context *ctx, uint8_t *out)
+{
+	struct sosemanuk_state st;
+
+	STATE_COPY(&st, ctx);
+	sosemanuk_state_export(&st, out);
+	sosemanuk_wipe(&st, sizeof(st));
+}
 
-	SRD(S2, 2, 3, 1, 4, 16);
+void
+sosemanuk_import_state(struct sosemanuk_context *ctx, const uint8_t *in)
+{
+	struct sosemanuk_state st;
 
-	ctx->s[0] = s0;
-	ctx->s[1] = s1;
-	ctx->s[2] = s2;
-	ctx->s[3] = s3;
-	ctx->s[4] = s4;
-	ctx->s[5] = s5;
-	ctx->s[6] = s6;
-	ctx->s[7] = s7;
-	ctx->s[8] = s8;
-	ctx->s[9] = s9;
-	ctx->r1 = r1;
-	ctx->r2 = r2;
+	sosemanuk_state_import(&st, in);
+	STATE_COPY(ctx, &st);
+	ctx->avail = 0;
+	sosemanuk_wipe(&st, sizeof(st));
 }
 
 /*
@@ -625,41 +576,199 @@ sosemanuk_generate_keystream(struct sosemanuk_context *ctx, uint32_t *keystream)
 */
 void
 sosemanuk_crypt(struct sosemanuk_context *ctx, const uint8_t *buf, uint32_t buflen, uint8_t *out)
+{
+	sosemanuk_impl->crypt(ctx, buf, buflen, out);
+}
+
+// Portable sosemanuk_crypt, used when no SIMD implementation is available
+void
+sosemanuk_crypt_ref(struct sosemanuk_context *ctx, const uint8_t *buf, size_t buflen, uint8_t *out)
 {
 	uint32_t keystream[20];
-	uint32_t i;
 
 	for(; buflen >= 80; buflen -= 80, buf += 80, out += 80) {
 		sosemanuk_generate_keystream(ctx, keystream);
-		
-		*(uint32_t *)(out +  0) = *(uint32_t *)(buf +  0) ^ keystream[ 0];
-		*(uint32_t *)(out +  4) = *(uint32_t *)(buf +  4) ^ keystream[ 1];
-		*(uint32_t *)(out +  8) = *(uint32_t *)(buf +  8) ^ keystream[ 2];
-		*(uint32_t *)(out + 12) = *(uint32_t *)(buf + 12) ^ keystream[ 3];
-		*(uint32_t *)(out + 16) = *(uint32_t *)(buf + 16) ^ keystream[ 4];
-		*(uint32_t *)(out + 20) = *(uint32_t *)(buf + 20) ^ keystream[ 5];
-		*(uint32_t *)(out + 24) = *(uint32_t *)(buf + 24) ^ keystream[ 6];
-		*(uint32_t *)(out + 28) = *(uint32_t *)(buf + 28) ^ keystream[ 7];
-		*(uint32_t *)(out + 32) = *(uint32_t *)(buf + 32) ^ keystream[ 8];
-		*(uint32_t *)(out + 36) = *(uint32_t *)(buf + 36) ^ keystream[ 9];
-		*(uint32_t *)(out + 40) = *(uint32_t *)(buf + 40) ^ keystream[10];
-		*(uint32_t *)(out + 44) = *(uint32_t *)(buf + 44) ^ keystream[11];
-		*(uint32_t *)(out + 48) = *(uint32_t *)(buf + 48) ^ keystream[12];
-		*(uint32_t *)(out + 52) = *(uint32_t *)(buf + 52) ^ keystream[13];
-		*(uint32_t *)(out + 56) = *(uint32_t *)(buf + 56) ^ keystream[14];
-		*(uint32_t *)(out + 60) = *(uint32_t *)(buf + 60) ^ keystream[15];
-		*(uint32_t *)(out + 64) = *(uint32_t *)(buf + 64) ^ keystream[16];
-		*(uint32_t *)(out + 68) = *(uint32_t *)(buf + 68) ^ keystream[17];
-		*(uint32_t *)(out + 72) = *(uint32_t *)(buf + 72) ^ keystream[18];
-		*(uint32_t *)(out + 76) = *(uint32_t *)(buf + 76) ^ keystream[19];
+		sosemanuk_xor_ref(out, buf, (uint8_t *)keystream, 80);
 	}
 
 	if(buflen > 0) {
 		sosemanuk_generate_keystream(ctx, keystream);	
-	
-		for(i = 0; i < buflen; i++)
-			out[i] = buf[i] ^ ((uint8_t *)keystream)[i];
+		sosemanuk_xor_ref(out, buf, (uint8_t *)keystream, buflen);
+	}
+}
+
+// XOR "len" bytes of data with keystream bytes
+void
+sosemanuk_xor_ref(uint8_t *out, const uint8_t *buf, const uint8_t *ks, size_t len)
+{
+	size_t i;
+	STATS_START(t);
+
+	for(i = 0; i < len; i++)
+		out[i] = buf[i] ^ ks[i];
+
+	STATS_STOP(t, SOSEMANUK_PHASE_XOR, 1, len);
+}
+
+// memset through a volatile pointer, the compiler cannot prove the buffer is dead
+static void *(*const volatile wipe_memset)(void *, int, size_t) = memset;
+
+void
+sosemanuk_wipe(void *p, size_t len)
+{
+	wipe_memset(p, 0, len);
+}
+
+// Non-temporal stores are only used by SIMD kernels: nothing to complete
+void
+sosemanuk_store_fence_ref(void)
+{
+}
+
+/*
+ * Sosemanuk streaming crypt function
+ * ctx - pointer on sosemanuk_context
+ * buf - pointer on buffer data (fragment of the message)
+ * buflen - length the data buffer, any value
+ * out - pointer on output
+ * The keystream left over from the previous call is used first
+*/
+void
+sosemanuk_stream_crypt(struct sosemanuk_context *ctx, const uint8_t *buf, size_t buflen, uint8_t *out)
+{
+	size_t n;
+
+	if(ctx->avail > 0) {
+		n = (buflen < ctx->avail) ? buflen : ctx->avail;
+
+		sosemanuk_impl->xor_bytes(out, buf, (uint8_t *)ctx->keystream + 80 - ctx->avail, n);
+
+		ctx->avail -= n;
+		buflen -= n;
+		buf += n;
+		out += n;
+	}
+
+	// Whole blocks: nothing is left over, the bulk path applies
+	n = buflen - buflen % 80;
+	sosemanuk_crypt_bulk(ctx, buf, n, out);
+	buflen -= n;
+	buf += n;
+	out += n;
+
+	if(buflen > 0) {
+		sosemanuk_generate_keystream(ctx, ctx->keystream);
+		sosemanuk_impl->xor_bytes(out, buf, (uint8_t *)ctx->keystream, buflen);
+		ctx->avail = 80 - buflen;
+	}
+}
+
+/*
+ * Sosemanuk scatter/gather crypt function
+ * ctx - pointer on sosemanuk_context
+ * in, incnt - segments of the data
+ * out, outcnt - segments of the output (NULL: in place)
+ * Every step covers the overlap of the current input and output segments
+*/
+int
+sosemanuk_crypt_iov(struct sosemanuk_context *ctx, const struct iovec *in, int incnt, const struct iovec *out, int outcnt)
+{
+	size_t inlen = 0, outlen = 0, inpos = 0, outpos = 0, n;
+	int i, j;
+
+	if(!out) {
+		out = in;
+		outcnt = incnt;
+	}
+
+	for(i = 0; i < incnt; i++)
+		inlen += in[i].iov_len;
+	for(j = 0; j < outcnt; j++)
+		outlen += out[j].iov_len;
+	if(outlen < inlen)
+		return -1;
+
+	for(i = 0, j = 0; i < incnt; ) {
+		if(inpos == in[i].iov_len) {
+			i++;
+			inpos = 0;
+			continue;
+		}
+		if(outpos == out[j].iov_len) {
+			j++;
+			outpos = 0;
+			continue;
+		}
+
+		n = in[i].iov_len - inpos;
+		if(n > out[j].iov_len - outpos)
+			n = out[j].iov_len - outpos;
+
+		sosemanuk_stream_crypt(ctx, (const uint8_t *)in[i].iov_base + inpos, n, (uint8_t *)out[j].iov_base + outpos);
+
+		inpos += n;
+		outpos += n;
 	}
+
+	return 0;
+}
+
+// Blocks of keystream generated ahead by sosemanuk_crypt_bulk
+#define BULK_BLOCKS	16
+
+// Outputs at least this long bypass the cache (non-temporal stores)
+#define BULK_NT_THRESHOLD	(4 << 20)
+
+/*
+ * Sosemanuk crypt function for buffers of any size, on a compact state
+ * st - pointer on sosemanuk_state
+ * buf - pointer on buffer data
+ * buflen - length the data buffer
+ * out - pointer on output
+ * Same result as sosemanuk_crypt. The keystream is generated BULK_BLOCKS blocks
+ * ahead into an aligned buffer (one call, the state stays in registers) and
+ * XORed with the widest vectors available
+*/
+void
+sosemanuk_state_crypt(struct sosemanuk_state *st, const uint8_t *buf, size_t buflen, uint8_t *out)
+{
+	const struct sosemanuk_impl *impl = sosemanuk_impl;
+	uint32_t keystream[BULK_BLOCKS * 20] __attribute__((aligned(64)));
+	void (*xor_bytes)(uint8_t *, const uint8_t *, const uint8_t *, size_t);
+	size_t n, used = 0;
+
+	xor_bytes = (buflen >= BULK_NT_THRESHOLD) ? impl->xor_nt : impl->xor_bytes;
+
+	while(buflen > 0) {
+		n = (buflen < sizeof(keystream)) ? buflen : sizeof(keystream);
+
+		sosemanuk_state_generate_keystream_blocks(st, keystream, (n + 79) / 80);
+		if(used < (n + 79) / 80 * 80)
+			used = (n + 79) / 80 * 80;
+
+		xor_bytes(out, buf, (uint8_t *)keystream, n);
+
+		buflen -= n;
+		buf += n;
+		out += n;
+	}
+
+	// Only the blocks generated were written: a short message wipes one block, not the whole buffer
+	sosemanuk_wipe(keystream, used);
+
+	if(xor_bytes == impl->xor_nt)
+		impl->store_fence();
+}
+
+// sosemanuk_state_crypt on the running state of a context
+void
+sosemanuk_crypt_bulk(struct sosemanuk_context *ctx, const uint8_t *buf, size_t buflen, uint8_t *out)
+{
+	struct sosemanuk_state st;
+
+	STATE_COPY(&st, ctx);
+	sosemanuk_state_crypt(&st, buf, buflen, out);
+	STATE_COPY(ctx, &st);
 }
 
 #if __BYTE_ORDER == __BIG_ENDIAN
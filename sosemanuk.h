@@ -8,6 +8,10 @@
 #ifndef SOSEMANUK_H
 #define SOSEMANUK_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
 /*
  * Sosemanuk context
  * keylen - chipher key length in bytes
@@ -18,6 +22,8 @@
  * s - array internal cipher state
  * r1 - internal cipher state
  * r2 - internal cipher state
+ * keystream - last keystream block of sosemanuk_stream_crypt
+ * avail - unused bytes left at the end of keystream
 */
 struct sosemanuk_context {
 	int keylen;
@@ -28,14 +34,176 @@ struct sosemanuk_context {
 	uint32_t s[10];
 	uint32_t r1;
 	uint32_t r2;
+	uint32_t keystream[20];
+	uint32_t avail;
+};
+
+/*
+ * Prepared key, shared by any number of streams (see sosemanuk_set_iv)
+ * keylen - chipher key length in bytes
+ * key - chiper key
+ * sk - array subkey for Serpent24
+*/
+struct sosemanuk_key {
+	int keylen;
+	uint8_t key[32];
+	uint32_t sk[100];
 };
 
+/*
+ * Compact running state of one stream: only the words read on every block,
+ * 48 bytes in one cache line. The key material stays in a struct sosemanuk_key
+ * shared by all the streams started from it
+ * s - array internal cipher state
+ * r1 - internal cipher state
+ * r2 - internal cipher state
+*/
+struct sosemanuk_state {
+	uint32_t s[10];
+	uint32_t r1;
+	uint32_t r2;
+} __attribute__((aligned(64)));
+
 int sosemanuk_set_key_and_iv(struct sosemanuk_context *ctx, const uint8_t *key, const int keylen, const uint8_t iv[16], const int ivlen);
 
+int sosemanuk_set_key(struct sosemanuk_key *kctx, const uint8_t *key, const int keylen);
+
+int sosemanuk_set_iv(struct sosemanuk_context *ctx, const struct sosemanuk_key *kctx, const uint8_t *iv, const int ivlen);
+
 void sosemanuk_crypt(struct sosemanuk_context *ctx, const uint8_t *buf, uint32_t buflen, uint8_t *out);
 
+/*
+ * sosemanuk_crypt for buffers of any size (64-bit lengths), tuned for large
+ * buffers: several keystream blocks are generated ahead and XORed with vector
+ * loads and stores, very large outputs are written around the cache
+*/
+void sosemanuk_crypt_bulk(struct sosemanuk_context *ctx, const uint8_t *buf, size_t buflen, uint8_t *out);
+
+/*
+ * Streaming variant of sosemanuk_crypt: the unused tail of the last keystream
+ * block is kept in the context, so a message may be passed in fragments of any
+ * size and gives the same output as one call on the whole message
+*/
+void sosemanuk_stream_crypt(struct sosemanuk_context *ctx, const uint8_t *buf, size_t buflen, uint8_t *out);
+
+/*
+ * sosemanuk_stream_crypt on a message spread over segments: the keystream runs
+ * on across segment boundaries. in and out may be cut differently; out may be
+ * NULL (or the same array) to encrypt in place
+ * Return value: 0 (if all is well), -1 (out is shorter than in)
+*/
+int sosemanuk_crypt_iov(struct sosemanuk_context *ctx, const struct iovec *in, int incnt, const struct iovec *out, int outcnt);
+
 void sosemanuk_test_vectors(struct sosemanuk_context *ctx);
 
 void sosemanuk_generate_keystream(struct sosemanuk_context *ctx, uint32_t *keystream);
 
+/*
+ * Generate nblocks consecutive blocks (80 * nblocks bytes) in one call, same
+ * result as nblocks calls of sosemanuk_generate_keystream. The running state
+ * is loaded and stored once, not once per block
+*/
+void sosemanuk_generate_keystream_blocks(struct sosemanuk_context *ctx, uint32_t *keystream, size_t nblocks);
+
+/*
+ * Same operations on a struct sosemanuk_state. sosemanuk_state_crypt behaves
+ * like sosemanuk_crypt_bulk: the unused tail of the last block is dropped
+*/
+int sosemanuk_state_set_iv(struct sosemanuk_state *st, const struct sosemanuk_key *kctx, const uint8_t *iv, const int ivlen);
+
+void sosemanuk_state_generate_keystream(struct sosemanuk_state *st, uint32_t *keystream);
+
+void sosemanuk_state_generate_keystream_blocks(struct sosemanuk_state *st, uint32_t *keystream, size_t nblocks);
+
+void sosemanuk_state_crypt(struct sosemanuk_state *st, const uint8_t *buf, size_t buflen, uint8_t *out);
+
+/*
+ * Running state as SOSEMANUK_STATE_BYTES bytes: s[0..9], r1, r2 as
+ * little-endian words. Whoever holds it can produce the rest of the keystream,
+ * it must be protected like the key. Importing into a context drops the
+ * keystream left over by sosemanuk_stream_crypt
+*/
+#define SOSEMANUK_STATE_BYTES	48
+
+void sosemanuk_state_export(const struct sosemanuk_state *st, uint8_t *out);
+
+void sosemanuk_state_import(struct sosemanuk_state *st, const uint8_t *in);
+
+void sosemanuk_export_state(const struct sosemanuk_context *ctx, uint8_t *out);
+
+void sosemanuk_import_state(struct sosemanuk_context *ctx, const uint8_t *in);
+
+/*
+ * Multi-lane running state: 4 (SSE2), 8 (AVX2) or 16 (AVX-512) independent
+ * streams processed together. Word j of lane n is stored in s[j][n], r1[n], r2[n].
+ * Lanes are filled from prepared contexts with sosemanuk_load_x4/x8/x16 and
+ * written back with sosemanuk_store_x4/x8/x16.
+*/
+struct sosemanuk_context_x4 {
+	uint32_t s[10][4];
+	uint32_t r1[4];
+	uint32_t r2[4];
+};
+
+struct sosemanuk_context_x8 {
+	uint32_t s[10][8];
+	uint32_t r1[8];
+	uint32_t r2[8];
+};
+
+struct sosemanuk_context_x16 {
+	uint32_t s[10][16];
+	uint32_t r1[16];
+	uint32_t r2[16];
+};
+
+void sosemanuk_load_x4(struct sosemanuk_context_x4 *xctx, struct sosemanuk_context *const ctx[4]);
+
+void sosemanuk_store_x4(const struct sosemanuk_context_x4 *xctx, struct sosemanuk_context *const ctx[4]);
+
+void sosemanuk_load_x8(struct sosemanuk_context_x8 *xctx, struct sosemanuk_context *const ctx[8]);
+
+void sosemanuk_store_x8(const struct sosemanuk_context_x8 *xctx, struct sosemanuk_context *const ctx[8]);
+
+void sosemanuk_load_x16(struct sosemanuk_context_x16 *xctx, struct sosemanuk_context *const ctx[16]);
+
+void sosemanuk_store_x16(const struct sosemanuk_context_x16 *xctx, struct sosemanuk_context *const ctx[16]);
+
+/*
+ * Generate one 80-byte block for every lane
+ * keystream - 20 * lanes words, lane-interleaved: word i of lane n is keystream[i * lanes + n]
+*/
+void sosemanuk_generate_keystream_x4(struct sosemanuk_context_x4 *xctx, uint32_t *keystream);
+
+void sosemanuk_generate_keystream_x8(struct sosemanuk_context_x8 *xctx, uint32_t *keystream);
+
+/*
+ * Generate one 80-byte block for each of the 16 lanes
+ * keystream - 320 words, one block per lane: lane n gets keystream[20 * n .. 20 * n + 19],
+ * the same bytes as sosemanuk_generate_keystream on that stream
+*/
+void sosemanuk_generate_keystream_x16(struct sosemanuk_context_x16 *xctx, uint32_t *keystream);
+
+/*
+ * Start n streams under one prepared key, same result as n calls of sosemanuk_set_iv.
+ * The Serpent24 IV injection runs on 4, 8 or 16 IVs at once
+*/
+int sosemanuk_set_iv_batch(struct sosemanuk_context *const ctx[], const struct sosemanuk_key *kctx, const uint8_t *const iv[], const int ivlen, size_t n);
+
+// CPU features used by the runtime dispatch
+#define SOSEMANUK_CPU_SSE2	0x01
+#define SOSEMANUK_CPU_AVX2	0x04
+#define SOSEMANUK_CPU_AVX512	0x08
+
+/*
+ * Runtime dispatch: the CPU is probed once at startup and sosemanuk_crypt, the
+ * XOR loops and the multi-lane kernels are bound to the best implementation.
+ * sosemanuk_cpu_select restricts the choice to a subset of the features.
+*/
+unsigned int sosemanuk_cpu_features(void);
+
+unsigned int sosemanuk_cpu_select(unsigned int features);
+
+const char *sosemanuk_impl_name(void);
+
 #endif
@@ -0,0 +1,411 @@
+/*
+ * Batch encryption on a work-stealing pool (see sosemanuk_batch.h).
+ *
+ * A batch is cut into tasks: one task per large job or per running context,
+ * one task per group of up to 16 small new streams (multi-lane kernel).
+ * Tasks are dealt round-robin into the per-worker deques. A worker pops from
+ * the tail of its own deque and steals from the head of the others; it sleeps
+ * only when no task is pending anywhere.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "sosemanuk.h"
+#include "sosemanuk_internal.h"
+#include "sosemanuk_batch.h"
+
+// New streams up to this length are grouped on the multi-lane kernel
+#define BATCH_SMALL	2048
+#define BATCH_LANES	16
+
+struct batch_task {
+	struct sosemanuk_batch *batch;
+	struct sosemanuk_job *job[BATCH_LANES];
+	int count;
+	int lanes;
+};
+
+struct sosemanuk_batch {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t remaining;
+	int complete;
+	struct sosemanuk_job *jobs;
+	size_t n;
+	void (*done)(void *arg, struct sosemanuk_job *jobs, size_t n);
+	void *arg;
+	size_t ntasks;
+	struct batch_task task[];
+};
+
+// Ring of task pointers, grown on demand
+struct batch_deque {
+	pthread_mutex_t lock;
+	struct batch_task **task;
+	size_t head;
+	size_t tail;
+	size_t size;
+} __attribute__((aligned(64)));
+
+struct batch_worker {
+	struct sosemanuk_batch_pool *pool;
+	int id;
+	pthread_t thread;
+};
+
+struct sosemanuk_batch_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	size_t pending;
+	int stop;
+	int threads;
+	unsigned int next;
+	struct batch_deque *deque;
+	struct batch_worker *worker;
+};
+
+static int
+deque_push(struct batch_deque *dq, struct batch_task *task)
+{
+	struct batch_task **grown;
+	size_t i, count;
+
+	pthread_mutex_lock(&dq->lock);
+
+	count = dq->tail - dq->head;
+	if(count == dq->size) {
+		grown = malloc(sizeof(*grown) * (dq->size ? dq->size * 2 : 64));
+		if(!grown) {
+			pthread_mutex_unlock(&dq->lock);
+			return -1;
+		}
+		for(i = 0; i < count; i++)
+			grown[i] = dq->task[(dq->head + i) % dq->size];
+		free(dq->task);
+		dq->task = grown;
+		dq->size = dq->size ? dq->size * 2 : 64;
+		dq->head = 0;
+		dq->tail = count;
+	}
+
+	dq->task[dq->tail++ % dq->size] = task;
+
+	pthread_mutex_unlock(&dq->lock);
+	return 0;
+}
+
+// Owner side: newest task first, its data is still in cache
+static struct batch_task *
+deque_pop(struct batch_deque *dq)
+{
+	struct batch_task *task = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if(dq->tail != dq->head)
+		task = dq->task[--dq->tail % dq->size];
+	pthread_mutex_unlock(&dq->lock);
+
+	return task;
+}
+
+// Thief side: oldest task first
+static struct batch_task *
+deque_steal(struct batch_deque *dq)
+{
+	struct batch_task *task = NULL;
+
+	if(pthread_mutex_trylock(&dq->lock))
+		return NULL;
+	if(dq->tail != dq->head)
+		task = dq->task[dq->head++ % dq->size];
+	pthread_mutex_unlock(&dq->lock);
+
+	return task;
+}
+
+static void
+batch_run_job(struct sosemanuk_job *job)
+{
+	struct sosemanuk_state st;
+
+	if(job->ctx) {
+		sosemanuk_crypt_bulk(job->ctx, job->buf, job->buflen, job->out);
+		job->status = 0;
+	} else if(job->key && sosemanuk_state_set_iv(&st, job->key, job->iv, job->ivlen) == 0) {
+		sosemanuk_state_crypt(&st, job->buf, job->buflen, job->out);
+		sosemanuk_wipe(&st, sizeof(st));
+		job->status = 0;
+	} else {
+		job->status = -1;
+	}
+}
+
+// Up to 16 new streams on the multi-lane kernel, unused lanes run on a zero state
+static void
+batch_run_lanes(struct sosemanuk_job *const *job, int count)
+{
+	struct sosemanuk_context lane[BATCH_LANES], *ctx[BATCH_LANES];
+	struct sosemanuk_context_x16 xctx;
+	uint32_t keystream[20 * BATCH_LANES];
+	const uint8_t *iv[BATCH_LANES];
+	size_t blocks = 0, pos, n;
+	int k, same = 1;
+
+	memset(lane, 0, sizeof(lane));
+
+	for(k = 0; k < count; k++) {
+		ctx[k] = &lane[k];
+		iv[k] = job[k]->iv;
+		if(job[k]->key != job[0]->key || job[k]->ivlen != job[0]->ivlen)
+			same = 0;
+		if((job[k]->buflen + 79) / 80 > blocks)
+			blocks = (job[k]->buflen + 79) / 80;
+	}
+	for(; k < BATCH_LANES; k++)
+		ctx[k] = &lane[k];
+
+	if(same) {
+		sosemanuk_set_iv_batch(ctx, job[0]->key, iv, job[0]->ivlen, count);
+	} else {
+		for(k = 0; k < count; k++)
+			sosemanuk_set_iv(ctx[k], job[k]->key, iv[k], job[k]->ivlen);
+	}
+
+	sosemanuk_load_x16(&xctx, ctx);
+
+	for(pos = 0; pos < blocks * 80; pos += 80) {
+		sosemanuk_generate_keystream_x16(&xctx, keystream);
+
+		for(k = 0; k < count; k++) {
+			if(job[k]->buflen <= pos)
+				continue;
+
+			n = (job[k]->buflen - pos < 80) ? job[k]->buflen - pos : 80;
+			sosemanuk_impl->xor_bytes(job[k]->out + pos, job[k]->buf + pos, (uint8_t *)(keystream + 20 * k), n);
+		}
+	}
+
+	for(k = 0; k < count; k++)
+		job[k]->status = 0;
+
+	sosemanuk_wipe(lane, sizeof(lane));
+	sosemanuk_wipe(&xctx, sizeof(xctx));
+	sosemanuk_wipe(keystream, sizeof(keystream));
+}
+
+static void
+batch_run_task(struct batch_task *task)
+{
+	struct sosemanuk_batch *batch = task->batch;
+
+	if(task->lanes)
+		batch_run_lanes(task->job, task->count);
+	else
+		batch_run_job(task->job[0]);
+
+	if(__atomic_sub_fetch(&batch->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+		if(batch->done)
+			batch->done(batch->arg, batch->jobs, batch->n);
+
+		pthread_mutex_lock(&batch->lock);
+		batch->complete = 1;
+		pthread_cond_broadcast(&batch->cond);
+		pthread_mutex_unlock(&batch->lock);
+	}
+}
+
+static void *
+batch_worker(void *arg)
+{
+	struct batch_worker *self = arg;
+	struct sosemanuk_batch_pool *pool = self->pool;
+	struct batch_task *task;
+	int i;
+
+	for(;;) {
+		task = deque_pop(&pool->deque[self->id]);
+		for(i = 1; !task && i < pool->threads; i++)
+			task = deque_steal(&pool->deque[(self->id + i) % pool->threads]);
+
+		if(task) {
+			__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_RELAXED);
+			batch_run_task(task);
+			continue;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		while(__atomic_load_n(&pool->pending, __ATOMIC_RELAXED) == 0 && !pool->stop)
+			pthread_cond_wait(&pool->work, &pool->lock);
+		if(pool->stop && __atomic_load_n(&pool->pending, __ATOMIC_RELAXED) == 0) {
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+struct sosemanuk_batch_pool *
+sosemanuk_batch_pool_create(int threads)
+{
+	struct sosemanuk_batch_pool *pool;
+	int i;
+
+	if(threads <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cpus > 0) ? (int)cpus : 1;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if(!pool)
+		return NULL;
+
+	pool->threads = threads;
+	pool->deque = aligned_alloc(64, sizeof(*pool->deque) * threads);
+	pool->worker = calloc(threads, sizeof(*pool->worker));
+	if(!pool->deque || !pool->worker) {
+		free(pool->deque);
+		free(pool->worker);
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+
+	for(i = 0; i < threads; i++) {
+		memset(&pool->deque[i], 0, sizeof(pool->deque[i]));
+		pthread_mutex_init(&pool->deque[i].lock, NULL);
+	}
+
+	for(i = 0; i < threads; i++) {
+		pool->worker[i].pool = pool;
+		pool->worker[i].id = i;
+		if(pthread_create(&pool->worker[i].thread, NULL, batch_worker, &pool->worker[i])) {
+			pool->threads = i;
+			sosemanuk_batch_pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+void
+sosemanuk_batch_pool_destroy(struct sosemanuk_batch_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for(i = 0; i < pool->threads; i++)
+		pthread_join(pool->worker[i].thread, NULL);
+
+	for(i = 0; i < pool->threads; i++) {
+		pthread_mutex_destroy(&pool->deque[i].lock);
+		free(pool->deque[i].task);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	free(pool->deque);
+	free(pool->worker);
+	free(pool);
+}
+
+struct sosemanuk_batch *
+sosemanuk_batch_submit(struct sosemanuk_batch_pool *pool, struct sosemanuk_job *jobs, size_t n,
+	void (*done)(void *arg, struct sosemanuk_job *jobs, size_t n), void *arg)
+{
+	struct sosemanuk_batch *batch;
+	struct batch_task *group = NULL, *task;
+	unsigned int next;
+	size_t i;
+
+	// At most one task per job
+	batch = calloc(1, sizeof(*batch) + sizeof(struct batch_task) * n);
+	if(!batch)
+		return NULL;
+
+	pthread_mutex_init(&batch->lock, NULL);
+	pthread_cond_init(&batch->cond, NULL);
+	batch->jobs = jobs;
+	batch->n = n;
+	batch->done = done;
+	batch->arg = arg;
+
+	for(i = 0; i < n; i++) {
+		if(!jobs[i].ctx && jobs[i].key && jobs[i].ivlen > 0 && jobs[i].ivlen <= 16 &&
+			jobs[i].buflen <= BATCH_SMALL) {
+			if(!group || group->count == BATCH_LANES) {
+				group = &batch->task[batch->ntasks++];
+				group->batch = batch;
+				group->lanes = 1;
+			}
+			group->job[group->count++] = &jobs[i];
+		} else {
+			task = &batch->task[batch->ntasks++];
+			task->batch = batch;
+			task->job[0] = &jobs[i];
+			task->count = 1;
+		}
+	}
+
+	batch->remaining = batch->ntasks;
+
+	if(batch->ntasks == 0) {
+		if(done)
+			done(arg, jobs, n);
+		batch->complete = 1;
+		return batch;
+	}
+
+	next = __atomic_fetch_add(&pool->next, batch->ntasks, __ATOMIC_RELAXED);
+	for(i = 0; i < batch->ntasks; i++) {
+		// Counted before the push: a worker may take the task at once
+		__atomic_add_fetch(&pool->pending, 1, __ATOMIC_RELAXED);
+
+		// A full deque that cannot grow: run the task here
+		if(deque_push(&pool->deque[(next + i) % pool->threads], &batch->task[i]) < 0) {
+			__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_RELAXED);
+			batch_run_task(&batch->task[i]);
+		}
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	return batch;
+}
+
+size_t
+sosemanuk_batch_wait(struct sosemanuk_batch *batch)
+{
+	size_t i, failed = 0;
+
+	pthread_mutex_lock(&batch->lock);
+	while(!batch->complete)
+		pthread_cond_wait(&batch->cond, &batch->lock);
+	pthread_mutex_unlock(&batch->lock);
+
+	for(i = 0; i < batch->n; i++) {
+		if(batch->jobs[i].status < 0)
+			failed++;
+	}
+
+	pthread_mutex_destroy(&batch->lock);
+	pthread_cond_destroy(&batch->cond);
+	free(batch);
+
+	return failed;
+}
@@ -0,0 +1,59 @@
+/*
+ * Batch encryption of many independent jobs on a pool of threads.
+ * A job is either a running context (encrypted with sosemanuk_crypt_bulk, the
+ * context advances) or a prepared key and an IV (a new stream). Small jobs of
+ * the second kind are grouped 16 at a time on the multi-lane kernels. Every
+ * worker owns a deque of tasks and steals from the others when it runs dry.
+*/
+
+#ifndef SOSEMANUK_BATCH_H
+#define SOSEMANUK_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sosemanuk.h"
+
+/*
+ * One job
+ * ctx - running context, or NULL to start a stream from key and iv
+ * key - prepared key (used when ctx is NULL)
+ * iv, ivlen - initialization vector (used when ctx is NULL)
+ * buf, out, buflen - data, as for sosemanuk_crypt_bulk
+ * status - set on completion: 0 (if all is well), -1 (bad job)
+*/
+struct sosemanuk_job {
+	struct sosemanuk_context *ctx;
+	const struct sosemanuk_key *key;
+	const uint8_t *iv;
+	int ivlen;
+	const uint8_t *buf;
+	uint8_t *out;
+	size_t buflen;
+	int status;
+};
+
+struct sosemanuk_batch_pool;
+struct sosemanuk_batch;
+
+// Start "threads" workers (0: one per online CPU)
+// Return value: pointer on the pool, NULL (if no resources)
+struct sosemanuk_batch_pool *sosemanuk_batch_pool_create(int threads);
+
+// Finish the queued work and stop the workers
+void sosemanuk_batch_pool_destroy(struct sosemanuk_batch_pool *pool);
+
+/*
+ * Queue n jobs. The jobs array and the buffers must stay valid until the batch
+ * is complete. done (may be NULL) is called once by a worker when all the jobs
+ * are complete; the handle must still be released with sosemanuk_batch_wait
+ * Return value: batch handle, NULL (if no memory)
+*/
+struct sosemanuk_batch *sosemanuk_batch_submit(struct sosemanuk_batch_pool *pool, struct sosemanuk_job *jobs, size_t n,
+	void (*done)(void *arg, struct sosemanuk_job *jobs, size_t n), void *arg);
+
+// Wait for a batch and release its handle
+// Return value: number of jobs with status -1
+size_t sosemanuk_batch_wait(struct sosemanuk_batch *batch);
+
+#endif
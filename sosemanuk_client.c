@@ -0,0 +1,268 @@
+/*
+ * Client of the encryption server (see sosemanuk_client.h).
+ * Every call sends one request and waits for its reply. The shared buffer is
+ * a memfd sealed against shrinking, so the server can map it safely.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sosemanuk.h"
+#include "sosemanuk_client.h"
+
+struct sosemanuk_client {
+	int fd;
+	uint8_t *shm;
+	size_t shm_size;
+};
+
+// Send a request, its payload and (fd >= 0) a descriptor
+static int
+client_send(int sock, const struct sosemanuk_msg *msg, const void *payload, int fd)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cm;
+	struct cmsghdr *c;
+	struct iovec iov[2];
+	struct msghdr mh;
+	ssize_t n;
+	int i = 0;
+
+	iov[0].iov_base = (void *)msg;
+	iov[0].iov_len = sizeof(*msg);
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = msg->len;
+
+	while(i < 2) {
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov + i;
+		mh.msg_iovlen = 2 - i;
+
+		// The descriptor goes with the first byte
+		if(fd >= 0) {
+			memset(&cm, 0, sizeof(cm));
+			mh.msg_control = cm.buf;
+			mh.msg_controllen = sizeof(cm.buf);
+			c = CMSG_FIRSTHDR(&mh);
+			c->cmsg_level = SOL_SOCKET;
+			c->cmsg_type = SCM_RIGHTS;
+			c->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(c), &fd, sizeof(int));
+		}
+
+		n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0)
+			return -1;
+		fd = -1;
+
+		for(; i < 2 && (size_t)n >= iov[i].iov_len; i++)
+			n -= iov[i].iov_len;
+		if(i < 2) {
+			iov[i].iov_base = (uint8_t *)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+static int
+client_recv(int sock, void *p, size_t len)
+{
+	ssize_t n;
+
+	while(len > 0) {
+		n = recv(sock, p, len, 0);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return -1;
+		p = (uint8_t *)p + n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * One request: the reply payload (reply.len bytes, at most outlen) is read into out
+ * Return value: status of the reply, -1 (connection lost or unexpected reply)
+*/
+static int
+client_call(struct sosemanuk_client *cl, uint32_t type, uint32_t session, const void *payload, size_t len,
+	int fd, void *out, size_t outlen)
+{
+	struct sosemanuk_msg msg;
+	struct sosemanuk_reply reply;
+
+	msg.type = type;
+	msg.session = session;
+	msg.len = len;
+
+	if(client_send(cl->fd, &msg, payload, fd) < 0 || client_recv(cl->fd, &reply, sizeof(reply)) < 0)
+		return -1;
+	if(reply.type != type || reply.len > outlen || client_recv(cl->fd, out, reply.len) < 0)
+		return -1;
+
+	return reply.status;
+}
+
+struct sosemanuk_client *
+sosemanuk_client_connect(const char *path)
+{
+	struct sosemanuk_client *cl;
+	struct sockaddr_un addr;
+
+	if(strlen(path) >= sizeof(addr.sun_path))
+		return NULL;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	cl = calloc(1, sizeof(*cl));
+	if(!cl)
+		return NULL;
+
+	cl->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(cl->fd < 0 || connect(cl->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		if(cl->fd >= 0)
+			close(cl->fd);
+		free(cl);
+		return NULL;
+	}
+
+	return cl;
+}
+
+void
+sosemanuk_client_close(struct sosemanuk_client *cl)
+{
+	close(cl->fd);
+	if(cl->shm)
+		munmap(cl->shm, cl->shm_size);
+	free(cl);
+}
+
+int
+sosemanuk_client_open(struct sosemanuk_client *cl, const char *key_id, const uint8_t *iv, int ivlen)
+{
+	struct sosemanuk_msg_open o;
+
+	if(strlen(key_id) >= sizeof(o.key_id) || ivlen <= 0 || ivlen > 16)
+		return -1;
+
+	memset(&o, 0, sizeof(o));
+	strcpy(o.key_id, key_id);
+	memcpy(o.iv, iv, ivlen);
+	o.ivlen = ivlen;
+
+	return client_call(cl, SOSEMANUK_MSG_OPEN, 0, &o, sizeof(o), -1, NULL, 0);
+}
+
+int
+sosemanuk_client_close_session(struct sosemanuk_client *cl, int session)
+{
+	return client_call(cl, SOSEMANUK_MSG_CLOSE, (uint32_t)session, NULL, 0, -1, NULL, 0);
+}
+
+uint8_t *
+sosemanuk_client_buffer(struct sosemanuk_client *cl, size_t size)
+{
+	uint8_t *shm;
+	int fd;
+
+	if(cl->shm && cl->shm_size >= size)
+		return cl->shm;
+	if(size == 0)
+		return NULL;
+
+	fd = memfd_create("sosemanuk", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(fd < 0)
+		return NULL;
+
+	if(ftruncate(fd, size) < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(shm == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+
+	// The server keeps its own mapping: the descriptor is not needed afterwards
+	if(client_call(cl, SOSEMANUK_MSG_SHM_ATTACH, 0, NULL, 0, fd, NULL, 0) != 0) {
+		munmap(shm, size);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	if(cl->shm)
+		munmap(cl->shm, cl->shm_size);
+	cl->shm = shm;
+	cl->shm_size = size;
+
+	return shm;
+}
+
+int
+sosemanuk_client_crypt_shared(struct sosemanuk_client *cl, int session, size_t offset, size_t length)
+{
+	struct sosemanuk_msg_shm m;
+
+	if(!cl->shm || offset > cl->shm_size || length > cl->shm_size - offset)
+		return -1;
+
+	m.offset = offset;
+	m.length = length;
+
+	return client_call(cl, SOSEMANUK_MSG_CRYPT_SHM, (uint32_t)session, &m, sizeof(m), -1, NULL, 0);
+}
+
+int
+sosemanuk_client_crypt(struct sosemanuk_client *cl, int session, const uint8_t *buf, size_t buflen, uint8_t *out)
+{
+	size_t n;
+	uint8_t *shm = NULL;
+
+	// Large payloads: through the shared buffer if one can be had
+	if(buflen >= SOSEMANUK_CLIENT_INLINE_MAX)
+		shm = sosemanuk_client_buffer(cl, SOSEMANUK_CLIENT_SHM_SIZE);
+
+	while(buflen > 0) {
+		if(shm) {
+			n = (buflen < cl->shm_size) ? buflen : cl->shm_size;
+			memcpy(shm, buf, n);
+			if(sosemanuk_client_crypt_shared(cl, session, 0, n) != 0)
+				return -1;
+			memcpy(out, shm, n);
+		} else {
+			n = (buflen < SOSEMANUK_MSG_MAX) ? buflen : SOSEMANUK_MSG_MAX;
+			if(client_call(cl, SOSEMANUK_MSG_CRYPT, (uint32_t)session, buf, n, -1, out, n) != 0)
+				return -1;
+		}
+
+		buflen -= n;
+		buf += n;
+		out += n;
+	}
+
+	return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Client of the encryption server (see sosemanuk_server.h).
+ * The key material stays in the server: a client names a key by its ID.
+ * Calls on one client are not thread-safe; use one client per thread.
+*/
+
+#ifndef SOSEMANUK_CLIENT_H
+#define SOSEMANUK_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sosemanuk_server.h"
+
+// sosemanuk_client_crypt passes payloads from this size through the shared buffer
+#define SOSEMANUK_CLIENT_INLINE_MAX	(64 << 10)
+
+// Size of the shared buffer created by sosemanuk_client_crypt
+#define SOSEMANUK_CLIENT_SHM_SIZE	(4 << 20)
+
+struct sosemanuk_client;
+
+// Return value: pointer on the client, NULL (if the server cannot be reached or no memory)
+struct sosemanuk_client *sosemanuk_client_connect(const char *path);
+
+// Close the connection (the server closes the sessions) and unmap the shared buffer
+void sosemanuk_client_close(struct sosemanuk_client *cl);
+
+// Open a session: a new stream under key "key_id" and iv
+// Return value: session ID (>= 0), -1 (unknown key, bad IV or connection lost)
+int sosemanuk_client_open(struct sosemanuk_client *cl, const char *key_id, const uint8_t *iv, int ivlen);
+
+// Return value: 0 (if all is well), -1 (unknown session or connection lost)
+int sosemanuk_client_close_session(struct sosemanuk_client *cl, int session);
+
+/*
+ * Encrypt (or decrypt) the next buflen bytes of the stream of a session,
+ * as sosemanuk_stream_crypt. out may be buf
+ * Return value: 0 (if all is well), -1 (unknown session or connection lost)
+*/
+int sosemanuk_client_crypt(struct sosemanuk_client *cl, int session, const uint8_t *buf, size_t buflen, uint8_t *out);
+
+/*
+ * Shared buffer of at least "size" bytes, attached to the server (an older,
+ * smaller one is replaced). Data written there is encrypted in place by
+ * sosemanuk_client_crypt_shared without any copy through the socket
+ * Return value: pointer on the buffer, NULL (if no memory or connection lost)
+*/
+uint8_t *sosemanuk_client_buffer(struct sosemanuk_client *cl, size_t size);
+
+// Encrypt in place "length" bytes at "offset" of the shared buffer
+// Return value: 0 (if all is well), -1 (bad range, unknown session or connection lost)
+int sosemanuk_client_crypt_shared(struct sosemanuk_client *cl, int session, size_t offset, size_t length);
+
+#endif
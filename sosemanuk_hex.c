@@ -0,0 +1,228 @@
+/*
+ * Hex codec (see sosemanuk_hex.h).
+ *
+ * Vector path, 16 bytes (32 digits) per step with SSE2, which every x86-64
+ * CPU has:
+ *   encode - split every byte into its two nibbles, interleave them and map
+ *            0..15 to '0'..'9', 'A'..'F' with one compare and two adds
+ *   decode - classify every char as digit or letter (case folded with 0x20),
+ *            reject the block if any char is neither, then merge the nibble
+ *            pairs with 16-bit shifts and pack them to bytes
+ * The ends shorter than a block go through the scalar code.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sosemanuk_hex.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HEX_SSE2
+#include <emmintrin.h>
+#endif
+
+// Digits written per fwrite by sosemanuk_hex_write
+#define HEX_WRITE_CHUNK	8192
+
+static const char hex_digits[16] = "0123456789ABCDEF";
+
+// Value of a hex digit, -1 for any other char
+static inline int
+hex_value(char c)
+{
+	if(c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if(c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+#ifdef HEX_SSE2
+
+static inline void
+hex_encode16(char *hex, const uint8_t *bytes)
+{
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	__m128i b, hi, lo, d0, d1;
+
+	b = _mm_loadu_si128((const __m128i *)bytes);
+	hi = _mm_and_si128(_mm_srli_epi16(b, 4), mask);
+	lo = _mm_and_si128(b, mask);
+
+	// High nibble first
+	d0 = _mm_unpacklo_epi8(hi, lo);
+	d1 = _mm_unpackhi_epi8(hi, lo);
+
+	// '0' + n, plus 7 more for n > 9 ('A' - '9' - 1)
+#define HEX_DIGITS(n)	_mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')),	\
+		_mm_and_si128(_mm_cmpgt_epi8(n, _mm_set1_epi8(9)), _mm_set1_epi8(7)))
+
+	_mm_storeu_si128((__m128i *)hex, HEX_DIGITS(d0));
+	_mm_storeu_si128((__m128i *)(hex + 16), HEX_DIGITS(d1));
+
+#undef HEX_DIGITS
+}
+
+// Values of 16 digits; *bad gets a nonzero mask if one char is not a digit
+static inline __m128i
+hex_values16(const char *hex, int *bad)
+{
+	__m128i c, lower, digit, alpha;
+
+	c = _mm_loadu_si128((const __m128i *)hex);
+	lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+
+	// Signed compares: chars from 0x80 are negative and fall in no range
+	digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+		_mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+	alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+		_mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+
+	*bad |= _mm_movemask_epi8(_mm_or_si128(digit, alpha)) ^ 0xFFFF;
+
+	return _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+		_mm_and_si128(alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+}
+
+// 32 digits to 16 bytes. Return value: 0 (if all is well), -1 (not a hex digit)
+static inline int
+hex_decode16(uint8_t *bytes, const char *hex)
+{
+	const __m128i low = _mm_set1_epi16(0x00FF);
+	__m128i v0, v1;
+	int bad = 0;
+
+	v0 = hex_values16(hex, &bad);
+	v1 = hex_values16(hex + 16, &bad);
+	if(bad)
+		return -1;
+
+	// 16-bit lane: first digit in the low byte, second in the high byte
+	v0 = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(v0, 4), _mm_srli_epi16(v0, 8)), low);
+	v1 = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(v1, 4), _mm_srli_epi16(v1, 8)), low);
+
+	_mm_storeu_si128((__m128i *)bytes, _mm_packus_epi16(v0, v1));
+
+	return 0;
+}
+
+#endif /* HEX_SSE2 */
+
+void
+sosemanuk_hex_encode(char *hex, const uint8_t *bytes, size_t len)
+{
+	size_t i = 0;
+
+#ifdef HEX_SSE2
+	for(; i + 16 <= len; i += 16)
+		hex_encode16(hex + 2 * i, bytes + i);
+#endif
+
+	for(; i < len; i++) {
+		hex[2 * i] = hex_digits[bytes[i] >> 4];
+		hex[2 * i + 1] = hex_digits[bytes[i] & 0x0F];
+	}
+
+	hex[2 * len] = '\0';
+}
+
+int
+sosemanuk_hex_write(FILE *fp, const uint8_t *bytes, size_t len)
+{
+	char hex[HEX_WRITE_CHUNK + 1];
+	size_t n;
+
+	for(; len > 0; len -= n, bytes += n) {
+		n = (len < HEX_WRITE_CHUNK / 2) ? len : HEX_WRITE_CHUNK / 2;
+		sosemanuk_hex_encode(hex, bytes, n);
+		if(fwrite(hex, 1, 2 * n, fp) != 2 * n)
+			return -1;
+	}
+
+	return 0;
+}
+
+// Whole bytes of an even number of digits
+static ssize_t
+hex_decode_pairs(uint8_t *bytes, const char *hex, size_t n)
+{
+	size_t i = 0;
+	int hi, lo;
+
+#ifdef HEX_SSE2
+	for(; i + 16 <= n; i += 16) {
+		if(hex_decode16(bytes + i, hex + 2 * i) != 0)
+			return -1;
+	}
+#endif
+
+	for(; i < n; i++) {
+		hi = hex_value(hex[2 * i]);
+		lo = hex_value(hex[2 * i + 1]);
+		if(hi < 0 || lo < 0)
+			return -1;
+		bytes[i] = (uint8_t)(hi << 4 | lo);
+	}
+
+	return n;
+}
+
+ssize_t
+sosemanuk_hex_decode(uint8_t *bytes, const char *hex, size_t hexlen)
+{
+	if(hexlen % 2 != 0)
+		return -1;
+
+	return hex_decode_pairs(bytes, hex, hexlen / 2);
+}
+
+void
+sosemanuk_hex_decoder_init(struct sosemanuk_hex_decoder *dec)
+{
+	dec->pending = 0;
+	dec->high = 0;
+}
+
+ssize_t
+sosemanuk_hex_decode_update(struct sosemanuk_hex_decoder *dec, uint8_t *bytes, const char *hex, size_t hexlen)
+{
+	size_t out = 0;
+	int v;
+
+	if(hexlen == 0)
+		return 0;
+
+	// Complete the byte left open by the previous call
+	if(dec->pending) {
+		v = hex_value(hex[0]);
+		if(v < 0)
+			return -1;
+		bytes[out++] = (uint8_t)(dec->high << 4 | v);
+		dec->pending = 0;
+		hex++;
+		hexlen--;
+	}
+
+	if(hex_decode_pairs(bytes + out, hex, hexlen / 2) < 0)
+		return -1;
+	out += hexlen / 2;
+
+	if(hexlen % 2) {
+		v = hex_value(hex[hexlen - 1]);
+		if(v < 0)
+			return -1;
+		dec->high = (uint8_t)v;
+		dec->pending = 1;
+	}
+
+	return out;
+}
+
+int
+sosemanuk_hex_decode_final(const struct sosemanuk_hex_decoder *dec)
+{
+	return dec->pending ? -1 : 0;
+}
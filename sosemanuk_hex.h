@@ -0,0 +1,45 @@
+/*
+ * Hex codec shared by the tools (keys, IVs, ciphertext dumps).
+ * Encoding writes uppercase digits; decoding accepts both cases and rejects
+ * anything else. Both run 16 bytes per step in vector registers on x86-64.
+ * Large inputs can be decoded piece by piece with a sosemanuk_hex_decoder and
+ * written with sosemanuk_hex_write, without holding the whole text.
+*/
+
+#ifndef SOSEMANUK_HEX_H
+#define SOSEMANUK_HEX_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Write 2 * len digits followed by a terminating zero (hex holds 2 * len + 1 chars)
+void sosemanuk_hex_encode(char *hex, const uint8_t *bytes, size_t len);
+
+// Write 2 * len digits to fp
+// Return value: 0 (if all is well), -1 (write error)
+int sosemanuk_hex_write(FILE *fp, const uint8_t *bytes, size_t len);
+
+// Decode hexlen digits into hexlen / 2 bytes, bytes may be hex itself (in place)
+// Return value: number of bytes, -1 (odd length or not a hex digit)
+ssize_t sosemanuk_hex_decode(uint8_t *bytes, const char *hex, size_t hexlen);
+
+// Streaming decoder: digits may be cut anywhere between two calls
+struct sosemanuk_hex_decoder {
+	int pending;
+	uint8_t high;
+};
+
+void sosemanuk_hex_decoder_init(struct sosemanuk_hex_decoder *dec);
+
+/*
+ * Decode the next hexlen digits, bytes holds at least (hexlen + 1) / 2 bytes
+ * Return value: number of bytes written, -1 (not a hex digit)
+*/
+ssize_t sosemanuk_hex_decode_update(struct sosemanuk_hex_decoder *dec, uint8_t *bytes, const char *hex, size_t hexlen);
+
+// Return value: 0 (if all is well), -1 (odd number of digits in total)
+int sosemanuk_hex_decode_final(const struct sosemanuk_hex_decoder *dec);
+
+#endif
@@ -0,0 +1,219 @@
+/*
+ * Checkpoint index for random access (see sosemanuk_index.h).
+ * Checkpoint i is the state before keystream block i * interval; it is taken
+ * by sosemanuk_index_crypt when the stream reaches that block.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sosemanuk.h"
+#include "sosemanuk_internal.h"
+#include "sosemanuk_index.h"
+
+#define INDEX_VERSION	1
+
+#define U8TO64_LITTLE(p)	((uint64_t)U8TO32_LITTLE(p) | ((uint64_t)U8TO32_LITTLE((p) + 4) << 32))
+
+int
+sosemanuk_index_init(struct sosemanuk_index *idx, uint32_t interval)
+{
+	memset(idx, 0, sizeof(*idx));
+
+	if(interval == 0)
+		return -1;
+
+	idx->interval = interval;
+
+	return 0;
+}
+
+void
+sosemanuk_index_free(struct sosemanuk_index *idx)
+{
+	if(idx->states) {
+		sosemanuk_wipe(idx->states, idx->capacity * SOSEMANUK_STATE_BYTES);
+		free(idx->states);
+	}
+
+	memset(idx, 0, sizeof(*idx));
+}
+
+// Append the state st as the next checkpoint
+static int
+index_record(struct sosemanuk_index *idx, const struct sosemanuk_state *st)
+{
+	uint8_t *grown;
+	uint64_t capacity;
+
+	if(idx->count == idx->capacity) {
+		capacity = idx->capacity ? idx->capacity * 2 : 64;
+		grown = malloc(capacity * SOSEMANUK_STATE_BYTES);
+		if(!grown)
+			return -1;
+
+		// Not realloc: the old copy of the states is wiped
+		if(idx->states) {
+			memcpy(grown, idx->states, idx->count * SOSEMANUK_STATE_BYTES);
+			sosemanuk_wipe(idx->states, idx->capacity * SOSEMANUK_STATE_BYTES);
+			free(idx->states);
+		}
+
+		idx->states = grown;
+		idx->capacity = capacity;
+	}
+
+	sosemanuk_state_export(st, idx->states + idx->count * SOSEMANUK_STATE_BYTES);
+	idx->count++;
+
+	return 0;
+}
+
+int
+sosemanuk_index_crypt(struct sosemanuk_index *idx, struct sosemanuk_state *st, const uint8_t *buf, size_t buflen, uint8_t *out)
+{
+	uint64_t left;
+	size_t n;
+
+	while(buflen > 0) {
+		if(idx->blocks % idx->interval == 0 && idx->blocks / idx->interval == idx->count) {
+			if(index_record(idx, st) < 0)
+				return -1;
+		}
+
+		// Up to the next checkpoint
+		left = idx->interval - idx->blocks % idx->interval;
+		n = (buflen / 80 < left) ? buflen : left * 80;
+
+		sosemanuk_state_crypt(st, buf, n, out);
+
+		idx->blocks += (n + 79) / 80;
+		buflen -= n;
+		buf += n;
+		out += n;
+	}
+
+	return 0;
+}
+
+int
+sosemanuk_index_seek(const struct sosemanuk_index *idx, struct sosemanuk_state *st, uint64_t block)
+{
+	uint32_t keystream[20];
+	uint64_t i, cp;
+
+	cp = block / idx->interval;
+	if(block > idx->blocks || cp >= idx->count)
+		return -1;
+
+	sosemanuk_state_import(st, idx->states + cp * SOSEMANUK_STATE_BYTES);
+
+	for(i = cp * idx->interval; i < block; i++)
+		sosemanuk_state_generate_keystream(st, keystream);
+
+	sosemanuk_wipe(keystream, sizeof(keystream));
+
+	return 0;
+}
+
+int
+sosemanuk_index_crypt_at(const struct sosemanuk_index *idx, uint64_t offset, const uint8_t *buf, size_t buflen, uint8_t *out)
+{
+	struct sosemanuk_state st;
+	uint32_t keystream[20];
+	size_t skip, n;
+
+	if(buflen == 0)
+		return 0;
+
+	if((offset + buflen + 79) / 80 > idx->blocks || sosemanuk_index_seek(idx, &st, offset / 80) < 0)
+		return -1;
+
+	// Offset inside a block: the head of the block is dropped
+	skip = offset % 80;
+	if(skip > 0) {
+		n = (buflen < 80 - skip) ? buflen : 80 - skip;
+
+		sosemanuk_state_generate_keystream(&st, keystream);
+		sosemanuk_impl->xor_bytes(out, buf, (uint8_t *)keystream + skip, n);
+		sosemanuk_wipe(keystream, sizeof(keystream));
+
+		buflen -= n;
+		buf += n;
+		out += n;
+	}
+
+	sosemanuk_state_crypt(&st, buf, buflen, out);
+	sosemanuk_wipe(&st, sizeof(st));
+
+	return 0;
+}
+
+size_t
+sosemanuk_index_size(const struct sosemanuk_index *idx)
+{
+	return SOSEMANUK_INDEX_HEADER + idx->count * SOSEMANUK_STATE_BYTES;
+}
+
+void
+sosemanuk_index_save(const struct sosemanuk_index *idx, uint8_t *out)
+{
+	uint8_t *p = out;
+	uint32_t w;
+
+	memcpy(p, "SOSI", 4);
+	p += 4;
+	w = INDEX_VERSION;
+	U32TO8_LITTLE(p, w);
+	p += 4;
+	U32TO8_LITTLE(p, idx->interval);
+	p += 4;
+	w = 0;
+	U32TO8_LITTLE(p, w);
+	p += 4;
+	U32TO8_LITTLE(p, (uint32_t)idx->blocks);
+	p += 4;
+	U32TO8_LITTLE(p, (uint32_t)(idx->blocks >> 32));
+	p += 4;
+	U32TO8_LITTLE(p, (uint32_t)idx->count);
+	p += 4;
+	U32TO8_LITTLE(p, (uint32_t)(idx->count >> 32));
+	p += 4;
+
+	memcpy(p, idx->states, idx->count * SOSEMANUK_STATE_BYTES);
+}
+
+int
+sosemanuk_index_load(struct sosemanuk_index *idx, const uint8_t *in, size_t len)
+{
+	uint64_t blocks, count;
+	uint32_t interval;
+
+	if(len < SOSEMANUK_INDEX_HEADER || memcmp(in, "SOSI", 4) != 0 || U8TO32_LITTLE(in + 4) != INDEX_VERSION)
+		return -1;
+
+	interval = U8TO32_LITTLE(in + 8);
+	blocks = U8TO64_LITTLE(in + 16);
+	count = U8TO64_LITTLE(in + 24);
+
+	// One checkpoint per started interval, and nothing after them
+	if(sosemanuk_index_init(idx, interval) < 0 || count != (blocks + interval - 1) / interval ||
+		count > (len - SOSEMANUK_INDEX_HEADER) / SOSEMANUK_STATE_BYTES ||
+		len != SOSEMANUK_INDEX_HEADER + count * SOSEMANUK_STATE_BYTES)
+		return -1;
+
+	if(count > 0) {
+		idx->states = malloc(count * SOSEMANUK_STATE_BYTES);
+		if(!idx->states)
+			return -1;
+		memcpy(idx->states, in + SOSEMANUK_INDEX_HEADER, count * SOSEMANUK_STATE_BYTES);
+	}
+
+	idx->blocks = blocks;
+	idx->count = count;
+	idx->capacity = count;
+
+	return 0;
+}
@@ -0,0 +1,76 @@
+/*
+ * Checkpoint index for random access into a long Sosemanuk stream.
+ * While a stream is encrypted, the running state is recorded every "interval"
+ * blocks. A reader resumes from the nearest checkpoint before the wanted
+ * offset and generates at most interval - 1 blocks to get there.
+ * The checkpoints reveal the keystream: keep the index as secret as the key.
+ *
+ * Serialized format (little-endian):
+ *   0  "SOSI"          magic
+ *   4  uint32 version  1
+ *   8  uint32 interval blocks between checkpoints
+ *   12 uint32 reserved 0
+ *   16 uint64 blocks   keystream blocks covered
+ *   24 uint64 count    number of checkpoints
+ *   32 count * 48      state before block i * interval (sosemanuk_state_export)
+*/
+
+#ifndef SOSEMANUK_INDEX_H
+#define SOSEMANUK_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sosemanuk.h"
+
+#define SOSEMANUK_INDEX_HEADER	32
+
+/*
+ * interval - keystream blocks between checkpoints
+ * blocks - keystream blocks covered so far
+ * count - number of checkpoints
+ * capacity - checkpoints allocated
+ * states - count * SOSEMANUK_STATE_BYTES bytes
+*/
+struct sosemanuk_index {
+	uint32_t interval;
+	uint64_t blocks;
+	uint64_t count;
+	uint64_t capacity;
+	uint8_t *states;
+};
+
+// Return value: 0 (if all is well), -1 (interval is 0)
+int sosemanuk_index_init(struct sosemanuk_index *idx, uint32_t interval);
+
+// Wipe and free the checkpoints
+void sosemanuk_index_free(struct sosemanuk_index *idx);
+
+/*
+ * sosemanuk_state_crypt that records the checkpoints it passes. The stream is
+ * cut in 80-byte blocks: buflen must be a multiple of 80 except in the last call
+ * Return value: 0 (if all is well), -1 (no memory)
+*/
+int sosemanuk_index_crypt(struct sosemanuk_index *idx, struct sosemanuk_state *st, const uint8_t *buf, size_t buflen, uint8_t *out);
+
+// Set st to the state before keystream block "block"
+// Return value: 0 (if all is well), -1 (block is not covered by the index)
+int sosemanuk_index_seek(const struct sosemanuk_index *idx, struct sosemanuk_state *st, uint64_t block);
+
+/*
+ * Decrypt buflen bytes starting at byte "offset" of the stream
+ * Return value: 0 (if all is well), -1 (range is not covered by the index)
+*/
+int sosemanuk_index_crypt_at(const struct sosemanuk_index *idx, uint64_t offset, const uint8_t *buf, size_t buflen, uint8_t *out);
+
+// Size of the serialized index
+size_t sosemanuk_index_size(const struct sosemanuk_index *idx);
+
+// Serialize into out (sosemanuk_index_size bytes)
+void sosemanuk_index_save(const struct sosemanuk_index *idx, uint8_t *out);
+
+// Load a serialized index (idx is initialized here)
+// Return value: 0 (if all is well), -1 (bad format or no memory)
+int sosemanuk_index_load(struct sosemanuk_index *idx, const uint8_t *in, size_t len);
+
+#endif
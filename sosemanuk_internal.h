@@ -0,0 +1,392 @@
+/*
+ * Private macros shared by the Sosemanuk implementations (sosemanuk.c and the
+ * SIMD kernels in sosemanuk_simd.c) and the library helpers. The round macros only use the operators
+ * & | ^ ~ + * << >>, so they expand the same way for uint32_t and for GCC
+ * vector types holding one word per lane.
+ * The includer defines XMUX, MUL_A and MUL_G for its word type.
+*/
+
+#ifndef SOSEMANUK_INTERNAL_H
+#define SOSEMANUK_INTERNAL_H
+
+// Selecting the byte order
+#if __BYTE_ORDER == BIG_ENDIAN
+#define U32TO32(x)								\
+	((x << 24) | ((x << 8) & 0xFF0000) | ((x >> 8) & 0xFF00) | (x >> 24))
+#elif __BYTE_ORDER == LITTLE_ENDIAN
+#define U32TO32(x)	(x)
+#else
+#error unsupported byte 
+#endif
+
+// Little-endian 4 uint8_t in the uint32_t
+#define U8TO32_LITTLE(p) 						\
+	(((uint32_t)((p)[0])     ) | ((uint32_t)((p)[1]) << 8) |	\
+	((uint32_t)((p)[2]) << 16) | ((uint32_t)((p)[3]) << 24))
+
+// Little-endian uint32_t in the 4 uint8_t
+#define U32TO8_LITTLE(dst, val) {	\
+	dst[0] = val;			\
+	dst[1] = val >> 8;		\
+	dst[2] = val >> 16;		\
+	dst[3] = val >> 24;		\
+}
+
+// Cyclic shift
+#define ROTL32(v, n)	((v << n) | (v >> (32 - n)))
+
+// Serpent S-boxes, implemented in bitslice mode.
+// These circuits have been published by Dag Arne Osvik ("Speeding up Serpent"). 
+// Published in the 3rd AES Candidate Conference.
+
+#define S0(r0, r1, r2, r3, r4) {	\
+	r3 ^= r0; r4  = r1;		\
+	r1 &= r3; r4 ^= r2;		\
+	r1 ^= r0; r0 |= r3;		\
+	r0 ^= r4; r4 ^= r3;		\
+	r3 ^= r2; r2 |= r1;		\
+	r2 ^= r4; r4 =~ r4;		\
+	r4 |= r1; r1 ^= r3;		\
+	r1 ^= r4; r3 |= r0;		\
+	r1 ^= r3; r4 ^= r3;		\
+}
+
+#define S1(r0, r1, r2, r3, r4) {	\
+	r0 =~ r0; r2 =~ r2;		\
+	r4  = r0; r0 &= r1;		\
+	r2 ^= r0; r0 |= r3;		\
+	r3 ^= r2; r1 ^= r0;		\
+	r0 ^= r4; r4 |= r1;		\
+	r1 ^= r3; r2 |= r0;		\
+	r2 &= r4; r0 ^= r1;		\
+	r1 &= r2;			\
+	r1 ^= r0; r0 &= r2;		\
+	r0 ^= r4;			\
+}
+
+#define S2(r0, r1, r2, r3, r4) {	\
+	r4  = r0; r0 &= r2;		\
+	r0 ^= r3; r2 ^= r1;		\
+	r2 ^= r0; r3 |= r4;		\
+	r3 ^= r1; r4 ^= r2;		\
+	r1  = r3; r3 |= r4;		\
+	r3 ^= r0; r0 &= r1;		\
+	r4 ^= r0; r1 ^= r3;		\
+	r1 ^= r4; r4 =~ r4;		\
+}
+
+#define S3(r0, r1, r2, r3, r4) {	\
+	r4  = r0; r0 |= r3;		\
+	r3 ^= r1; r1 &= r4;		\
+	r4 ^= r2; r2 ^= r3;		\
+	r3 &= r0; r4 |= r1;		\
+	r3 ^= r4; r0 ^= r1;		\
+	r4 &= r0; r1 ^= r3;		\
+	r4 ^= r2; r1 |= r0;		\
+	r1 ^= r2; r0 ^= r3;		\
+	r2  = r1; r1 |= r3;		\
+	r1 ^= r0;			\
+}
+
+#define S4(r0, r1, r2, r3, r4) {	\
+	r1 ^= r3; r3 =~ r3;		\
+	r2 ^= r3; r3 ^= r0;		\
+	r4  = r1; r1 &= r3;		\
+	r1 ^= r2; r4 ^= r3;		\
+	r0 ^= r4; r2 &= r4;		\
+	r2 ^= r0; r0 &= r1;		\
+	r3 ^= r0; r4 |= r1;		\
+	r4 ^= r0; r0 |= r3;		\
+	r0 ^= r2; r2 &= r3;		\
+	r0 =~ r0; r4 ^= r2;		\
+}
+
+#define S5(r0, r1, r2, r3, r4) {	\
+	r0 ^= r1; r1 ^= r3;		\
+	r3 =~ r3; r4  = r1;		\
+	r1 &= r0; r2 ^= r3;		\
+	r1 ^= r2; r2 |= r4;		\
+	r4 ^= r3; r3 &= r1;		\
+	r3 ^= r0; r4 ^= r1;		\
+	r4 ^= r2; r2 ^= r0;		\
+	r0 &= r3; r2 =~ r2;		\
+	r0 ^= r4; r4 |= r3;		\
+	r2 ^= r4;			\
+}
+
+#define S6(r0, r1, r2, r3, r4) {	\
+	r2 =~ r2; r4  = r3;		\
+	r3 &= r0; r0 ^= r4;		\
+	r3 ^= r2; r2 |= r4;		\
+	r1 ^= r3; r2 ^= r0;		\
+	r0 |= r1; r2 ^= r1;		\
+	r4 ^= r0; r0 |= r3;		\
+	r0 ^= r2; r4 ^= r3;		\
+	r4 ^= r0; r3 =~ r3;		\
+	r2 &= r4; r2 ^= r3;		\
+}
+
+#define S7(r0, r1, r2, r3, r4) {	\
+	r4  = r1; r1 |= r2;		\
+	r1 ^= r3; r4 ^= r2;		\
+	r2 ^= r1; r3 |= r4;		\
+	r3 &= r0; r4 ^= r2;		\
+	r3 ^= r1; r1 |= r4;		\
+	r1 ^= r0; r0 |= r4;		\
+	r0 ^= r2; r1 ^= r4;		\
+	r2 ^= r1; r1 &= r0;		\
+	r1 ^= r4; r2 =~ r2;		\
+	r2 |= r0; r4 ^= r2;		\
+}
+
+// The Serpent key addition step. Subkeys are read from "sk" in the caller scope
+#define KA(zc, x0, x1, x2, x3) {	\
+	x0 ^= sk[zc];			\
+	x1 ^= sk[zc + 1];		\
+	x2 ^= sk[zc + 2];		\
+	x3 ^= sk[zc + 3];		\
+}
+
+// The Serpent linear transform
+#define SERPENT_LT(x0, x1, x2, x3) {	\
+	x0 = ROTL32(x0, 13);		\
+	x2 = ROTL32(x2, 3);		\
+	x1 = x1 ^ x0 ^ x2;		\
+	x3 = x3 ^ x2 ^ (x0 << 3);	\
+	x1 = ROTL32(x1, 1);		\
+	x3 = ROTL32(x3, 7);		\
+	x0 = x0 ^ x1 ^ x3;		\
+	x2 = x2 ^ x3 ^ (x1 << 7);	\
+	x0 = ROTL32(x0, 5);		\
+	x2 = ROTL32(x2, 22);		\
+}
+
+/* 
+ * One Serpent round
+ * zc - current subkey counter
+ * S - S-box macro for this round
+ * i0 - i4 - input register number
+ * o0 - o3 - output register number
+*/
+#define FSS(zc, S, i0, i1, i2, i3, i4, o0, o1, o2, o3) {	\
+	KA(zc, r ## i0, r ## i1, r ## i2, r ## i3);		\
+	S(r ## i0, r ## i1, r ## i2, r ## i3, r ## i4);		\
+	SERPENT_LT(r ## o0, r ## o1, r ## o2, r ## o3);		\
+}
+
+// Last Serpent round. Keep the linear transformation for that last round
+#define FSF(zc, S, i0, i1, i2, i3, i4, o0, o1, o2, o3) {	\
+	KA(zc, r ## i0, r ## i1, r ## i2, r ## i3);		\
+	S(r ## i0, r ## i1, r ## i2, r ## i3, r ## i4);		\
+	SERPENT_LT(r ## o0, r ## o1, r ## o2, r ## o3);		\
+	KA(zc + 4, r ## o0, r ## o1, r ## o2, r ## o3);		\
+}
+
+/*
+ * Serpent24 on the IV held in r0..r3, with subkeys "sk" in the caller scope.
+ * IVS(field, register) stores the outputs of rounds 12, 18 and 24 into the
+ * running state fields (s[0..9], r1, r2)
+*/
+#define SERPENT24_IV(IVS) {				\
+	FSS( 0, S0, 0, 1, 2, 3, 4, 1, 4, 2, 0);		\
+	FSS( 4, S1, 1, 4, 2, 0, 3, 2, 1, 0, 4);		\
+	FSS( 8, S2, 2, 1, 0, 4, 3, 0, 4, 1, 3);		\
+	FSS(12, S3, 0, 4, 1, 3, 2, 4, 1, 3, 2);		\
+	FSS(16, S4, 4, 1, 3, 2, 0, 1, 0, 4, 2);		\
+	FSS(20, S5, 1, 0, 4, 2, 3, 0, 2, 1, 4);		\
+	FSS(24, S6, 0, 2, 1, 4, 3, 0, 2, 3, 1);		\
+	FSS(28, S7, 0, 2, 3, 1, 4, 4, 1, 2, 0);		\
+	FSS(32, S0, 4, 1, 2, 0, 3, 1, 3, 2, 4);		\
+	FSS(36, S1, 1, 3, 2, 4, 0, 2, 1, 4, 3);		\
+	FSS(40, S2, 2, 1, 4, 3, 0, 4, 3, 1, 0);		\
+	FSS(44, S3, 4, 3, 1, 0, 2, 3, 1, 0, 2);		\
+							\
+	IVS(s[9], r3);					\
+	IVS(s[8], r1);					\
+	IVS(s[7], r0);					\
+	IVS(s[6], r2);					\
+							\
+	FSS(48, S4, 3, 1, 0, 2, 4, 1, 4, 3, 2);		\
+	FSS(52, S5, 1, 4, 3, 2, 0, 4, 2, 1, 3);		\
+	FSS(56, S6, 4, 2, 1, 3, 0, 4, 2, 0, 1);		\
+	FSS(60, S7, 4, 2, 0, 1, 3, 3, 1, 2, 4);		\
+	FSS(64, S0, 3, 1, 2, 4, 0, 1, 0, 2, 3);		\
+	FSS(68, S1, 1, 0, 2, 3, 4, 2, 1, 3, 0);		\
+							\
+	IVS(r1, r2);					\
+	IVS(s[4], r1);					\
+	IVS(r2, r3);					\
+	IVS(s[5], r0);					\
+							\
+	FSS(72, S2, 2, 1, 3, 0, 4, 3, 0, 1, 4);		\
+	FSS(76, S3, 3, 0, 1, 4, 2, 0, 1, 4, 2);		\
+	FSS(80, S4, 0, 1, 4, 2, 3, 1, 3, 0, 2);		\
+	FSS(84, S5, 1, 3, 0, 2, 4, 3, 2, 1, 0);		\
+	FSS(88, S6, 3, 2, 1, 0, 4, 3, 2, 4, 1);		\
+	FSF(92, S7, 3, 2, 4, 1, 0, 0, 1, 2, 3);		\
+							\
+	IVS(s[3], r0);					\
+	IVS(s[2], r1);					\
+	IVS(s[1], r2);					\
+	IVS(s[0], r3);					\
+}
+
+// Updates the finite state machine. Temporaries "tt" and "or1" are declared by the caller
+#define FSM(x1, x3) {				\
+	tt = XMUX(r1, s ## x1, s ## x3);	\
+	or1 = r1;				\
+	r1 = r2 + tt;				\
+	tt = or1 * 0x54655307;			\
+	r2 = ROTL32(tt, 7);			\
+}
+
+// Updates the shift registres. Value stored in "dd" and "ee"
+#define LRU(x0, x2, x4, dd, ee) {				\
+	dd = s ## x0;						\
+	s ## x0 = MUL_A(s ## x0) ^ MUL_G(s ## x2) ^ s ## x4;	\
+	ee = (s ## x4 + r1) ^ r2;				\
+}
+
+// Computes one internal round
+#define STEP(x0, x1, x2, x3, x4, dd, ee) {	\
+	FSM(x1, x3);				\
+	LRU(x0, x2, x4, dd, ee);		\
+}
+
+// Entry keystream
+#define SRD(S, x0, x1, x2, x3, i) {		\
+	S(u0, u1, u2, u3, u4);			\
+	keystream[i] = U32TO32(((u ## x0) ^ v0));		\
+	keystream[i + 1] = U32TO32(((u ## x1) ^ v1));	\
+	keystream[i + 2] = U32TO32(((u ## x2) ^ v2));	\
+	keystream[i + 3] = U32TO32(((u ## x3) ^ v3));	\
+}
+
+// One keystream block: 20 internal rounds, 80 bytes written in keystream[0..19]
+#define SOSEMANUK_BLOCK {			\
+	STEP(0, 1, 3, 8, 9, v0, u0);		\
+	STEP(1, 2, 4, 9, 0, v1, u1);		\
+	STEP(2, 3, 5, 0, 1, v2, u2);		\
+	STEP(3, 4, 6, 1, 2, v3, u3);		\
+	SRD(S2, 2, 3, 1, 4, 0);			\
+						\
+	STEP(4, 5, 7, 2, 3, v0, u0);		\
+	STEP(5, 6, 8, 3, 4, v1, u1);		\
+	STEP(6, 7, 9, 4, 5, v2, u2);		\
+	STEP(7, 8, 0, 5, 6, v3, u3);		\
+	SRD(S2, 2, 3, 1, 4, 4);			\
+						\
+	STEP(8, 9, 1, 6, 7, v0, u0);		\
+	STEP(9, 0, 2, 7, 8, v1, u1);		\
+	STEP(0, 1, 3, 8, 9, v2, u2);		\
+	STEP(1, 2, 4, 9, 0, v3, u3);		\
+	SRD(S2, 2, 3, 1, 4, 8);			\
+						\
+	STEP(2, 3, 5, 0, 1, v0, u0);		\
+	STEP(3, 4, 6, 1, 2, v1, u1);		\
+	STEP(4, 5, 7, 2, 3, v2, u2);		\
+	STEP(5, 6, 8, 3, 4, v3, u3);		\
+	SRD(S2, 2, 3, 1, 4, 12);		\
+						\
+	STEP(6, 7, 9, 4, 5, v0, u0);		\
+	STEP(7, 8, 0, 5, 6, v1, u1);		\
+	STEP(8, 9, 1, 6, 7, v2, u2);		\
+	STEP(9, 0, 2, 7, 8, v3, u3);		\
+	SRD(S2, 2, 3, 1, 4, 16);		\
+}
+
+#ifndef SOSEMANUK_NO_TABLES
+
+// Multiplication tables for alpha and 1/alpha (sosemanuk.c)
+extern const uint32_t mul_a[256];
+extern const uint32_t mul_ia[256];
+
+// alpha * x and 1/alpha * x, LOOKUP(table, index) reads one table word per lane
+#define MUL_ALPHA(x, LOOKUP)	(((x) << 8) ^ LOOKUP(mul_a, (x) >> 24))
+#define DIV_ALPHA(x, LOOKUP)	(((x) >> 8) ^ LOOKUP(mul_ia, (x) & 0xFF))
+
+#else
+
+/*
+ * Table-free build: the table words are GF(2)-linear in their index, so
+ * mul_a[b] is the XOR of mul_a[1 << i] over the bits i of b. The masks come
+ * from arithmetic: no load depends on the state (no cache-timing leak) and the
+ * expression vectorizes like the rest of the round. LOOKUP is not used
+*/
+#define MUL_BIT(b, i, t)	(-(((b) >> (i)) & 0x1) & (t))
+
+#define MUL_BITS(b, t0, t1, t2, t3, t4, t5, t6, t7)			\
+	(MUL_BIT(b, 0, t0) ^ MUL_BIT(b, 1, t1) ^ MUL_BIT(b, 2, t2) ^	\
+	 MUL_BIT(b, 3, t3) ^ MUL_BIT(b, 4, t4) ^ MUL_BIT(b, 5, t5) ^	\
+	 MUL_BIT(b, 6, t6) ^ MUL_BIT(b, 7, t7))
+
+#define MUL_ALPHA(x, LOOKUP)							\
+	(((x) << 8) ^ MUL_BITS((x) >> 24, 0xE19FCF13U, 0x6B973726U, 0xD6876E4CU,	\
+		0x05A7DC98U, 0x0AE71199U, 0x1467229BU, 0x28CE449FU, 0x50358897U))
+
+#define DIV_ALPHA(x, LOOKUP)							\
+	(((x) >> 8) ^ MUL_BITS((x) & 0xFF, 0x180F40CDU, 0x301E8033U, 0x603CA966U,	\
+		0xC078FBCCU, 0x29F05F31U, 0x5249BE62U, 0xA492D5C4U, 0xE18D0321U))
+
+#endif
+
+/*
+ * One set of kernels for a given instruction set (sosemanuk_simd.c)
+ * features - SOSEMANUK_CPU_* flags the kernels need
+ * xor_nt - XOR with non-temporal stores, completed by store_fence
+ * keystream_x16 - one block per lane, lane-contiguous (two x8 calls where AVX-512 is missing)
+ * ivsetup_x4, ivsetup_x8 - may be NULL, batched IV setup then runs the scalar code
+ * ivsetup_x16 - may be NULL, batched IV setup then runs 8 lanes at a time
+*/
+struct sosemanuk_impl {
+	const char *name;
+	unsigned int features;
+	void (*crypt)(struct sosemanuk_context *ctx, const uint8_t *buf, size_t buflen, uint8_t *out);
+	void (*xor_bytes)(uint8_t *out, const uint8_t *buf, const uint8_t *ks, size_t len);
+	void (*xor_nt)(uint8_t *out, const uint8_t *buf, const uint8_t *ks, size_t len);
+	void (*store_fence)(void);
+	void (*keystream_x4)(struct sosemanuk_context_x4 *xctx, uint32_t *keystream);
+	void (*keystream_x8)(struct sosemanuk_context_x8 *xctx, uint32_t *keystream);
+	void (*keystream_x16)(struct sosemanuk_context_x16 *xctx, uint32_t *keystream);
+	void (*ivsetup_x4)(struct sosemanuk_context *const *ctx, const uint32_t *sk);
+	void (*ivsetup_x8)(struct sosemanuk_context *const *ctx, const uint32_t *sk);
+	void (*ivsetup_x16)(struct sosemanuk_context *const *ctx, const uint32_t *sk);
+};
+
+// Implementation bound at startup
+extern const struct sosemanuk_impl *sosemanuk_impl;
+
+// Portable kernels (sosemanuk.c)
+void sosemanuk_generate_keystream_ref(struct sosemanuk_context *ctx, uint32_t *keystream);
+
+void sosemanuk_crypt_ref(struct sosemanuk_context *ctx, const uint8_t *buf, size_t buflen, uint8_t *out);
+
+void sosemanuk_xor_ref(uint8_t *out, const uint8_t *buf, const uint8_t *ks, size_t len);
+
+void sosemanuk_store_fence_ref(void);
+
+// Clear key material or keystream: the stores are never optimized out
+void sosemanuk_wipe(void *p, size_t len);
+
+// Statistics (sosemanuk_stats.c): a sample covers the code between STATS_START and STATS_STOP
+#include "sosemanuk_stats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define STATS_NOW()	__builtin_ia32_rdtsc()
+#else
+#define STATS_NOW()	sosemanuk_stats_ns()
+#endif
+
+#ifdef SOSEMANUK_STATS
+#define STATS_START(t)				uint64_t t = STATS_NOW()
+#define STATS_STOP(t, phase, count, bytes)	sosemanuk_stats_add(phase, count, bytes, t)
+#else
+#define STATS_START(t)
+#define STATS_STOP(t, phase, count, bytes)
+#endif
+
+uint64_t sosemanuk_stats_ns(void);
+
+void sosemanuk_stats_add(enum sosemanuk_phase phase, uint64_t count, uint64_t bytes, uint64_t start);
+
+#endif
@@ -0,0 +1,348 @@
+/*
+ * Cache of prepared keys (see sosemanuk_keycache.h).
+ *
+ * The cache is cut into KEYCACHE_SHARDS shards, each with its own lock, hash
+ * table and LRU list, so threads working on different keys rarely meet. The
+ * shard and the bucket of a key come from one SipHash-2-4 of the key bytes
+ * under a secret drawn at creation: the placement cannot be predicted, and a
+ * peer choosing keys cannot pile them up in one bucket.
+ * The key schedule of a miss and the IV setup run outside of the lock. The
+ * entries live in one mapping kept out of core dumps; an evicted entry is
+ * wiped before it is reused.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+
+#include "sosemanuk.h"
+#include "sosemanuk_internal.h"
+#include "sosemanuk_keycache.h"
+
+#define KEYCACHE_SHARDS	16
+
+// The top bits of the hash pick the shard, the low bits the bucket
+#define KEYCACHE_SHARD(hash)	((hash) >> 60)
+
+struct keycache_entry {
+	uint64_t hash;
+	struct keycache_entry *chain;
+	struct keycache_entry *prev;
+	struct keycache_entry *next;
+	struct sosemanuk_key key;
+};
+
+struct keycache_shard {
+	pthread_mutex_t lock;
+	struct keycache_entry **bucket;
+	size_t mask;
+	struct keycache_entry *entries;
+	size_t used;
+	size_t capacity;
+	// LRU list: the most recently used entry follows the head
+	struct keycache_entry *head;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+} __attribute__((aligned(64)));
+
+struct sosemanuk_keycache {
+	uint64_t k0;
+	uint64_t k1;
+	void *mem;
+	size_t memlen;
+	struct keycache_shard shard[KEYCACHE_SHARDS];
+};
+
+#define ROTL64(v, n)	(((v) << (n)) | ((v) >> (64 - (n))))
+
+#define SIPROUND {						\
+	v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32);	\
+	v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;		\
+	v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;		\
+	v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32);	\
+}
+
+// SipHash-2-4 of in[0..len-1] under the key (k0, k1)
+static uint64_t
+siphash24(uint64_t k0, uint64_t k1, const uint8_t *in, size_t len)
+{
+	uint64_t v0 = k0 ^ 0x736F6D6570736575ULL;
+	uint64_t v1 = k1 ^ 0x646F72616E646F6DULL;
+	uint64_t v2 = k0 ^ 0x6C7967656E657261ULL;
+	uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+	uint64_t m, b = (uint64_t)len << 56;
+	size_t i, j;
+
+	for(i = 0; i + 8 <= len; i += 8) {
+		for(m = 0, j = 0; j < 8; j++)
+			m |= (uint64_t)in[i + j] << (8 * j);
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+
+	for(j = 0; i + j < len; j++)
+		b |= (uint64_t)in[i + j] << (8 * j);
+
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+
+	v2 ^= 0xFF;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Compare without an early exit: the time does not depend on where keys differ
+static int
+keycache_equal(const uint8_t *a, const uint8_t *b, int len)
+{
+	uint8_t diff = 0;
+	int i;
+
+	for(i = 0; i < len; i++)
+		diff |= a[i] ^ b[i];
+
+	return diff == 0;
+}
+
+static void
+keycache_unlink(struct keycache_entry *e)
+{
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+}
+
+static void
+keycache_push_front(struct keycache_shard *sh, struct keycache_entry *e)
+{
+	e->prev = sh->head;
+	e->next = sh->head->next;
+	sh->head->next->prev = e;
+	sh->head->next = e;
+}
+
+// Lock held. Return value: entry of the key, NULL (if not cached)
+static struct keycache_entry *
+keycache_find(struct keycache_shard *sh, uint64_t hash, const uint8_t *key, int keylen)
+{
+	struct keycache_entry *e;
+
+	for(e = sh->bucket[hash & sh->mask]; e; e = e->chain) {
+		if(e->hash == hash && e->key.keylen == keylen && keycache_equal(e->key.key, key, keylen))
+			return e;
+	}
+
+	return NULL;
+}
+
+// Lock held. Take a free entry or evict the least recently used one
+static struct keycache_entry *
+keycache_insert(struct keycache_shard *sh, uint64_t hash, const struct sosemanuk_key *kctx)
+{
+	struct keycache_entry *e, **p;
+
+	if(sh->used < sh->capacity) {
+		e = &sh->entries[sh->used++];
+	} else {
+		e = sh->head->prev;
+		for(p = &sh->bucket[e->hash & sh->mask]; *p != e; p = &(*p)->chain)
+			;
+		*p = e->chain;
+		keycache_unlink(e);
+		sosemanuk_wipe(&e->key, sizeof(e->key));
+		sh->evictions++;
+	}
+
+	e->hash = hash;
+	memcpy(&e->key, kctx, sizeof(e->key));
+	e->chain = sh->bucket[hash & sh->mask];
+	sh->bucket[hash & sh->mask] = e;
+	keycache_push_front(sh, e);
+
+	return e;
+}
+
+/*
+ * Entry of a key, prepared and inserted on a miss. Returns with the lock of
+ * *shp held, the entry stays valid until it is released
+ * Return value: entry, *hit set to 1 (hit) or 0 (miss)
+*/
+static struct keycache_entry *
+keycache_acquire(struct sosemanuk_keycache *cache, const uint8_t *key, int keylen,
+	struct keycache_shard **shp, int *hit)
+{
+	uint64_t hash = siphash24(cache->k0, cache->k1, key, keylen);
+	struct keycache_shard *sh = &cache->shard[KEYCACHE_SHARD(hash)];
+	struct keycache_entry *e;
+	struct sosemanuk_key kctx;
+
+	*shp = sh;
+
+	pthread_mutex_lock(&sh->lock);
+	e = keycache_find(sh, hash, key, keylen);
+	if(e) {
+		sh->hits++;
+		keycache_unlink(e);
+		keycache_push_front(sh, e);
+		*hit = 1;
+		return e;
+	}
+	sh->misses++;
+	pthread_mutex_unlock(&sh->lock);
+
+	sosemanuk_set_key(&kctx, key, keylen);
+
+	// Another thread may have inserted the key in the meantime
+	pthread_mutex_lock(&sh->lock);
+	e = keycache_find(sh, hash, key, keylen);
+	if(!e)
+		e = keycache_insert(sh, hash, &kctx);
+
+	sosemanuk_wipe(&kctx, sizeof(kctx));
+	*hit = 0;
+
+	return e;
+}
+
+struct sosemanuk_keycache *
+sosemanuk_keycache_create(size_t capacity)
+{
+	struct sosemanuk_keycache *cache;
+	struct keycache_shard *sh;
+	size_t per_shard, buckets, i;
+	uint64_t seed[2];
+
+	if(capacity == 0 || capacity > ((size_t)1 << 32))
+		return NULL;
+
+	if(getrandom(seed, sizeof(seed), 0) != sizeof(seed))
+		return NULL;
+
+	cache = calloc(1, sizeof(*cache));
+	if(!cache)
+		return NULL;
+
+	cache->k0 = seed[0];
+	cache->k1 = seed[1];
+	sosemanuk_wipe(seed, sizeof(seed));
+
+	// One extra entry per shard is the head of its LRU list
+	per_shard = (capacity + KEYCACHE_SHARDS - 1) / KEYCACHE_SHARDS;
+	cache->memlen = KEYCACHE_SHARDS * (per_shard + 1) * sizeof(struct keycache_entry);
+	cache->mem = mmap(NULL, cache->memlen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(cache->mem == MAP_FAILED) {
+		free(cache);
+		return NULL;
+	}
+#ifdef MADV_DONTDUMP
+	madvise(cache->mem, cache->memlen, MADV_DONTDUMP);
+#endif
+
+	for(buckets = 1; buckets < 2 * per_shard; buckets <<= 1)
+		;
+
+	for(i = 0; i < KEYCACHE_SHARDS; i++)
+		pthread_mutex_init(&cache->shard[i].lock, NULL);
+
+	for(i = 0; i < KEYCACHE_SHARDS; i++) {
+		sh = &cache->shard[i];
+		sh->head = (struct keycache_entry *)cache->mem + i * (per_shard + 1);
+		sh->head->prev = sh->head;
+		sh->head->next = sh->head;
+		sh->entries = sh->head + 1;
+		sh->capacity = per_shard;
+		sh->mask = buckets - 1;
+		sh->bucket = calloc(buckets, sizeof(*sh->bucket));
+		if(!sh->bucket) {
+			sosemanuk_keycache_destroy(cache);
+			return NULL;
+		}
+	}
+
+	return cache;
+}
+
+void
+sosemanuk_keycache_destroy(struct sosemanuk_keycache *cache)
+{
+	size_t i;
+
+	for(i = 0; i < KEYCACHE_SHARDS; i++) {
+		pthread_mutex_destroy(&cache->shard[i].lock);
+		free(cache->shard[i].bucket);
+	}
+
+	sosemanuk_wipe(cache->mem, cache->memlen);
+	munmap(cache->mem, cache->memlen);
+	sosemanuk_wipe(cache, sizeof(*cache));
+	free(cache);
+}
+
+int
+sosemanuk_keycache_get(struct sosemanuk_keycache *cache, struct sosemanuk_key *kctx, const uint8_t *key, const int keylen)
+{
+	struct keycache_shard *sh;
+	struct keycache_entry *e;
+	int hit;
+
+	if((keylen <= 0) || (keylen > 32))
+		return -1;
+
+	e = keycache_acquire(cache, key, keylen, &sh, &hit);
+	memcpy(kctx, &e->key, sizeof(*kctx));
+	pthread_mutex_unlock(&sh->lock);
+
+	return hit;
+}
+
+int
+sosemanuk_keycache_set_key_and_iv(struct sosemanuk_keycache *cache, struct sosemanuk_context *ctx,
+	const uint8_t *key, const int keylen, const uint8_t *iv, const int ivlen)
+{
+	struct sosemanuk_key kctx;
+
+	if((ivlen <= 0) || (ivlen > 16))
+		return -1;
+
+	// The IV setup runs on a copy, outside of the shard lock
+	if(sosemanuk_keycache_get(cache, &kctx, key, keylen) < 0)
+		return -1;
+
+	// ctx->sk is filled as by sosemanuk_set_key_and_iv
+	memcpy(ctx->sk, kctx.sk, sizeof(ctx->sk));
+	sosemanuk_set_iv(ctx, &kctx, iv, ivlen);
+	sosemanuk_wipe(&kctx, sizeof(kctx));
+
+	return 0;
+}
+
+void
+sosemanuk_keycache_stats(struct sosemanuk_keycache *cache, struct sosemanuk_keycache_stats *st)
+{
+	struct keycache_shard *sh;
+	size_t i;
+
+	memset(st, 0, sizeof(*st));
+
+	for(i = 0; i < KEYCACHE_SHARDS; i++) {
+		sh = &cache->shard[i];
+		pthread_mutex_lock(&sh->lock);
+		st->hits += sh->hits;
+		st->misses += sh->misses;
+		st->evictions += sh->evictions;
+		st->entries += sh->used;
+		pthread_mutex_unlock(&sh->lock);
+	}
+}
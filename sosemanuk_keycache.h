@@ -0,0 +1,48 @@
+/*
+ * Cache of prepared keys for services where a working set of keys recurs.
+ * A hit replaces the Serpent24 key schedule of sosemanuk_set_key by a lookup;
+ * only the IV injection is left to compute. The cache holds a bounded number
+ * of keys, evicts the least recently used one when full and wipes every key
+ * schedule it drops. All calls are thread-safe.
+*/
+
+#ifndef SOSEMANUK_KEYCACHE_H
+#define SOSEMANUK_KEYCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sosemanuk.h"
+
+struct sosemanuk_keycache;
+
+struct sosemanuk_keycache_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	size_t entries;
+};
+
+// Create a cache of at least "capacity" keys
+// Return value: pointer on the cache, NULL (if capacity is 0 or no resources)
+struct sosemanuk_keycache *sosemanuk_keycache_create(size_t capacity);
+
+// Wipe every cached key and free the cache
+void sosemanuk_keycache_destroy(struct sosemanuk_keycache *cache);
+
+/*
+ * Copy the prepared key of "key" into kctx, same result as sosemanuk_set_key.
+ * On a miss the key is prepared and cached
+ * Return value: 1 (hit), 0 (miss), -1 (bad key length)
+*/
+int sosemanuk_keycache_get(struct sosemanuk_keycache *cache, struct sosemanuk_key *kctx, const uint8_t *key, const int keylen);
+
+// sosemanuk_set_key_and_iv with the key schedule taken from the cache
+// Return value: 0 (if all is well), -1 (is all bad)
+int sosemanuk_keycache_set_key_and_iv(struct sosemanuk_keycache *cache, struct sosemanuk_context *ctx,
+	const uint8_t *key, const int keylen, const uint8_t *iv, const int ivlen);
+
+// Counters since creation and number of keys held
+void sosemanuk_keycache_stats(struct sosemanuk_keycache *cache, struct sosemanuk_keycache_stats *st);
+
+#endif
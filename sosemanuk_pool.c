@@ -0,0 +1,253 @@
+/*
+ * Pool of Sosemanuk contexts (see sosemanuk_pool.h).
+ *
+ * A slab is POOL_SLAB_SIZE bytes aligned on its size: a 64-byte header, the
+ * contexts (one or more cache lines each), the freelist links and one in-use
+ * flag per context. The owner slab of a context is found by masking its
+ * address and looked up in a hash table of the slabs of the pool (open
+ * addressing on the slab number, at most half full) before it is read, so a
+ * foreign pointer is refused in O(1). The in-use flag refuses a second
+ * release of the same context.
+ * Every context has a global index (slab * POOL_SLAB_ITEMS + position). The
+ * freelist is a stack of indexes; its head is one 64-bit word holding the top
+ * index and a tag incremented on every change, so the compare-and-swap cannot
+ * be fooled by a context released and acquired again in between (ABA).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "sosemanuk.h"
+#include "sosemanuk_internal.h"
+#include "sosemanuk_pool.h"
+
+#define POOL_SLAB_SIZE	(4 << 20)
+#define POOL_MAX_SLABS	1024
+#define POOL_HEADER	64
+#define POOL_STRIDE	((sizeof(struct sosemanuk_context) + 63) & ~(size_t)63)
+#define POOL_SLAB_ITEMS	((POOL_SLAB_SIZE - POOL_HEADER) / (POOL_STRIDE + sizeof(uint32_t) + 1))
+#define POOL_EMPTY	0xFFFFFFFF
+
+// Slab lookup table, twice the maximum number of slabs
+#define POOL_TABLE_BITS	11
+#define POOL_TABLE	(1 << POOL_TABLE_BITS)
+#define POOL_TABLE_HASH(slab)	\
+	((uint32_t)((((uintptr_t)(slab) / POOL_SLAB_SIZE) * 0x9E3779B97F4A7C15ULL) >> (64 - POOL_TABLE_BITS)))
+
+// Head word of the freelist
+#define HEAD(tag, index)	(((uint64_t)(tag) << 32) | (uint32_t)(index))
+#define HEAD_TAG(head)		((uint32_t)((head) >> 32))
+#define HEAD_INDEX(head)	((uint32_t)(head))
+
+struct pool_slab {
+	uint32_t first;
+	uint32_t *next;
+	uint8_t *items;
+	uint8_t *used;
+};
+
+struct sosemanuk_pool {
+	uint64_t head __attribute__((aligned(64)));
+	struct pool_slab *slabs[POOL_MAX_SLABS] __attribute__((aligned(64)));
+	struct pool_slab *table[POOL_TABLE];
+	uint32_t nslabs;
+	pthread_mutex_t grow;
+};
+
+// Slab at the masked address of a context, NULL if it is not a slab of the pool
+static struct pool_slab *
+pool_find_slab(struct sosemanuk_pool *pool, const struct pool_slab *slab)
+{
+	struct pool_slab *e;
+	uint32_t h;
+
+	for(h = POOL_TABLE_HASH(slab);; h = (h + 1) & (POOL_TABLE - 1)) {
+		e = __atomic_load_n(&pool->table[h], __ATOMIC_ACQUIRE);
+		if(e == slab || e == NULL)
+			return e;
+	}
+}
+
+// Map one slab aligned on POOL_SLAB_SIZE: map twice the size and trim both ends
+static struct pool_slab *
+pool_slab_map(void)
+{
+	uint8_t *p, *base;
+	size_t head;
+
+	p = mmap(NULL, 2 * POOL_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(p == MAP_FAILED)
+		return NULL;
+
+	base = (uint8_t *)(((uintptr_t)p + POOL_SLAB_SIZE - 1) & ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+	head = base - p;
+
+	if(head > 0)
+		munmap(p, head);
+	munmap(base + POOL_SLAB_SIZE, POOL_SLAB_SIZE - head);
+
+#ifdef MADV_HUGEPAGE
+	madvise(base, POOL_SLAB_SIZE, MADV_HUGEPAGE);
+#endif
+
+	return (struct pool_slab *)base;
+}
+
+// Push the chain first..last (already linked) on the freelist
+static void
+pool_push(struct sosemanuk_pool *pool, uint32_t *last_next, uint32_t first)
+{
+	uint64_t old, new;
+
+	old = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+	do {
+		__atomic_store_n(last_next, HEAD_INDEX(old), __ATOMIC_RELAXED);
+		new = HEAD(HEAD_TAG(old) + 1, first);
+	} while(!__atomic_compare_exchange_n(&pool->head, &old, new, 1, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+// Add one slab to the pool and push all its contexts on the freelist
+// Return value: 0 (if all is well), -1 (no memory or POOL_MAX_SLABS reached)
+static int
+pool_grow(struct sosemanuk_pool *pool)
+{
+	struct pool_slab *slab;
+	uint32_t i;
+	int ret = 0;
+
+	pthread_mutex_lock(&pool->grow);
+
+	// Another thread may have grown the pool while this one was waiting
+	if(HEAD_INDEX(__atomic_load_n(&pool->head, __ATOMIC_ACQUIRE)) != POOL_EMPTY)
+		goto out;
+
+	if(pool->nslabs == POOL_MAX_SLABS || (slab = pool_slab_map()) == NULL) {
+		ret = -1;
+		goto out;
+	}
+
+	slab->first = pool->nslabs * POOL_SLAB_ITEMS;
+	slab->items = (uint8_t *)slab + POOL_HEADER;
+	slab->next = (uint32_t *)(slab->items + POOL_SLAB_ITEMS * POOL_STRIDE);
+	slab->used = (uint8_t *)(slab->next + POOL_SLAB_ITEMS);
+
+	for(i = 0; i < POOL_SLAB_ITEMS - 1; i++)
+		slab->next[i] = slab->first + i + 1;
+
+	// Entries are only added, under the grow lock
+	for(i = POOL_TABLE_HASH(slab); pool->table[i]; i = (i + 1) & (POOL_TABLE - 1))
+		;
+	__atomic_store_n(&pool->table[i], slab, __ATOMIC_RELEASE);
+
+	__atomic_store_n(&pool->slabs[pool->nslabs], slab, __ATOMIC_RELEASE);
+	__atomic_store_n(&pool->nslabs, pool->nslabs + 1, __ATOMIC_RELEASE);
+
+	pool_push(pool, &slab->next[POOL_SLAB_ITEMS - 1], slab->first);
+
+out:
+	pthread_mutex_unlock(&pool->grow);
+	return ret;
+}
+
+struct sosemanuk_pool *
+sosemanuk_pool_create(size_t count)
+{
+	struct sosemanuk_pool *pool;
+
+	if(posix_memalign((void **)&pool, 64, sizeof(*pool)))
+		return NULL;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->head = HEAD(0, POOL_EMPTY);
+	pthread_mutex_init(&pool->grow, NULL);
+
+	while(sosemanuk_pool_capacity(pool) < count) {
+		if(pool_grow(pool) < 0) {
+			sosemanuk_pool_destroy(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+void
+sosemanuk_pool_destroy(struct sosemanuk_pool *pool)
+{
+	uint32_t i;
+
+	for(i = 0; i < pool->nslabs; i++) {
+		sosemanuk_wipe(pool->slabs[i]->items, POOL_SLAB_ITEMS * POOL_STRIDE);
+		munmap(pool->slabs[i], POOL_SLAB_SIZE);
+	}
+
+	pthread_mutex_destroy(&pool->grow);
+	free(pool);
+}
+
+struct sosemanuk_context *
+sosemanuk_pool_acquire(struct sosemanuk_pool *pool)
+{
+	struct pool_slab *slab;
+	uint64_t old, new;
+	uint32_t index, next;
+
+	old = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+	for(;;) {
+		index = HEAD_INDEX(old);
+
+		if(index == POOL_EMPTY) {
+			if(pool_grow(pool) < 0)
+				return NULL;
+			old = __atomic_load_n(&pool->head, __ATOMIC_ACQUIRE);
+			continue;
+		}
+
+		// The link may be stale if the head moved: the tag makes the CAS fail then
+		slab = __atomic_load_n(&pool->slabs[index / POOL_SLAB_ITEMS], __ATOMIC_ACQUIRE);
+		next = __atomic_load_n(&slab->next[index % POOL_SLAB_ITEMS], __ATOMIC_RELAXED);
+		new = HEAD(HEAD_TAG(old) + 1, next);
+
+		if(__atomic_compare_exchange_n(&pool->head, &old, new, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&slab->used[index % POOL_SLAB_ITEMS], 1, __ATOMIC_RELAXED);
+			return (struct sosemanuk_context *)(slab->items + (index % POOL_SLAB_ITEMS) * POOL_STRIDE);
+		}
+	}
+}
+
+int
+sosemanuk_pool_release(struct sosemanuk_pool *pool, struct sosemanuk_context *ctx)
+{
+	struct pool_slab *slab;
+	size_t offset;
+	uint32_t i;
+
+	slab = (struct pool_slab *)((uintptr_t)ctx & ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+	offset = (uint8_t *)ctx - (uint8_t *)slab;
+
+	// A foreign pointer may mask to unmapped memory: find the slab before reading it
+	if(!pool_find_slab(pool, slab) || offset < POOL_HEADER || (offset - POOL_HEADER) % POOL_STRIDE != 0 ||
+		(offset - POOL_HEADER) / POOL_STRIDE >= POOL_SLAB_ITEMS)
+		return -1;
+
+	i = (offset - POOL_HEADER) / POOL_STRIDE;
+
+	// Released twice: pushing it again would hand it out twice
+	if(!__atomic_exchange_n(&slab->used[i], 0, __ATOMIC_RELAXED))
+		return -1;
+
+	sosemanuk_wipe(ctx, sizeof(*ctx));
+	pool_push(pool, &slab->next[i], slab->first + i);
+
+	return 0;
+}
+
+size_t
+sosemanuk_pool_capacity(const struct sosemanuk_pool *pool)
+{
+	return (size_t)__atomic_load_n(&pool->nslabs, __ATOMIC_ACQUIRE) * POOL_SLAB_ITEMS;
+}
@@ -0,0 +1,36 @@
+/*
+ * Pool of Sosemanuk contexts for servers with many short sessions.
+ * Contexts are carved from large slabs (aligned on their size and advised for
+ * transparent huge pages) and handed out through a lock-free freelist, so
+ * acquire and release are O(1) and never call malloc. A released context is
+ * wiped before it can be handed out again.
+*/
+
+#ifndef SOSEMANUK_POOL_H
+#define SOSEMANUK_POOL_H
+
+#include <stddef.h>
+
+#include "sosemanuk.h"
+
+struct sosemanuk_pool;
+
+// Create a pool with room for at least "count" contexts (more slabs are added on demand)
+// Return value: pointer on the pool, NULL (if memory is not available)
+struct sosemanuk_pool *sosemanuk_pool_create(size_t count);
+
+// Wipe and unmap every slab. No context of the pool may be used afterwards
+void sosemanuk_pool_destroy(struct sosemanuk_pool *pool);
+
+// Take a zeroed context from the pool. Thread-safe
+// Return value: pointer on the context, NULL (if the pool cannot grow)
+struct sosemanuk_context *sosemanuk_pool_acquire(struct sosemanuk_pool *pool);
+
+// Wipe a context returned by sosemanuk_pool_acquire and give it back to the pool. Thread-safe
+// Return value: 0 (if all is well), -1 (ctx is not a context of this pool, or is already released)
+int sosemanuk_pool_release(struct sosemanuk_pool *pool, struct sosemanuk_context *ctx);
+
+// Number of contexts in the slabs allocated so far
+size_t sosemanuk_pool_capacity(const struct sosemanuk_pool *pool);
+
+#endif
@@ -0,0 +1,295 @@
+/*
+ * Keystream reservoir (see sosemanuk_reservoir.h).
+ *
+ * The ring of a stream is a single-consumer queue of keystream bytes:
+ *   produced - bytes generated so far, advanced by whoever holds the stream lock
+ *              (the worker or the consumer when the ring is dry)
+ *   consumed - bytes XORed so far, advanced by the consumer only
+ * Blocks are written at produced % size; size is a multiple of 80, so a block
+ * never wraps. The consumer takes no lock while keystream is available.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sosemanuk.h"
+#include "sosemanuk_internal.h"
+#include "sosemanuk_reservoir.h"
+
+// Blocks generated by the worker per hold of the stream lock
+#define RESERVOIR_CHUNK	16
+
+struct sosemanuk_reservoir_stream {
+	uint64_t produced __attribute__((aligned(64)));
+	uint64_t consumed __attribute__((aligned(64)));
+	struct sosemanuk_state st;
+	pthread_mutex_t lock;
+	struct sosemanuk_reservoir *res;
+	struct sosemanuk_reservoir_stream *next;
+	int queued;
+	size_t size;
+	uint8_t *ks;
+};
+
+struct sosemanuk_reservoir {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	struct sosemanuk_reservoir_stream *head;
+	struct sosemanuk_reservoir_stream *tail;
+	struct sosemanuk_reservoir_stream *current;
+	size_t stream_bytes;
+	size_t budget;
+	size_t used;
+	int stop;
+	pthread_t worker;
+};
+
+// Generate up to "blocks" blocks into the free part of the ring. Stream lock held
+// Return value: number of blocks generated
+static size_t
+reservoir_fill(struct sosemanuk_reservoir_stream *rs, size_t blocks)
+{
+	uint64_t produced = rs->produced;
+	uint64_t consumed = __atomic_load_n(&rs->consumed, __ATOMIC_ACQUIRE);
+	size_t n;
+
+	for(n = 0; n < blocks && produced - consumed + 80 <= rs->size; n++) {
+		sosemanuk_state_generate_keystream(&rs->st, (uint32_t *)(rs->ks + produced % rs->size));
+		produced += 80;
+	}
+
+	__atomic_store_n(&rs->produced, produced, __ATOMIC_RELEASE);
+
+	return n;
+}
+
+// Queue a stream for the worker, unless it is queued already
+static void
+reservoir_queue(struct sosemanuk_reservoir_stream *rs)
+{
+	struct sosemanuk_reservoir *res = rs->res;
+
+	pthread_mutex_lock(&res->lock);
+
+	if(!rs->queued) {
+		rs->next = NULL;
+		if(res->tail)
+			res->tail->next = rs;
+		else
+			res->head = rs;
+		res->tail = rs;
+		__atomic_store_n(&rs->queued, 1, __ATOMIC_RELAXED);
+		pthread_cond_signal(&res->work);
+	}
+
+	pthread_mutex_unlock(&res->lock);
+}
+
+static void *
+reservoir_worker(void *arg)
+{
+	struct sosemanuk_reservoir *res = arg;
+	struct sosemanuk_reservoir_stream *rs;
+	size_t n;
+
+	pthread_mutex_lock(&res->lock);
+
+	for(;;) {
+		while(!res->head && !res->stop)
+			pthread_cond_wait(&res->work, &res->lock);
+
+		if(res->stop)
+			break;
+
+		rs = res->head;
+		res->head = rs->next;
+		if(!res->head)
+			res->tail = NULL;
+		__atomic_store_n(&rs->queued, 0, __ATOMIC_RELAXED);
+		res->current = rs;
+
+		pthread_mutex_unlock(&res->lock);
+
+		// The lock is released between chunks, a dry consumer never waits long
+		do {
+			pthread_mutex_lock(&rs->lock);
+			n = reservoir_fill(rs, RESERVOIR_CHUNK);
+			pthread_mutex_unlock(&rs->lock);
+		} while(n == RESERVOIR_CHUNK);
+
+		pthread_mutex_lock(&res->lock);
+		res->current = NULL;
+		pthread_cond_broadcast(&res->done);
+	}
+
+	pthread_mutex_unlock(&res->lock);
+
+	return NULL;
+}
+
+struct sosemanuk_reservoir *
+sosemanuk_reservoir_create(size_t stream_bytes, size_t budget)
+{
+	struct sosemanuk_reservoir *res;
+
+	stream_bytes = (stream_bytes + 79) / 80 * 80;
+	if(stream_bytes == 0 || stream_bytes > budget)
+		return NULL;
+
+	res = calloc(1, sizeof(*res));
+	if(!res)
+		return NULL;
+
+	res->stream_bytes = stream_bytes;
+	res->budget = budget;
+
+	pthread_mutex_init(&res->lock, NULL);
+	pthread_cond_init(&res->work, NULL);
+	pthread_cond_init(&res->done, NULL);
+
+	if(pthread_create(&res->worker, NULL, reservoir_worker, res)) {
+		pthread_mutex_destroy(&res->lock);
+		pthread_cond_destroy(&res->work);
+		pthread_cond_destroy(&res->done);
+		free(res);
+		return NULL;
+	}
+
+	return res;
+}
+
+void
+sosemanuk_reservoir_destroy(struct sosemanuk_reservoir *res)
+{
+	pthread_mutex_lock(&res->lock);
+	res->stop = 1;
+	pthread_cond_signal(&res->work);
+	pthread_mutex_unlock(&res->lock);
+
+	pthread_join(res->worker, NULL);
+
+	pthread_mutex_destroy(&res->lock);
+	pthread_cond_destroy(&res->work);
+	pthread_cond_destroy(&res->done);
+	free(res);
+}
+
+struct sosemanuk_reservoir_stream *
+sosemanuk_reservoir_attach(struct sosemanuk_reservoir *res, const struct sosemanuk_state *st)
+{
+	struct sosemanuk_reservoir_stream *rs;
+
+	pthread_mutex_lock(&res->lock);
+	if(res->used + res->stream_bytes > res->budget) {
+		pthread_mutex_unlock(&res->lock);
+		return NULL;
+	}
+	res->used += res->stream_bytes;
+	pthread_mutex_unlock(&res->lock);
+
+	if(posix_memalign((void **)&rs, 64, sizeof(*rs)))
+		goto fail;
+
+	memset(rs, 0, sizeof(*rs));
+	if(posix_memalign((void **)&rs->ks, 64, res->stream_bytes)) {
+		free(rs);
+		goto fail;
+	}
+
+	rs->st = *st;
+	rs->res = res;
+	rs->size = res->stream_bytes;
+	pthread_mutex_init(&rs->lock, NULL);
+
+	reservoir_queue(rs);
+
+	return rs;
+
+fail:
+	pthread_mutex_lock(&res->lock);
+	res->used -= res->stream_bytes;
+	pthread_mutex_unlock(&res->lock);
+	return NULL;
+}
+
+void
+sosemanuk_reservoir_detach(struct sosemanuk_reservoir_stream *rs)
+{
+	struct sosemanuk_reservoir *res = rs->res;
+	struct sosemanuk_reservoir_stream **p, *prev = NULL;
+
+	pthread_mutex_lock(&res->lock);
+
+	if(rs->queued) {
+		for(p = &res->head; *p != rs; p = &(*p)->next)
+			prev = *p;
+		*p = rs->next;
+		if(res->tail == rs)
+			res->tail = prev;
+	}
+
+	while(res->current == rs)
+		pthread_cond_wait(&res->done, &res->lock);
+
+	res->used -= rs->size;
+
+	pthread_mutex_unlock(&res->lock);
+
+	sosemanuk_wipe(rs->ks, rs->size);
+	sosemanuk_wipe(&rs->st, sizeof(rs->st));
+	pthread_mutex_destroy(&rs->lock);
+	free(rs->ks);
+	free(rs);
+}
+
+void
+sosemanuk_reservoir_crypt(struct sosemanuk_reservoir_stream *rs, const uint8_t *buf, size_t buflen, uint8_t *out)
+{
+	uint64_t produced, consumed = rs->consumed;
+	size_t n, offset;
+
+	while(buflen > 0) {
+		produced = __atomic_load_n(&rs->produced, __ATOMIC_ACQUIRE);
+
+		// Ring dry: generate what this call needs on the caller's time
+		if(produced == consumed) {
+			pthread_mutex_lock(&rs->lock);
+			reservoir_fill(rs, (buflen + 79) / 80);
+			pthread_mutex_unlock(&rs->lock);
+			continue;
+		}
+
+		offset = consumed % rs->size;
+		n = produced - consumed;
+		if(n > rs->size - offset)
+			n = rs->size - offset;
+		if(n > buflen)
+			n = buflen;
+
+		sosemanuk_impl->xor_bytes(out, buf, rs->ks + offset, n);
+		// Used keystream would otherwise sit in the ring until refilled; wipe it before the worker may reuse the slot
+		sosemanuk_wipe(rs->ks + offset, n);
+
+		consumed += n;
+		__atomic_store_n(&rs->consumed, consumed, __ATOMIC_RELEASE);
+
+		buflen -= n;
+		buf += n;
+		out += n;
+	}
+
+	// Low-water mark: half of the ring
+	produced = __atomic_load_n(&rs->produced, __ATOMIC_ACQUIRE);
+	if(produced - consumed < rs->size / 2 && !__atomic_load_n(&rs->queued, __ATOMIC_RELAXED))
+		reservoir_queue(rs);
+}
+
+size_t
+sosemanuk_reservoir_available(const struct sosemanuk_reservoir_stream *rs)
+{
+	return __atomic_load_n(&rs->produced, __ATOMIC_ACQUIRE) - __atomic_load_n(&rs->consumed, __ATOMIC_ACQUIRE);
+}
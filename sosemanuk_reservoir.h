@@ -0,0 +1,51 @@
+/*
+ * Keystream reservoir: a background worker generates the keystream of every
+ * attached stream ahead of time, so sosemanuk_reservoir_crypt is only an XOR.
+ * Each stream owns a ring of keystream; when fewer than half of it is left the
+ * stream is queued for a refill. The total size of the rings is bounded by the
+ * memory budget given at creation. If the ring runs dry, the missing keystream
+ * is generated by the caller and the output stays the same.
+*/
+
+#ifndef SOSEMANUK_RESERVOIR_H
+#define SOSEMANUK_RESERVOIR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sosemanuk.h"
+
+struct sosemanuk_reservoir;
+struct sosemanuk_reservoir_stream;
+
+/*
+ * Start the worker
+ * stream_bytes - keystream kept ahead for each stream (rounded up to 80-byte blocks)
+ * budget - maximum bytes of keystream held for all the streams
+ * Return value: pointer on the reservoir, NULL (if bad sizes or no resources)
+*/
+struct sosemanuk_reservoir *sosemanuk_reservoir_create(size_t stream_bytes, size_t budget);
+
+// Stop the worker and free the reservoir. All streams must be detached first
+void sosemanuk_reservoir_destroy(struct sosemanuk_reservoir *res);
+
+/*
+ * Attach a stream: the running state is copied (st is not used afterwards)
+ * and the first refill is queued
+ * Return value: pointer on the stream, NULL (if the budget is spent or no memory)
+*/
+struct sosemanuk_reservoir_stream *sosemanuk_reservoir_attach(struct sosemanuk_reservoir *res, const struct sosemanuk_state *st);
+
+// Wipe the keystream and the state of a stream and give its memory back to the budget
+void sosemanuk_reservoir_detach(struct sosemanuk_reservoir_stream *rs);
+
+/*
+ * Encrypt the next buflen bytes of the stream, same result as
+ * sosemanuk_stream_crypt from the attached state. One thread per stream
+*/
+void sosemanuk_reservoir_crypt(struct sosemanuk_reservoir_stream *rs, const uint8_t *buf, size_t buflen, uint8_t *out);
+
+// Bytes of keystream ready in the ring of a stream
+size_t sosemanuk_reservoir_available(const struct sosemanuk_reservoir_stream *rs);
+
+#endif
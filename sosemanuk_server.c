@@ -0,0 +1,754 @@
+/*
+ * Local encryption server (see sosemanuk_server.h).
+ *
+ * The connections sit in the epoll set with EPOLLONESHOT: when one becomes
+ * readable the event loop queues it and it is not reported again until the
+ * worker that serves its request re-arms it. So a connection is owned by at
+ * most one worker and its requests are answered in order, while the other
+ * connections are served in parallel. Accepted sockets are non-blocking: a
+ * worker reads a whole request, then writes the whole reply, waiting in poll()
+ * for at most what is left of one deadline per request. A client that trickles
+ * its bytes in cannot hold a worker longer than that.
+ * Session contexts come from a sosemanuk_pool and are wiped on release.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "sosemanuk.h"
+#include "sosemanuk_internal.h"
+#include "sosemanuk_pool.h"
+#include "sosemanuk_server.h"
+
+// A request and its reply must be through within this time (ms), or the connection is closed
+#define SERVER_IO_TIMEOUT	5000
+#define SERVER_EVENTS		64
+#define SERVER_BACKLOG		128
+
+struct server_key {
+	char id[SOSEMANUK_KEY_ID_MAX];
+	struct sosemanuk_key key;
+	struct server_key *next;
+};
+
+/*
+ * One client connection
+ * session - nsession slots, NULL for a free slot
+ * shm, shm_size - shared buffer attached by the client
+ * prev, next - list of all the connections
+ * queued - next connection in the queue of the workers
+*/
+struct server_conn {
+	int fd;
+	struct sosemanuk_context **session;
+	uint32_t nsession;
+	uint8_t *shm;
+	size_t shm_size;
+	struct server_conn *prev;
+	struct server_conn *next;
+	struct server_conn *queued;
+};
+
+struct server_worker {
+	struct sosemanuk_server *srv;
+	pthread_t thread;
+	uint8_t *buf;
+};
+
+struct sosemanuk_server {
+	int listen_fd;
+	int epoll_fd;
+	int stop_fd;
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	struct server_key *keys;
+	struct sosemanuk_pool *pool;
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	struct server_conn *head;
+	struct server_conn *tail;
+	struct server_conn *conns;
+	int stop;
+	int threads;
+	struct server_worker *worker;
+};
+
+static int64_t
+server_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Wait until the socket is ready for events or the deadline (ms, CLOCK_MONOTONIC) has passed
+// Return value: 0 (ready), -1 (timeout or error)
+static int
+server_wait(int sock, short events, int64_t deadline)
+{
+	struct pollfd pfd;
+	int64_t left;
+	int n;
+
+	pfd.fd = sock;
+	pfd.events = events;
+
+	for(;;) {
+		left = deadline - server_now();
+		if(left <= 0)
+			return -1;
+		n = poll(&pfd, 1, (int)left);
+		if(n < 0 && errno == EINTR)
+			continue;
+		return (n > 0) ? 0 : -1;
+	}
+}
+
+// Receive exactly len bytes. A descriptor passed with them is stored in *fd (extra ones are closed)
+// Return value: 0 (if all is well), -1 (connection closed, deadline passed or error)
+static int
+server_recv(int sock, void *p, size_t len, int *fd, int64_t deadline)
+{
+	union {
+		struct cmsghdr h;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} cm;
+	struct cmsghdr *c;
+	struct msghdr mh;
+	struct iovec iov;
+	ssize_t n;
+	int *fds;
+	size_t i, nfds;
+
+	while(len > 0) {
+		iov.iov_base = p;
+		iov.iov_len = len;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = cm.buf;
+		mh.msg_controllen = sizeof(cm.buf);
+
+		n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if(server_wait(sock, POLLIN, deadline) < 0)
+				return -1;
+			continue;
+		}
+		if(n <= 0)
+			return -1;
+
+		for(c = CMSG_FIRSTHDR(&mh); c; c = CMSG_NXTHDR(&mh, c)) {
+			if(c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+				continue;
+			fds = (int *)CMSG_DATA(c);
+			nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for(i = 0; i < nfds; i++) {
+				if(fd && *fd < 0)
+					*fd = fds[i];
+				else
+					close(fds[i]);
+			}
+		}
+
+		p = (uint8_t *)p + n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+// Send a reply and its payload
+// Return value: 0 (if all is well), -1 (connection closed, deadline passed or error)
+static int
+server_send(int sock, const struct sosemanuk_reply *reply, const uint8_t *payload, int64_t deadline)
+{
+	struct iovec iov[2];
+	struct msghdr mh;
+	ssize_t n;
+	int i = 0;
+
+	iov[0].iov_base = (void *)reply;
+	iov[0].iov_len = sizeof(*reply);
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = reply->len;
+
+	while(i < 2) {
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov + i;
+		mh.msg_iovlen = 2 - i;
+
+		n = sendmsg(sock, &mh, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if(server_wait(sock, POLLOUT, deadline) < 0)
+				return -1;
+			continue;
+		}
+		if(n < 0)
+			return -1;
+
+		for(; i < 2 && (size_t)n >= iov[i].iov_len; i++)
+			n -= iov[i].iov_len;
+		if(i < 2) {
+			iov[i].iov_base = (uint8_t *)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+
+	return 0;
+}
+
+static const struct server_key *
+server_find_key(const struct sosemanuk_server *srv, const char *id)
+{
+	const struct server_key *k;
+
+	for(k = srv->keys; k; k = k->next) {
+		if(strcmp(k->id, id) == 0)
+			return k;
+	}
+
+	return NULL;
+}
+
+static struct sosemanuk_context *
+server_session(const struct server_conn *conn, uint32_t session)
+{
+	return (session < conn->nsession) ? conn->session[session] : NULL;
+}
+
+// Return value: session ID, -1 (unknown key, bad IV, too many sessions or no memory)
+static int
+server_open(struct sosemanuk_server *srv, struct server_conn *conn, const struct sosemanuk_msg_open *o)
+{
+	const struct server_key *key;
+	struct sosemanuk_context **grown, *ctx;
+	uint32_t i, n;
+
+	if(!memchr(o->key_id, 0, sizeof(o->key_id)))
+		return -1;
+	key = server_find_key(srv, o->key_id);
+	if(!key)
+		return -1;
+
+	for(i = 0; i < conn->nsession && conn->session[i]; i++)
+		;
+
+	if(i == conn->nsession) {
+		n = conn->nsession ? conn->nsession * 2 : 8;
+		if(n > SOSEMANUK_SESSIONS_MAX)
+			n = SOSEMANUK_SESSIONS_MAX;
+		if(i == n)
+			return -1;
+
+		grown = realloc(conn->session, n * sizeof(*grown));
+		if(!grown)
+			return -1;
+		memset(grown + conn->nsession, 0, (n - conn->nsession) * sizeof(*grown));
+		conn->session = grown;
+		conn->nsession = n;
+	}
+
+	ctx = sosemanuk_pool_acquire(srv->pool);
+	if(!ctx)
+		return -1;
+
+	if(sosemanuk_set_iv(ctx, &key->key, o->iv, (int)o->ivlen) < 0) {
+		sosemanuk_pool_release(srv->pool, ctx);
+		return -1;
+	}
+
+	conn->session[i] = ctx;
+
+	return (int)i;
+}
+
+static int
+server_close_session(struct sosemanuk_server *srv, struct server_conn *conn, uint32_t session)
+{
+	struct sosemanuk_context *ctx = server_session(conn, session);
+
+	if(!ctx)
+		return -1;
+
+	sosemanuk_pool_release(srv->pool, ctx);
+	conn->session[session] = NULL;
+
+	return 0;
+}
+
+/*
+ * Map the shared buffer of a connection. The client must seal the memfd
+ * against shrinking: a buffer cut under the mapping would fault the server
+*/
+static int
+server_attach(struct server_conn *conn, int fd)
+{
+	struct stat st;
+	uint8_t *shm;
+	int seals;
+
+	seals = fcntl(fd, F_GET_SEALS);
+	if(seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &st) < 0 || st.st_size <= 0)
+		return -1;
+
+	shm = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(shm == MAP_FAILED)
+		return -1;
+
+	if(conn->shm)
+		munmap(conn->shm, conn->shm_size);
+	conn->shm = shm;
+	conn->shm_size = st.st_size;
+
+	return 0;
+}
+
+/*
+ * Serve one request of a connection
+ * buf - SOSEMANUK_MSG_MAX bytes of scratch for inline payloads
+ * Return value: 0 (if all is well), -1 (the connection must be closed)
+*/
+static int
+server_request(struct sosemanuk_server *srv, struct server_conn *conn, uint8_t *buf)
+{
+	struct sosemanuk_msg msg;
+	struct sosemanuk_msg_open open_msg;
+	struct sosemanuk_msg_shm shm_msg;
+	struct sosemanuk_reply reply;
+	struct sosemanuk_context *ctx;
+	int64_t deadline = server_now() + SERVER_IO_TIMEOUT;
+	int fd = -1, ret = 0;
+
+	if(server_recv(conn->fd, &msg, sizeof(msg), &fd, deadline) < 0) {
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	reply.type = msg.type;
+	reply.status = -1;
+	reply.len = 0;
+
+	switch(msg.type) {
+	case SOSEMANUK_MSG_OPEN:
+		if(msg.len != sizeof(open_msg) || server_recv(conn->fd, &open_msg, sizeof(open_msg), NULL, deadline) < 0) {
+			ret = -1;
+			break;
+		}
+		reply.status = server_open(srv, conn, &open_msg);
+		break;
+
+	case SOSEMANUK_MSG_CLOSE:
+		if(msg.len != 0) {
+			ret = -1;
+			break;
+		}
+		reply.status = server_close_session(srv, conn, msg.session);
+		break;
+
+	case SOSEMANUK_MSG_CRYPT:
+		if(msg.len > SOSEMANUK_MSG_MAX || server_recv(conn->fd, buf, msg.len, NULL, deadline) < 0) {
+			ret = -1;
+			break;
+		}
+		ctx = server_session(conn, msg.session);
+		if(ctx) {
+			sosemanuk_stream_crypt(ctx, buf, msg.len, buf);
+			reply.status = 0;
+			reply.len = msg.len;
+		}
+		break;
+
+	case SOSEMANUK_MSG_SHM_ATTACH:
+		if(msg.len != 0) {
+			ret = -1;
+			break;
+		}
+		if(fd >= 0)
+			reply.status = server_attach(conn, fd);
+		break;
+
+	case SOSEMANUK_MSG_CRYPT_SHM:
+		if(msg.len != sizeof(shm_msg) || server_recv(conn->fd, &shm_msg, sizeof(shm_msg), NULL, deadline) < 0) {
+			ret = -1;
+			break;
+		}
+		ctx = server_session(conn, msg.session);
+		if(ctx && shm_msg.offset <= conn->shm_size && shm_msg.length <= conn->shm_size - shm_msg.offset) {
+			sosemanuk_stream_crypt(ctx, conn->shm + shm_msg.offset, shm_msg.length, conn->shm + shm_msg.offset);
+			reply.status = 0;
+		}
+		break;
+
+	default:
+		ret = -1;
+		break;
+	}
+
+	if(fd >= 0)
+		close(fd);
+
+	if(ret == 0)
+		ret = server_send(conn->fd, &reply, buf, deadline);
+
+	// The payload held plaintext, then ciphertext
+	if(msg.type == SOSEMANUK_MSG_CRYPT && msg.len <= SOSEMANUK_MSG_MAX)
+		sosemanuk_wipe(buf, msg.len);
+
+	return ret;
+}
+
+// Close a connection and release its sessions. The caller owns the connection
+static void
+server_close(struct sosemanuk_server *srv, struct server_conn *conn)
+{
+	uint32_t i;
+
+	epoll_ctl(srv->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+
+	for(i = 0; i < conn->nsession; i++) {
+		if(conn->session[i])
+			sosemanuk_pool_release(srv->pool, conn->session[i]);
+	}
+	free(conn->session);
+
+	if(conn->shm)
+		munmap(conn->shm, conn->shm_size);
+
+	pthread_mutex_lock(&srv->lock);
+	if(conn->prev)
+		conn->prev->next = conn->next;
+	else
+		srv->conns = conn->next;
+	if(conn->next)
+		conn->next->prev = conn->prev;
+	pthread_mutex_unlock(&srv->lock);
+
+	free(conn);
+}
+
+static void *
+server_worker(void *arg)
+{
+	struct server_worker *w = arg;
+	struct sosemanuk_server *srv = w->srv;
+	struct server_conn *conn;
+	struct epoll_event ev;
+
+	for(;;) {
+		pthread_mutex_lock(&srv->lock);
+		while(!srv->head && !srv->stop)
+			pthread_cond_wait(&srv->work, &srv->lock);
+		conn = srv->head;
+		if(conn) {
+			srv->head = conn->queued;
+			if(!srv->head)
+				srv->tail = NULL;
+		}
+		pthread_mutex_unlock(&srv->lock);
+
+		if(!conn)
+			break;
+
+		if(server_request(srv, conn, w->buf) < 0) {
+			server_close(srv, conn);
+			continue;
+		}
+
+		// Requests already buffered make the connection readable again at once
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = conn;
+		if(epoll_ctl(srv->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0)
+			server_close(srv, conn);
+	}
+
+	return NULL;
+}
+
+static void
+server_accept(struct sosemanuk_server *srv)
+{
+	struct server_conn *conn;
+	struct epoll_event ev;
+	int fd;
+
+	for(;;) {
+		fd = accept4(srv->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+		if(fd < 0) {
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+
+		conn = calloc(1, sizeof(*conn));
+		if(!conn) {
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+
+		pthread_mutex_lock(&srv->lock);
+		conn->next = srv->conns;
+		if(srv->conns)
+			srv->conns->prev = conn;
+		srv->conns = conn;
+		pthread_mutex_unlock(&srv->lock);
+
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = conn;
+		if(epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+			server_close(srv, conn);
+	}
+}
+
+// Bind the socket: a live server on the path is an error, a stale socket is removed
+static int
+server_listen(struct sosemanuk_server *srv, const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	if(strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(fd < 0)
+			return -1;
+		if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 || errno != ECONNREFUSED) {
+			close(fd);
+			return -1;
+		}
+		close(fd);
+		unlink(path);
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+		return -1;
+
+	// No client can connect before listen: the mode is set in between
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	if(chmod(path, 0600) < 0 || listen(fd, SERVER_BACKLOG) < 0) {
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	strcpy(srv->path, path);
+	srv->listen_fd = fd;
+
+	return 0;
+}
+
+struct sosemanuk_server *
+sosemanuk_server_create(const char *path, int threads)
+{
+	struct sosemanuk_server *srv;
+	struct epoll_event ev;
+	int i;
+
+	if(threads <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cpus > 0) ? (int)cpus : 1;
+	}
+
+	srv = calloc(1, sizeof(*srv));
+	if(!srv)
+		return NULL;
+
+	srv->listen_fd = -1;
+	srv->epoll_fd = -1;
+	srv->stop_fd = -1;
+	pthread_mutex_init(&srv->lock, NULL);
+	pthread_cond_init(&srv->work, NULL);
+
+	srv->worker = calloc(threads, sizeof(*srv->worker));
+	srv->pool = sosemanuk_pool_create(256);
+	srv->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	srv->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(!srv->worker || !srv->pool || srv->epoll_fd < 0 || srv->stop_fd < 0 || server_listen(srv, path) < 0) {
+		sosemanuk_server_destroy(srv);
+		return NULL;
+	}
+
+	// The listening socket is marked by the server pointer, the stop event by &stop_fd
+	ev.events = EPOLLIN;
+	ev.data.ptr = srv;
+	if(epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->listen_fd, &ev) < 0) {
+		sosemanuk_server_destroy(srv);
+		return NULL;
+	}
+	ev.data.ptr = &srv->stop_fd;
+	if(epoll_ctl(srv->epoll_fd, EPOLL_CTL_ADD, srv->stop_fd, &ev) < 0) {
+		sosemanuk_server_destroy(srv);
+		return NULL;
+	}
+
+	for(i = 0; i < threads; i++) {
+		srv->worker[i].srv = srv;
+		srv->worker[i].buf = malloc(SOSEMANUK_MSG_MAX);
+		if(!srv->worker[i].buf || pthread_create(&srv->worker[i].thread, NULL, server_worker, &srv->worker[i])) {
+			free(srv->worker[i].buf);
+			srv->worker[i].buf = NULL;
+			sosemanuk_server_destroy(srv);
+			return NULL;
+		}
+		srv->threads = i + 1;
+	}
+
+	return srv;
+}
+
+int
+sosemanuk_server_add_key(struct sosemanuk_server *srv, const char *id, const uint8_t *key, int keylen)
+{
+	struct server_key *k;
+
+	if(!id[0] || strlen(id) >= SOSEMANUK_KEY_ID_MAX || server_find_key(srv, id))
+		return -1;
+
+	k = calloc(1, sizeof(*k));
+	if(!k)
+		return -1;
+
+	if(sosemanuk_set_key(&k->key, key, keylen) < 0) {
+		free(k);
+		return -1;
+	}
+	strcpy(k->id, id);
+
+	k->next = srv->keys;
+	srv->keys = k;
+
+	return 0;
+}
+
+int
+sosemanuk_server_run(struct sosemanuk_server *srv)
+{
+	struct epoll_event ev[SERVER_EVENTS];
+	struct server_conn *conn;
+	uint64_t count;
+	int i, n;
+
+	for(;;) {
+		n = epoll_wait(srv->epoll_fd, ev, SERVER_EVENTS, -1);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		for(i = 0; i < n; i++) {
+			if(ev[i].data.ptr == srv) {
+				server_accept(srv);
+			} else if(ev[i].data.ptr == &srv->stop_fd) {
+				if(read(srv->stop_fd, &count, sizeof(count)) < 0) {
+					// Nothing to do: the event is level-triggered and the server stops anyway
+				}
+				return 0;
+			} else {
+				conn = ev[i].data.ptr;
+
+				pthread_mutex_lock(&srv->lock);
+				conn->queued = NULL;
+				if(srv->tail)
+					srv->tail->queued = conn;
+				else
+					srv->head = conn;
+				srv->tail = conn;
+				pthread_cond_signal(&srv->work);
+				pthread_mutex_unlock(&srv->lock);
+			}
+		}
+	}
+}
+
+void
+sosemanuk_server_stop(struct sosemanuk_server *srv)
+{
+	uint64_t one = 1;
+
+	if(write(srv->stop_fd, &one, sizeof(one)) < 0) {
+		// The counter is already set: a stop is pending
+	}
+}
+
+void
+sosemanuk_server_destroy(struct sosemanuk_server *srv)
+{
+	struct server_key *k;
+	int i;
+
+	// The workers finish the queued requests
+	pthread_mutex_lock(&srv->lock);
+	srv->stop = 1;
+	pthread_cond_broadcast(&srv->work);
+	pthread_mutex_unlock(&srv->lock);
+
+	for(i = 0; i < srv->threads; i++)
+		pthread_join(srv->worker[i].thread, NULL);
+
+	for(i = 0; i < srv->threads; i++) {
+		sosemanuk_wipe(srv->worker[i].buf, SOSEMANUK_MSG_MAX);
+		free(srv->worker[i].buf);
+	}
+	free(srv->worker);
+
+	while(srv->conns)
+		server_close(srv, srv->conns);
+
+	if(srv->listen_fd >= 0) {
+		close(srv->listen_fd);
+		unlink(srv->path);
+	}
+	if(srv->epoll_fd >= 0)
+		close(srv->epoll_fd);
+	if(srv->stop_fd >= 0)
+		close(srv->stop_fd);
+
+	while(srv->keys) {
+		k = srv->keys;
+		srv->keys = k->next;
+		sosemanuk_wipe(k, sizeof(*k));
+		free(k);
+	}
+
+	if(srv->pool)
+		sosemanuk_pool_destroy(srv->pool);
+
+	pthread_mutex_destroy(&srv->lock);
+	pthread_cond_destroy(&srv->work);
+	free(srv);
+}
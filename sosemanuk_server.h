@@ -0,0 +1,98 @@
+/*
+ * Local encryption server over a Unix domain socket.
+ * The server holds prepared keys (sosemanuk_set_key, run once at load) under
+ * a key ID. A client opens sessions by key ID and IV - only the IV injection
+ * is computed - and streams data through them: every session is a running
+ * stream, the fragments may have any size. Small payloads travel inline in
+ * the messages; large ones are encrypted in place in a shared memory buffer
+ * (memfd) the client attaches once per connection.
+ * One thread runs the epoll loop and hands the connections with a pending
+ * request to a pool of workers; the requests of one connection are served
+ * in order.
+ *
+ * Protocol (host byte order, the peers run on the same machine): every
+ * request is a struct sosemanuk_msg followed by len bytes, every reply a
+ * struct sosemanuk_reply followed by len bytes.
+ *   OPEN        payload struct sosemanuk_msg_open, reply status: session ID
+ *   CLOSE       session - session to close
+ *   CRYPT       session, payload: data (at most SOSEMANUK_MSG_MAX bytes),
+ *               reply payload: the data encrypted
+ *   SHM_ATTACH  no payload, one descriptor (SCM_RIGHTS) of the shared buffer
+ *   CRYPT_SHM   session, payload struct sosemanuk_msg_shm: the range of the
+ *               shared buffer is encrypted in place
+ * status is -1 on error (unknown key or session, bad message), the connection
+ * stays open. A malformed header closes the connection.
+*/
+
+#ifndef SOSEMANUK_SERVER_H
+#define SOSEMANUK_SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sosemanuk.h"
+
+#define SOSEMANUK_KEY_ID_MAX	64
+#define SOSEMANUK_MSG_MAX	(1 << 20)
+#define SOSEMANUK_SESSIONS_MAX	4096
+
+enum sosemanuk_msg_type {
+	SOSEMANUK_MSG_OPEN = 1,
+	SOSEMANUK_MSG_CLOSE,
+	SOSEMANUK_MSG_CRYPT,
+	SOSEMANUK_MSG_SHM_ATTACH,
+	SOSEMANUK_MSG_CRYPT_SHM
+};
+
+struct sosemanuk_msg {
+	uint32_t type;
+	uint32_t session;
+	uint64_t len;
+};
+
+struct sosemanuk_reply {
+	uint32_t type;
+	int32_t status;
+	uint64_t len;
+};
+
+// key_id is padded with zero bytes
+struct sosemanuk_msg_open {
+	char key_id[SOSEMANUK_KEY_ID_MAX];
+	uint8_t iv[16];
+	uint32_t ivlen;
+	uint32_t reserved;
+};
+
+struct sosemanuk_msg_shm {
+	uint64_t offset;
+	uint64_t length;
+};
+
+struct sosemanuk_server;
+
+/*
+ * Listen on the socket "path" (created with mode 0600, a stale socket is
+ * replaced) and start "threads" workers (0: one per online CPU)
+ * Return value: pointer on the server, NULL (if the socket cannot be created or no resources)
+*/
+struct sosemanuk_server *sosemanuk_server_create(const char *path, int threads);
+
+/*
+ * Prepare a key and store it under "id" (at most SOSEMANUK_KEY_ID_MAX - 1 characters).
+ * Keys are added before sosemanuk_server_run
+ * Return value: 0 (if all is well), -1 (bad id or key, id already used, no memory)
+*/
+int sosemanuk_server_add_key(struct sosemanuk_server *srv, const char *id, const uint8_t *key, int keylen);
+
+// Serve the clients until sosemanuk_server_stop
+// Return value: 0 (stopped), -1 (epoll error)
+int sosemanuk_server_run(struct sosemanuk_server *srv);
+
+// Make sosemanuk_server_run return. Async-signal-safe
+void sosemanuk_server_stop(struct sosemanuk_server *srv);
+
+// Stop the workers, close the connections, wipe the keys and the sessions, remove the socket
+void sosemanuk_server_destroy(struct sosemanuk_server *srv);
+
+#endif
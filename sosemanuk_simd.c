@@ -0,0 +1,782 @@
+/*
+ * Multi-lane Sosemanuk keystream generation.
+ * Each lane is an independent stream (own key, IV and running state). The round
+ * macros of sosemanuk_internal.h are expanded on GCC vector types, so the LFSR
+ * update, the FSM and the Serpent S2 output layer run on all lanes at once:
+ *   x4 - SSE2, 4 lanes in 128-bit registers
+ *   x8 - AVX2, 8 lanes in 256-bit registers (gathers for the alpha tables)
+ *   x16 - AVX-512, 16 lanes in 512-bit registers; S2 is built from ternary-logic
+ *         operations, the FSM rotation is a native rotate, and the block is
+ *         transposed in registers so every lane gets its 80 bytes contiguous
+ * Built with SOSEMANUK_NO_TABLES, the alpha multiplications are pure lane
+ * arithmetic and no kernel reads a table.
+ * The IV setup of many streams under one key is batched the same way: the
+ * Serpent24 rounds run on 4, 8 or 16 IVs per register.
+ * Other targets fall back to the scalar code lane by lane.
+ *
+ * The kernels are compiled with per-function target attributes and bound at
+ * startup to the best set the CPU supports (sosemanuk_impl), so one binary
+ * runs on any x86-64 host.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sosemanuk.h"
+#include "sosemanuk_internal.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SOSEMANUK_X86
+#include <immintrin.h>
+#endif
+
+// Copy the running state of "lanes" contexts into the lane-transposed layout and back
+#define LANES_LOAD(xctx, ctx, lanes) {			\
+	int i, n;					\
+	for(n = 0; n < lanes; n++) {			\
+		for(i = 0; i < 10; i++)			\
+			xctx->s[i][n] = ctx[n]->s[i];	\
+		xctx->r1[n] = ctx[n]->r1;		\
+		xctx->r2[n] = ctx[n]->r2;		\
+	}						\
+}
+
+#define LANES_STORE(xctx, ctx, lanes) {			\
+	int i, n;					\
+	for(n = 0; n < lanes; n++) {			\
+		for(i = 0; i < 10; i++)			\
+			ctx[n]->s[i] = xctx->s[i][n];	\
+		ctx[n]->r1 = xctx->r1[n];		\
+		ctx[n]->r2 = xctx->r2[n];		\
+	}						\
+}
+
+void
+sosemanuk_load_x4(struct sosemanuk_context_x4 *xctx, struct sosemanuk_context *const ctx[4])
+{
+	LANES_LOAD(xctx, ctx, 4);
+}
+
+void
+sosemanuk_store_x4(const struct sosemanuk_context_x4 *xctx, struct sosemanuk_context *const ctx[4])
+{
+	LANES_STORE(xctx, ctx, 4);
+}
+
+void
+sosemanuk_load_x8(struct sosemanuk_context_x8 *xctx, struct sosemanuk_context *const ctx[8])
+{
+	LANES_LOAD(xctx, ctx, 8);
+}
+
+void
+sosemanuk_store_x8(const struct sosemanuk_context_x8 *xctx, struct sosemanuk_context *const ctx[8])
+{
+	LANES_STORE(xctx, ctx, 8);
+}
+
+void
+sosemanuk_load_x16(struct sosemanuk_context_x16 *xctx, struct sosemanuk_context *const ctx[16])
+{
+	LANES_LOAD(xctx, ctx, 16);
+}
+
+void
+sosemanuk_store_x16(const struct sosemanuk_context_x16 *xctx, struct sosemanuk_context *const ctx[16])
+{
+	LANES_STORE(xctx, ctx, 16);
+}
+
+/*
+ * Portable path: run the scalar generator on every lane. The public x4/x8/x16
+ * calls count the blocks, so the uncounted generator is used
+ * s - lane-transposed s[10][lanes], followed by r1[lanes] and r2[lanes]
+ * word i of lane n is written to keystream[i * wstep + n * lstep]
+*/
+static void
+keystream_lanes_ref(uint32_t *s, uint32_t *r1, uint32_t *r2, int lanes, uint32_t *keystream, int wstep, int lstep)
+{
+	struct sosemanuk_context ctx;
+	uint32_t block[20];
+	int i, n;
+
+	for(n = 0; n < lanes; n++) {
+		for(i = 0; i < 10; i++)
+			ctx.s[i] = s[i * lanes + n];
+		ctx.r1 = r1[n];
+		ctx.r2 = r2[n];
+
+		sosemanuk_generate_keystream_ref(&ctx, block);
+
+		for(i = 0; i < 10; i++)
+			s[i * lanes + n] = ctx.s[i];
+		r1[n] = ctx.r1;
+		r2[n] = ctx.r2;
+
+		for(i = 0; i < 20; i++)
+			keystream[i * wstep + n * lstep] = block[i];
+	}
+}
+
+#ifdef SOSEMANUK_X86
+
+// One word per lane. Unaligned and may_alias so the vectors can be loaded from plain uint32_t arrays
+typedef uint32_t v4u32 __attribute__((vector_size(16), aligned(4), may_alias));
+typedef uint32_t v8u32 __attribute__((vector_size(32), aligned(4), may_alias));
+typedef uint32_t v16u32 __attribute__((vector_size(64), aligned(4), may_alias));
+
+/*
+ * One keystream block on all lanes
+ * V - vector type, xctx - lane-transposed state, out - lane-interleaved keystream
+*/
+#define KEYSTREAM_LANES(V, xctx, out) {					\
+	V r1, r2, u0, u1, u2, u3, u4, v0, v1, v2, v3;			\
+	V s0, s1, s2, s3, s4, s5, s6, s7, s8, s9;			\
+	V tt, or1;							\
+	V *keystream = (V *)(out);					\
+									\
+	s0 = *(V *)xctx->s[0];						\
+	s1 = *(V *)xctx->s[1];						\
+	s2 = *(V *)xctx->s[2];						\
+	s3 = *(V *)xctx->s[3];						\
+	s4 = *(V *)xctx->s[4];						\
+	s5 = *(V *)xctx->s[5];						\
+	s6 = *(V *)xctx->s[6];						\
+	s7 = *(V *)xctx->s[7];						\
+	s8 = *(V *)xctx->s[8];						\
+	s9 = *(V *)xctx->s[9];						\
+	r1 = *(V *)xctx->r1;						\
+	r2 = *(V *)xctx->r2;						\
+									\
+	SOSEMANUK_BLOCK;						\
+									\
+	*(V *)xctx->s[0] = s0;						\
+	*(V *)xctx->s[1] = s1;						\
+	*(V *)xctx->s[2] = s2;						\
+	*(V *)xctx->s[3] = s3;						\
+	*(V *)xctx->s[4] = s4;						\
+	*(V *)xctx->s[5] = s5;						\
+	*(V *)xctx->s[6] = s6;						\
+	*(V *)xctx->s[7] = s7;						\
+	*(V *)xctx->s[8] = s8;						\
+	*(V *)xctx->s[9] = s9;						\
+	*(V *)xctx->r1 = r1;						\
+	*(V *)xctx->r2 = r2;						\
+}
+
+// Branch-free multiplexer: lanes with the low bit of c set take "x xor y"
+#define XMUX(c, x, y)	((x) ^ ((y) & -((c) & 0x1)))
+
+// SSE2 has no gather: table words are fetched lane by lane
+static inline v4u32
+lookup_x4(const uint32_t *table, v4u32 idx)
+{
+	return (v4u32){ table[idx[0]], table[idx[1]], table[idx[2]], table[idx[3]] };
+}
+
+#define MUL_A(x)	MUL_ALPHA(x, lookup_x4)
+#define MUL_G(x)	DIV_ALPHA(x, lookup_x4)
+
+static void
+keystream_x4_sse2(struct sosemanuk_context_x4 *xctx, uint32_t *out)
+{
+	KEYSTREAM_LANES(v4u32, xctx, out);
+}
+
+#undef MUL_A
+#undef MUL_G
+
+// 8 lanes without AVX2: GCC splits every v8u32 operation into two SSE2 halves
+#define LOOKUP_X8(table, idx)							\
+	(v8u32){ table[(idx)[0]], table[(idx)[1]], table[(idx)[2]], table[(idx)[3]],	\
+		 table[(idx)[4]], table[(idx)[5]], table[(idx)[6]], table[(idx)[7]] }
+
+#define MUL_A(x)	MUL_ALPHA(x, LOOKUP_X8)
+#define MUL_G(x)	DIV_ALPHA(x, LOOKUP_X8)
+
+static void
+keystream_x8_sse2(struct sosemanuk_context_x8 *xctx, uint32_t *out)
+{
+	KEYSTREAM_LANES(v8u32, xctx, out);
+}
+
+#undef MUL_A
+#undef MUL_G
+
+#define GATHER_X8(table, idx)	\
+	((v8u32)_mm256_i32gather_epi32((const int *)(table), (__m256i)(idx), 4))
+
+#define MUL_A(x)	MUL_ALPHA(x, GATHER_X8)
+#define MUL_G(x)	DIV_ALPHA(x, GATHER_X8)
+
+__attribute__((target("avx2")))
+static void
+keystream_x8_avx2(struct sosemanuk_context_x8 *xctx, uint32_t *out)
+{
+	KEYSTREAM_LANES(v8u32, xctx, out);
+}
+
+#undef MUL_A
+#undef MUL_G
+
+/*
+ * 16 lanes as two halves on an x8 kernel; the lane-interleaved halves are
+ * copied out one lane after the other
+*/
+static inline __attribute__((always_inline)) void
+keystream_x16_halves(struct sosemanuk_context_x16 *xctx, uint32_t *out,
+	void (*x8)(struct sosemanuk_context_x8 *, uint32_t *))
+{
+	struct sosemanuk_context_x8 half;
+	uint32_t keystream[20 * 8];
+	int h, i, n;
+
+	for(h = 0; h < 16; h += 8) {
+		for(i = 0; i < 10; i++)
+			memcpy(half.s[i], &xctx->s[i][h], sizeof(half.s[i]));
+		memcpy(half.r1, &xctx->r1[h], sizeof(half.r1));
+		memcpy(half.r2, &xctx->r2[h], sizeof(half.r2));
+
+		x8(&half, keystream);
+
+		for(i = 0; i < 10; i++)
+			memcpy(&xctx->s[i][h], half.s[i], sizeof(half.s[i]));
+		memcpy(&xctx->r1[h], half.r1, sizeof(half.r1));
+		memcpy(&xctx->r2[h], half.r2, sizeof(half.r2));
+
+		for(n = 0; n < 8; n++)
+			for(i = 0; i < 20; i++)
+				out[(h + n) * 20 + i] = keystream[i * 8 + n];
+	}
+}
+
+static void
+keystream_x16_sse2(struct sosemanuk_context_x16 *xctx, uint32_t *out)
+{
+	keystream_x16_halves(xctx, out, keystream_x8_sse2);
+}
+
+static void
+keystream_x16_avx2(struct sosemanuk_context_x16 *xctx, uint32_t *out)
+{
+	keystream_x16_halves(xctx, out, keystream_x8_avx2);
+}
+
+/*
+ * AVX-512: the generic round macros with two substitutions. vpternlogd
+ * evaluates any 3-input boolean function, so S2 takes 10 of them instead of
+ * 18 and/or/xor/not; the FSM rotation is vprold. The truth tables are built
+ * from A = 0xF0, B = 0xCC, C = 0xAA (first, second, third operand). The
+ * outputs go to the registers SRD reads (2, 3, 1, 4), r0 is left unused
+*/
+#define TERN(a, b, c, f)	\
+	((v16u32)_mm512_ternarylogic_epi32((__m512i)(a), (__m512i)(b), (__m512i)(c), (f) & 0xFF))
+
+#define TA	0xF0
+#define TB	0xCC
+#define TC	0xAA
+
+// a ? b : c
+#define TMUX	(TC ^ (TA & (TB ^ TC)))
+
+#pragma push_macro("S2")
+#pragma push_macro("ROTL32")
+#undef S2
+#undef ROTL32
+
+#define S2(r0, r1, r2, r3, r4) {							\
+	v16u32 o1, o2, o3;								\
+											\
+	o1 = TERN(r3, TERN(r2, r1, r0, ~TA ^ ((TA ^ TC) & (TB ^ TC))),			\
+		TERN(r2, r1, r0, TC ^ (TB & ~TA)), TMUX);				\
+	o2 = TERN(r2, r1, r0, TB ^ (TA & ~TC)) ^ r3;					\
+	o3 = TERN(r3, TERN(r2, r1, r0, TA ^ (~TC & (TA | TB))),				\
+		TERN(r2, r1, r0, (TA & TB) | (TA ^ TB ^ TC)), TMUX);			\
+	r4 = TERN(TERN(r0, r1, r2, TA ^ ((TA & TB) | (TB ^ TC))), r1, r3, ~TA ^ (TB & TC));	\
+	r1 = o1;									\
+	r2 = o2;									\
+	r3 = o3;									\
+}
+
+#define ROTL32(v, n)	((v16u32)_mm512_rol_epi32((__m512i)(v), n))
+
+#define GATHER_X16(table, idx)	\
+	((v16u32)_mm512_i32gather_epi32((__m512i)(idx), (const void *)(table), 4))
+
+#define MUL_A(x)	MUL_ALPHA(x, GATHER_X16)
+#define MUL_G(x)	DIV_ALPHA(x, GATHER_X16)
+
+// Rows of 4 words of lanes 4q..4q+3 in a 128-bit chunk q, stored at word "off" of each lane
+#define STORE_X4(out, x, j, off) {							\
+	_mm_storeu_si128((__m128i *)((out) + 20 * (j) + (off)), _mm512_extracti32x4_epi32(x, 0));	\
+	_mm_storeu_si128((__m128i *)((out) + 20 * (4 + (j)) + (off)), _mm512_extracti32x4_epi32(x, 1));	\
+	_mm_storeu_si128((__m128i *)((out) + 20 * (8 + (j)) + (off)), _mm512_extracti32x4_epi32(x, 2));	\
+	_mm_storeu_si128((__m128i *)((out) + 20 * (12 + (j)) + (off)), _mm512_extracti32x4_epi32(x, 3));	\
+}
+
+/*
+ * Lane-interleaved block (word i of every lane in ks[i]) to one block per lane.
+ * Words 0..15 are a 16x16 transpose: 32-bit then 64-bit unpacks make 4x4
+ * blocks in every 128-bit chunk, two rounds of 128-bit shuffles put the
+ * chunks of a lane together. Words 16..19 stop after the unpacks
+*/
+__attribute__((target("avx512f")))
+static inline __attribute__((always_inline)) void
+transpose_x16(const v16u32 *ks, uint32_t *out)
+{
+	__m512i t[16], u[16], x, y, xx, yy;
+	int j;
+
+	for(j = 0; j < 16; j += 2) {
+		t[j] = _mm512_unpacklo_epi32((__m512i)ks[j], (__m512i)ks[j + 1]);
+		t[j + 1] = _mm512_unpackhi_epi32((__m512i)ks[j], (__m512i)ks[j + 1]);
+	}
+
+	// u[4k + j], chunk q: words 4k..4k+3 of lane 4q + j
+	for(j = 0; j < 16; j += 4) {
+		u[j] = _mm512_unpacklo_epi64(t[j], t[j + 2]);
+		u[j + 1] = _mm512_unpackhi_epi64(t[j], t[j + 2]);
+		u[j + 2] = _mm512_unpacklo_epi64(t[j + 1], t[j + 3]);
+		u[j + 3] = _mm512_unpackhi_epi64(t[j + 1], t[j + 3]);
+	}
+
+	for(j = 0; j < 4; j++) {
+		x = _mm512_shuffle_i32x4(u[j], u[4 + j], 0x88);
+		y = _mm512_shuffle_i32x4(u[j], u[4 + j], 0xDD);
+		xx = _mm512_shuffle_i32x4(u[8 + j], u[12 + j], 0x88);
+		yy = _mm512_shuffle_i32x4(u[8 + j], u[12 + j], 0xDD);
+
+		_mm512_storeu_si512((void *)(out + 20 * j), _mm512_shuffle_i32x4(x, xx, 0x88));
+		_mm512_storeu_si512((void *)(out + 20 * (4 + j)), _mm512_shuffle_i32x4(y, yy, 0x88));
+		_mm512_storeu_si512((void *)(out + 20 * (8 + j)), _mm512_shuffle_i32x4(x, xx, 0xDD));
+		_mm512_storeu_si512((void *)(out + 20 * (12 + j)), _mm512_shuffle_i32x4(y, yy, 0xDD));
+	}
+
+	t[0] = _mm512_unpacklo_epi32((__m512i)ks[16], (__m512i)ks[17]);
+	t[1] = _mm512_unpackhi_epi32((__m512i)ks[16], (__m512i)ks[17]);
+	t[2] = _mm512_unpacklo_epi32((__m512i)ks[18], (__m512i)ks[19]);
+	t[3] = _mm512_unpackhi_epi32((__m512i)ks[18], (__m512i)ks[19]);
+
+	STORE_X4(out, _mm512_unpacklo_epi64(t[0], t[2]), 0, 16);
+	STORE_X4(out, _mm512_unpackhi_epi64(t[0], t[2]), 1, 16);
+	STORE_X4(out, _mm512_unpacklo_epi64(t[1], t[3]), 2, 16);
+	STORE_X4(out, _mm512_unpackhi_epi64(t[1], t[3]), 3, 16);
+}
+
+__attribute__((target("avx512f")))
+static void
+keystream_x16_avx512(struct sosemanuk_context_x16 *xctx, uint32_t *out)
+{
+	v16u32 ks[20];
+
+	KEYSTREAM_LANES(v16u32, xctx, ks);
+	transpose_x16(ks, out);
+}
+
+#undef MUL_A
+#undef MUL_G
+#undef STORE_X4
+#pragma pop_macro("ROTL32")
+#pragma pop_macro("S2")
+
+// Store one Serpent24 output word of every lane in its context
+#define IVS(f, x) {							\
+	int n;								\
+	for(n = 0; n < (int)(sizeof(x) / sizeof(uint32_t)); n++)	\
+		ctx[n]->f = x[n];					\
+}
+
+// Word "off" of the IV of lane n
+#define IVW(n, off)	U8TO32_LITTLE(ctx[n]->iv + off)
+
+#define IVW_X4(off)	(v4u32){ IVW(0, off), IVW(1, off), IVW(2, off), IVW(3, off) }
+#define IVW_X8(off)	(v8u32){ IVW(0, off), IVW(1, off), IVW(2, off), IVW(3, off),	\
+				 IVW(4, off), IVW(5, off), IVW(6, off), IVW(7, off) }
+#define IVW_X16(off)	(v16u32){ IVW(0, off), IVW(1, off), IVW(2, off), IVW(3, off),	\
+				  IVW(4, off), IVW(5, off), IVW(6, off), IVW(7, off),	\
+				  IVW(8, off), IVW(9, off), IVW(10, off), IVW(11, off),	\
+				  IVW(12, off), IVW(13, off), IVW(14, off), IVW(15, off) }
+
+// IV injection for 4 contexts; ctx[n]->iv holds the zero-padded IV
+static void
+ivsetup_x4_sse2(struct sosemanuk_context *const *ctx, const uint32_t *sk)
+{
+	v4u32 r0, r1, r2, r3, r4;
+
+	r0 = IVW_X4(0);
+	r1 = IVW_X4(4);
+	r2 = IVW_X4(8);
+	r3 = IVW_X4(12);
+
+	SERPENT24_IV(IVS);
+}
+
+static void
+ivsetup_x8_sse2(struct sosemanuk_context *const *ctx, const uint32_t *sk)
+{
+	ivsetup_x4_sse2(ctx, sk);
+	ivsetup_x4_sse2(ctx + 4, sk);
+}
+
+__attribute__((target("avx2")))
+static void
+ivsetup_x8_avx2(struct sosemanuk_context *const *ctx, const uint32_t *sk)
+{
+	v8u32 r0, r1, r2, r3, r4;
+
+	r0 = IVW_X8(0);
+	r1 = IVW_X8(4);
+	r2 = IVW_X8(8);
+	r3 = IVW_X8(12);
+
+	SERPENT24_IV(IVS);
+}
+
+__attribute__((target("avx512f")))
+static void
+ivsetup_x16_avx512(struct sosemanuk_context *const *ctx, const uint32_t *sk)
+{
+	v16u32 r0, r1, r2, r3, r4;
+
+	r0 = IVW_X16(0);
+	r1 = IVW_X16(4);
+	r2 = IVW_X16(8);
+	r3 = IVW_X16(12);
+
+	SERPENT24_IV(IVS);
+}
+
+// XOR loops: widest vector first, the tail byte by byte
+#define XOR_TAIL(out, buf, ks, i, len) {	\
+	for(; i < len; i++)			\
+		out[i] = buf[i] ^ ks[i];	\
+}
+
+static inline __attribute__((always_inline)) void
+xor_sse2(uint8_t *out, const uint8_t *buf, const uint8_t *ks, size_t len)
+{
+	size_t i = 0;
+
+	for(; i + 16 <= len; i += 16)
+		_mm_storeu_si128((__m128i *)(out + i),
+			_mm_xor_si128(_mm_loadu_si128((const __m128i *)(buf + i)),
+				_mm_loadu_si128((const __m128i *)(ks + i))));
+
+	XOR_TAIL(out, buf, ks, i, len);
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void
+xor_avx2(uint8_t *out, const uint8_t *buf, const uint8_t *ks, size_t len)
+{
+	size_t i = 0;
+
+	for(; i + 32 <= len; i += 32)
+		_mm256_storeu_si256((__m256i *)(out + i),
+			_mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(buf + i)),
+				_mm256_loadu_si256((const __m256i *)(ks + i))));
+
+	xor_sse2(out + i, buf + i, ks + i, len - i);
+}
+
+__attribute__((target("avx512f")))
+static inline __attribute__((always_inline)) void
+xor_avx512(uint8_t *out, const uint8_t *buf, const uint8_t *ks, size_t len)
+{
+	size_t i = 0;
+
+	for(; i + 64 <= len; i += 64)
+		_mm512_storeu_si512((void *)(out + i),
+			_mm512_xor_si512(_mm512_loadu_si512((const void *)(buf + i)),
+				_mm512_loadu_si512((const void *)(ks + i))));
+
+	xor_avx2(out + i, buf + i, ks + i, len - i);
+}
+
+/*
+ * XOR with non-temporal stores for outputs much larger than the cache. The
+ * head is XORed with plain stores up to the first aligned address
+*/
+#define XOR_NT(W, STREAM, LOADU, T) {					\
+	size_t i = 0;							\
+	STATS_START(t);							\
+									\
+	for(; i < len && ((uintptr_t)(out + i) & (W - 1)); i++)		\
+		out[i] = buf[i] ^ ks[i];				\
+									\
+	for(; i + W <= len; i += W)					\
+		STREAM((T *)(out + i), XOR(LOADU((const T *)(buf + i)),	\
+			LOADU((const T *)(ks + i))));			\
+									\
+	XOR_TAIL(out, buf, ks, i, len);					\
+	STATS_STOP(t, SOSEMANUK_PHASE_XOR, 1, len);			\
+}
+
+static void
+xor_nt_sse2(uint8_t *out, const uint8_t *buf, const uint8_t *ks, size_t len)
+{
+#define XOR	_mm_xor_si128
+	XOR_NT(16, _mm_stream_si128, _mm_loadu_si128, __m128i);
+#undef XOR
+}
+
+__attribute__((target("avx2")))
+static void
+xor_nt_avx2(uint8_t *out, const uint8_t *buf, const uint8_t *ks, size_t len)
+{
+#define XOR	_mm256_xor_si256
+	XOR_NT(32, _mm256_stream_si256, _mm256_loadu_si256, __m256i);
+#undef XOR
+}
+
+__attribute__((target("avx512f")))
+static void
+xor_nt_avx512(uint8_t *out, const uint8_t *buf, const uint8_t *ks, size_t len)
+{
+#define XOR	_mm512_xor_si512
+	XOR_NT(64, _mm512_stream_si512, _mm512_loadu_si512, __m512i);
+#undef XOR
+}
+
+static void
+store_fence_sse2(void)
+{
+	_mm_sfence();
+}
+
+/*
+ * sosemanuk_crypt with the XOR done in vector registers. The keystream comes
+ * from sosemanuk_generate_keystream_blocks, CRYPT_CHUNK blocks per call, with
+ * the state kept in registers across them; each chunk is then XORed at once
+*/
+#define CRYPT_CHUNK	8
+
+#define CRYPT_BLOCKS(XOR) {						\
+	uint32_t keystream[20 * CRYPT_CHUNK] __attribute__((aligned(64)));	\
+	size_t n;							\
+									\
+	for(; buflen > 0; buflen -= n, buf += n, out += n) {		\
+		n = (buflen < sizeof(keystream)) ? buflen : sizeof(keystream);	\
+		sosemanuk_generate_keystream_blocks(ctx, keystream, (n + 79) / 80);	\
+		STATS_START(t);						\
+		XOR(out, buf, (uint8_t *)keystream, n);			\
+		STATS_STOP(t, SOSEMANUK_PHASE_XOR, 1, n);		\
+	}								\
+}
+
+static void
+xor_bytes_sse2(uint8_t *out, const uint8_t *buf, const uint8_t *ks, size_t len)
+{
+	STATS_START(t);
+	xor_sse2(out, buf, ks, len);
+	STATS_STOP(t, SOSEMANUK_PHASE_XOR, 1, len);
+}
+
+__attribute__((target("avx2")))
+static void
+xor_bytes_avx2(uint8_t *out, const uint8_t *buf, const uint8_t *ks, size_t len)
+{
+	STATS_START(t);
+	xor_avx2(out, buf, ks, len);
+	STATS_STOP(t, SOSEMANUK_PHASE_XOR, 1, len);
+}
+
+__attribute__((target("avx512f")))
+static void
+xor_bytes_avx512(uint8_t *out, const uint8_t *buf, const uint8_t *ks, size_t len)
+{
+	STATS_START(t);
+	xor_avx512(out, buf, ks, len);
+	STATS_STOP(t, SOSEMANUK_PHASE_XOR, 1, len);
+}
+
+static void
+crypt_sse2(struct sosemanuk_context *ctx, const uint8_t *buf, size_t buflen, uint8_t *out)
+{
+	CRYPT_BLOCKS(xor_sse2);
+}
+
+__attribute__((target("avx2")))
+static void
+crypt_avx2(struct sosemanuk_context *ctx, const uint8_t *buf, size_t buflen, uint8_t *out)
+{
+	CRYPT_BLOCKS(xor_avx2);
+}
+
+__attribute__((target("avx512f")))
+static void
+crypt_avx512(struct sosemanuk_context *ctx, const uint8_t *buf, size_t buflen, uint8_t *out)
+{
+	CRYPT_BLOCKS(xor_avx512);
+}
+
+#endif /* SOSEMANUK_X86 */
+
+static void
+keystream_x4_ref(struct sosemanuk_context_x4 *xctx, uint32_t *keystream)
+{
+	keystream_lanes_ref(&xctx->s[0][0], xctx->r1, xctx->r2, 4, keystream, 4, 1);
+}
+
+static void
+keystream_x8_ref(struct sosemanuk_context_x8 *xctx, uint32_t *keystream)
+{
+	keystream_lanes_ref(&xctx->s[0][0], xctx->r1, xctx->r2, 8, keystream, 8, 1);
+}
+
+static void
+keystream_x16_ref(struct sosemanuk_context_x16 *xctx, uint32_t *keystream)
+{
+	keystream_lanes_ref(&xctx->s[0][0], xctx->r1, xctx->r2, 16, keystream, 1, 20);
+}
+
+// Implementations, from the most to the least demanding. The last one runs everywhere
+static const struct sosemanuk_impl impls[] = {
+#ifdef SOSEMANUK_X86
+	{ "avx512", SOSEMANUK_CPU_AVX512 | SOSEMANUK_CPU_AVX2 | SOSEMANUK_CPU_SSE2,
+		crypt_avx512, xor_bytes_avx512, xor_nt_avx512, store_fence_sse2, keystream_x4_sse2, keystream_x8_avx2, keystream_x16_avx512,
+		ivsetup_x4_sse2, ivsetup_x8_avx2, ivsetup_x16_avx512 },
+	{ "avx2", SOSEMANUK_CPU_AVX2 | SOSEMANUK_CPU_SSE2,
+		crypt_avx2, xor_bytes_avx2, xor_nt_avx2, store_fence_sse2, keystream_x4_sse2, keystream_x8_avx2, keystream_x16_avx2,
+		ivsetup_x4_sse2, ivsetup_x8_avx2, NULL },
+	{ "sse2", SOSEMANUK_CPU_SSE2,
+		crypt_sse2, xor_bytes_sse2, xor_nt_sse2, store_fence_sse2, keystream_x4_sse2, keystream_x8_sse2, keystream_x16_sse2,
+		ivsetup_x4_sse2, ivsetup_x8_sse2, NULL },
+#endif
+	{ "scalar", 0,
+		sosemanuk_crypt_ref, sosemanuk_xor_ref, sosemanuk_xor_ref, sosemanuk_store_fence_ref, keystream_x4_ref, keystream_x8_ref, keystream_x16_ref,
+		NULL, NULL, NULL },
+};
+
+#define IMPLS	(sizeof(impls) / sizeof(impls[0]))
+
+const struct sosemanuk_impl *sosemanuk_impl = &impls[IMPLS - 1];
+
+static unsigned int cpu_features;
+
+// Bind the best implementation once, before main()
+__attribute__((constructor))
+static void
+sosemanuk_cpu_init(void)
+{
+#ifdef SOSEMANUK_X86
+	__builtin_cpu_init();
+
+	if(__builtin_cpu_supports("sse2"))
+		cpu_features |= SOSEMANUK_CPU_SSE2;
+	if(__builtin_cpu_supports("avx2"))
+		cpu_features |= SOSEMANUK_CPU_AVX2;
+	if(__builtin_cpu_supports("avx512f"))
+		cpu_features |= SOSEMANUK_CPU_AVX512;
+#endif
+
+	sosemanuk_cpu_select(cpu_features);
+}
+
+// CPU features found at startup (SOSEMANUK_CPU_*)
+unsigned int
+sosemanuk_cpu_features(void)
+{
+	return cpu_features;
+}
+
+/*
+ * Bind the best implementation using only the given features, e.g. to test or
+ * benchmark the fallbacks. Features the CPU does not have are ignored.
+ * Return value: features used by the selected implementation
+*/
+unsigned int
+sosemanuk_cpu_select(unsigned int features)
+{
+	size_t i;
+
+	features &= cpu_features;
+
+	for(i = 0; i < IMPLS - 1; i++) {
+		if((impls[i].features & features) == impls[i].features)
+			break;
+	}
+
+	sosemanuk_impl = &impls[i];
+
+	return impls[i].features;
+}
+
+// Name of the bound implementation ("avx512", "avx2", "sse2" or "scalar")
+const char *
+sosemanuk_impl_name(void)
+{
+	return sosemanuk_impl->name;
+}
+
+void
+sosemanuk_generate_keystream_x4(struct sosemanuk_context_x4 *xctx, uint32_t *keystream)
+{
+	STATS_START(t);
+	sosemanuk_impl->keystream_x4(xctx, keystream);
+	STATS_STOP(t, SOSEMANUK_PHASE_KEYSTREAM, 4, 80 * 4);
+}
+
+void
+sosemanuk_generate_keystream_x8(struct sosemanuk_context_x8 *xctx, uint32_t *keystream)
+{
+	STATS_START(t);
+	sosemanuk_impl->keystream_x8(xctx, keystream);
+	STATS_STOP(t, SOSEMANUK_PHASE_KEYSTREAM, 8, 80 * 8);
+}
+
+void
+sosemanuk_generate_keystream_x16(struct sosemanuk_context_x16 *xctx, uint32_t *keystream)
+{
+	STATS_START(t);
+	sosemanuk_impl->keystream_x16(xctx, keystream);
+	STATS_STOP(t, SOSEMANUK_PHASE_KEYSTREAM, 16, 80 * 16);
+}
+
+/*
+ * Batched IV setup: start n streams under one prepared key
+ * ctx - n contexts to initialize
+ * kctx - key prepared by sosemanuk_set_key
+ * iv - n initialization vectors of ivlen bytes each
+ * Return value: 0 (if all is well), -1 (is all bad)
+*/
+int
+sosemanuk_set_iv_batch(struct sosemanuk_context *const ctx[], const struct sosemanuk_key *kctx, const uint8_t *const iv[], const int ivlen, size_t n)
+{
+	const struct sosemanuk_impl *impl = sosemanuk_impl;
+	size_t lanes = (impl->ivsetup_x4 != NULL) ? n - n % 4 : 0;
+	size_t i = 0;
+	size_t j;
+
+	if((ivlen <= 0) || (ivlen > 16))
+		return -1;
+
+	for(j = 0; j < lanes; j++) {
+		ctx[j]->keylen = kctx->keylen;
+		memcpy(ctx[j]->key, kctx->key, sizeof(ctx[j]->key));
+		ctx[j]->ivlen = ivlen;
+		memset(ctx[j]->iv, 0, sizeof(ctx[j]->iv));
+		memcpy(ctx[j]->iv, iv[j], ivlen);
+		ctx[j]->avail = 0;
+	}
+
+	STATS_START(t);
+
+	for(; impl->ivsetup_x16 && i + 16 <= lanes; i += 16)
+		impl->ivsetup_x16(ctx + i, kctx->sk);
+
+	for(; i + 8 <= lanes; i += 8)
+		impl->ivsetup_x8(ctx + i, kctx->sk);
+
+	for(; i + 4 <= lanes; i += 4)
+		impl->ivsetup_x4(ctx + i, kctx->sk);
+
+	STATS_STOP(t, SOSEMANUK_PHASE_IV_SETUP, lanes, 0);
+
+	for(; i < n; i++)
+		sosemanuk_set_iv(ctx[i], kctx, iv[i], ivlen);
+
+	return 0;
+}
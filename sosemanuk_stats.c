@@ -0,0 +1,155 @@
+/*
+ * Statistics of the library (see sosemanuk_stats.h).
+ * Each thread owns a thread-local block of counters, linked in a global list
+ * the first time it counts. The owner updates its counters with relaxed
+ * atomic stores (no lock, no shared cache line); sosemanuk_stats_get reads
+ * them with relaxed loads. When a thread exits its totals move to
+ * stats_retired.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sosemanuk.h"
+#include "sosemanuk_internal.h"
+#include "sosemanuk_stats.h"
+
+struct stats_thread {
+	struct sosemanuk_stats stats;
+	struct stats_thread *next;
+	int registered;
+};
+
+static __thread struct stats_thread stats_local;
+
+static struct stats_thread *stats_threads;
+static struct sosemanuk_stats stats_retired;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+static sosemanuk_stats_hook stats_hook;
+static void *stats_hook_arg;
+
+static void
+stats_sum(struct sosemanuk_stats *dst, const struct sosemanuk_stats *src)
+{
+	int i;
+
+	for(i = 0; i < SOSEMANUK_PHASES; i++) {
+		dst->count[i] += __atomic_load_n(&src->count[i], __ATOMIC_RELAXED);
+		dst->bytes[i] += __atomic_load_n(&src->bytes[i], __ATOMIC_RELAXED);
+		dst->cycles[i] += __atomic_load_n(&src->cycles[i], __ATOMIC_RELAXED);
+	}
+}
+
+// Thread exit: keep the totals, unlink the counters
+static void
+stats_exit(void *arg)
+{
+	struct stats_thread *t = arg, **p;
+
+	pthread_mutex_lock(&stats_lock);
+
+	stats_sum(&stats_retired, &t->stats);
+	for(p = &stats_threads; *p; p = &(*p)->next) {
+		if(*p == t) {
+			*p = t->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static void
+stats_key_init(void)
+{
+	pthread_key_create(&stats_key, stats_exit);
+}
+
+static void
+stats_register(struct stats_thread *t)
+{
+	pthread_once(&stats_once, stats_key_init);
+
+	pthread_mutex_lock(&stats_lock);
+	t->next = stats_threads;
+	stats_threads = t;
+	pthread_mutex_unlock(&stats_lock);
+
+	pthread_setspecific(stats_key, t);
+	t->registered = 1;
+}
+
+uint64_t
+sosemanuk_stats_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+sosemanuk_stats_add(enum sosemanuk_phase phase, uint64_t count, uint64_t bytes, uint64_t start)
+{
+	struct stats_thread *t = &stats_local;
+	uint64_t cycles = STATS_NOW() - start;
+	sosemanuk_stats_hook hook;
+
+	if(!t->registered)
+		stats_register(t);
+
+	__atomic_store_n(&t->stats.count[phase], t->stats.count[phase] + count, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->stats.bytes[phase], t->stats.bytes[phase] + bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&t->stats.cycles[phase], t->stats.cycles[phase] + cycles, __ATOMIC_RELAXED);
+
+	hook = __atomic_load_n(&stats_hook, __ATOMIC_ACQUIRE);
+	if(hook)
+		hook(phase, count, bytes, cycles, stats_hook_arg);
+}
+
+int
+sosemanuk_stats_enabled(void)
+{
+#ifdef SOSEMANUK_STATS
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+void
+sosemanuk_stats_get(struct sosemanuk_stats *stats)
+{
+	struct stats_thread *t;
+
+	memset(stats, 0, sizeof(*stats));
+
+	pthread_mutex_lock(&stats_lock);
+
+	stats_sum(stats, &stats_retired);
+	for(t = stats_threads; t; t = t->next)
+		stats_sum(stats, &t->stats);
+
+	pthread_mutex_unlock(&stats_lock);
+}
+
+void
+sosemanuk_stats_thread(struct sosemanuk_stats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	stats_sum(stats, &stats_local.stats);
+}
+
+void
+sosemanuk_stats_set_hook(sosemanuk_stats_hook hook, void *arg)
+{
+	stats_hook_arg = arg;
+	__atomic_store_n(&stats_hook, hook, __ATOMIC_RELEASE);
+}
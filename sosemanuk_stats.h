@@ -0,0 +1,47 @@
+/*
+ * Opt-in statistics of the library, compiled in with SOSEMANUK_STATS
+ * (make STATS=1). Every thread counts into its own counters; they are summed
+ * on demand. The phases do not overlap: the cycles of a crypt call are split
+ * between keystream generation and XOR. Cycles are TSC ticks on x86,
+ * nanoseconds elsewhere.
+ * Without SOSEMANUK_STATS nothing is counted and the totals stay zero.
+*/
+
+#ifndef SOSEMANUK_STATS_H
+#define SOSEMANUK_STATS_H
+
+#include <stdint.h>
+
+enum sosemanuk_phase {
+	SOSEMANUK_PHASE_KEY_SETUP,	// count: key schedules
+	SOSEMANUK_PHASE_IV_SETUP,	// count: IV injections
+	SOSEMANUK_PHASE_KEYSTREAM,	// count: blocks, bytes: keystream bytes
+	SOSEMANUK_PHASE_XOR,		// count: XOR calls, bytes: bytes encrypted
+	SOSEMANUK_PHASES
+};
+
+struct sosemanuk_stats {
+	uint64_t count[SOSEMANUK_PHASES];
+	uint64_t bytes[SOSEMANUK_PHASES];
+	uint64_t cycles[SOSEMANUK_PHASES];
+};
+
+/*
+ * Called on every sample by the thread that did the work
+ * count, bytes - as in struct sosemanuk_stats, cycles - time of this sample
+*/
+typedef void (*sosemanuk_stats_hook)(enum sosemanuk_phase phase, uint64_t count, uint64_t bytes, uint64_t cycles, void *arg);
+
+// Return value: 1 (if the library counts), 0 (built without SOSEMANUK_STATS)
+int sosemanuk_stats_enabled(void);
+
+// Totals of all threads, including the threads that have exited
+void sosemanuk_stats_get(struct sosemanuk_stats *stats);
+
+// Totals of the calling thread
+void sosemanuk_stats_thread(struct sosemanuk_stats *stats);
+
+// Install (or remove, hook = NULL) the sample hook. Set it before the cipher threads start
+void sosemanuk_stats_set_hook(sosemanuk_stats_hook hook, void *arg);
+
+#endif
@@ -0,0 +1,151 @@
+// Local encryption daemon for the library sosemanuk.h
+//
+// Loads the keys of a key file, prepares them once and serves clients on a
+// Unix domain socket (protocol in sosemanuk_server.h, client in
+// sosemanuk_client.h). SIGINT or SIGTERM stops the daemon; the keys and the
+// sessions are wiped and the socket is removed.
+//
+// Key file: one key per line, "<key_id>=<hex key>" (1 to 32 bytes); empty
+// lines and lines starting with '#' are skipped.
+//
+// Usage: ./sosemanukd -s socket_path -k key_file [-t threads]
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+
+#include "sosemanuk.h"
+#include "sosemanuk_server.h"
+#include "sosemanuk_hex.h"
+
+static struct sosemanuk_server *server;
+
+static void
+on_signal(int sig)
+{
+	(void)sig;
+	sosemanuk_server_stop(server);
+}
+
+// Return value: number of bytes, -1 (empty, odd length, not hex or longer than max)
+static int
+parse_hex(const char *hex, uint8_t *out, size_t max)
+{
+	size_t len = strlen(hex);
+	ssize_t n;
+
+	if (len == 0 || len % 2 != 0 || len / 2 > max)
+		return -1;
+
+	n = sosemanuk_hex_decode(out, hex, len);
+	if (n < 0)
+		return -1;
+
+	return (int)n;
+}
+
+// Return value: number of keys loaded, -1 (file cannot be read or bad line)
+static int
+load_keys(struct sosemanuk_server *srv, const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	char line[256], *eq, *end;
+	uint8_t key[32];
+	int keylen, count = 0, lineno = 0;
+
+	if (!fp) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		end = line + strcspn(line, "\r\n");
+		*end = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+
+		eq = strchr(line, '=');
+		if (eq)
+			*eq = '\0';
+		keylen = eq ? parse_hex(eq + 1, key, sizeof(key)) : -1;
+		if (keylen < 0 || sosemanuk_server_add_key(srv, line, key, keylen) < 0) {
+			fprintf(stderr, "%s:%d: bad key line\n", path, lineno);
+			count = -1;
+			break;
+		}
+		count++;
+	}
+
+	// The buffers die here: a plain memset would be dropped as a dead store
+	explicit_bzero(line, sizeof(line));
+	explicit_bzero(key, sizeof(key));
+	fclose(fp);
+
+	return count;
+}
+
+static void
+usage(const char *program_name)
+{
+	printf("Usage: %s -s socket_path -k key_file [-t threads]\n", program_name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *socket_path = NULL, *key_file = NULL;
+	struct sigaction sa;
+	int threads = 0, keys, ret;
+
+	for (int i = 1; i < argc; i++) {
+		if (i + 1 >= argc) {
+			usage(argv[0]);
+			return 1;
+		}
+		if (strcmp(argv[i], "-s") == 0) {
+			socket_path = argv[++i];
+		} else if (strcmp(argv[i], "-k") == 0) {
+			key_file = argv[++i];
+		} else if (strcmp(argv[i], "-t") == 0) {
+			threads = atoi(argv[++i]);
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!socket_path || !key_file || threads < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	server = sosemanuk_server_create(socket_path, threads);
+	if (!server) {
+		fprintf(stderr, "Cannot listen on %s\n", socket_path);
+		return 1;
+	}
+
+	keys = load_keys(server, key_file);
+	if (keys < 0) {
+		sosemanuk_server_destroy(server);
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	fprintf(stderr, "Serving %d keys on %s (implementation %s)\n", keys, socket_path, sosemanuk_impl_name());
+
+	ret = sosemanuk_server_run(server);
+	sosemanuk_server_destroy(server);
+
+	return ret < 0 ? 1 : 0;
+}
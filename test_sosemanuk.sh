@@ -1,7 +1,40 @@
 #!/bin/sh
 
-echo "Run time main"
+echo "Run main"
 ./main
+echo "Run self-test"
+./selftest || exit 1
+echo "Run simple_sosemanuk"
+# Plaintext that starts with hex digits but is not all hex is encrypted as text
+tmp=$(mktemp -d) || exit 1
+head -n 2 encrypt_input.txt > "$tmp/enc.txt"
+echo "plaintext=cafe is open" >> "$tmp/enc.txt"
+./simple_sosemanuk -e "$tmp/enc.txt" "$tmp/out.bin" > "$tmp/enc.log" || exit 1
+head -n 2 encrypt_input.txt > "$tmp/dec.txt"
+sed -n 's/^Ciphertext (hex): /ciphertext=/p' "$tmp/enc.log" >> "$tmp/dec.txt"
+./simple_sosemanuk -h "$tmp/dec.txt" | grep -qx "Recovered plaintext: cafe is open" || { echo "simple_sosemanuk text plaintext: FAILED"; rm -rf "$tmp"; exit 1; }
+echo "simple_sosemanuk text plaintext: ok"
+# Containers under one key with related base IVs share no chunk keystream:
+# chunk 1 of base IV 0 and chunk 0 of base IV 1 must differ
+head -c 8192 /dev/zero > "$tmp/zero"
+for b in 0 1; do
+    head -n 1 encrypt_input.txt > "$tmp/key$b.txt"
+    echo "iv=000000000000000${b}0000000000000000" >> "$tmp/key$b.txt"
+    ./simple_sosemanuk -c "$tmp/key$b.txt" "$tmp/zero" "$tmp/c$b" 4096 > /dev/null || exit 1
+done
+if cmp -s -n 4096 -i 4128:32 "$tmp/c0" "$tmp/c1" || cmp -s -n 4096 -i 32:4128 "$tmp/c0" "$tmp/c1"; then
+    echo "simple_sosemanuk container IVs: FAILED"; rm -rf "$tmp"; exit 1
+fi
+./simple_sosemanuk -x "$tmp/key1.txt" "$tmp/c1" "$tmp/plain" > /dev/null && cmp -s "$tmp/plain" "$tmp/zero" || { echo "simple_sosemanuk container: FAILED"; rm -rf "$tmp"; exit 1; }
+# Bytes 8..15 of the container IV hold the chunk index
+echo "iv=00000000000000000000000000000001" >> "$tmp/key0.txt"
+if ./simple_sosemanuk -c "$tmp/key0.txt" "$tmp/zero" "$tmp/c2" > /dev/null; then
+    echo "simple_sosemanuk container IV check: FAILED"; rm -rf "$tmp"; exit 1
+fi
+rm -rf "$tmp"
+echo "simple_sosemanuk container IVs: ok"
+echo "Run benchmark"
+./bench -s 1048576
 echo "Run time developer"
 cd sosemanuk_sources/
 ./main
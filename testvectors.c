@@ -5,22 +5,7 @@
 #include <time.h>
 
 #include "sosemanuk.h"
-
-// Function to convert hex string to bytes
-int hex_to_bytes(const char *hex, uint8_t *bytes, size_t len) {
-    for (size_t i = 0; i < len; i++) {
-        sscanf(hex + 2 * i, "%2hhx", &bytes[i]);
-    }
-    return 0;
-}
-
-// Function to convert bytes to hex string
-void bytes_to_hex(const uint8_t *bytes, size_t len, char *hex) {
-    for (size_t i = 0; i < len; i++) {
-        sprintf(hex + 2 * i, "%02X", bytes[i]);
-    }
-    hex[2 * len] = '\0';
-}
+#include "sosemanuk_hex.h"
 
 // Function to compare two byte arrays
 int compare_bytes(const uint8_t *a, const uint8_t *b, size_t len) {
@@ -47,8 +32,8 @@ main(void)
     int i;
 
     // Convert key and plaintext to hex
-    bytes_to_hex(key, 32, key_hex);
-    // bytes_to_hex(plaintext, 16, plaintext_hex); // Not needed anymore
+    sosemanuk_hex_encode(key_hex, key, 32);
+    // sosemanuk_hex_encode(plaintext_hex, plaintext, 16); // Not needed anymore
 
     // Open files
     remove("test_vector.txt");
@@ -85,10 +70,10 @@ main(void)
         }
 
         // Convert to hex
-        bytes_to_hex(iv, 16, iv_hex);
-        bytes_to_hex(keystream_bytes, 80, keystream_hex);
-        bytes_to_hex(ciphertext, 16, ciphertext_hex);
-        // bytes_to_hex(recovered, 16, recovered_hex); // Not needed
+        sosemanuk_hex_encode(iv_hex, iv, 16);
+        sosemanuk_hex_encode(keystream_hex, keystream_bytes, 80);
+        sosemanuk_hex_encode(ciphertext_hex, ciphertext, 16);
+        // sosemanuk_hex_encode(recovered_hex, recovered, 16); // Not needed
 
         // Write to TXT
         if (fp_txt) {